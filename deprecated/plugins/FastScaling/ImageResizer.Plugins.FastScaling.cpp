@@ -31,17 +31,13 @@ namespace ImageResizer{
 			public ref class FastScalingPlugin : public ImageResizer::Resizing::BuilderExtension, IPlugin, IQuerystringPlugin
 			{
                 void SetupConvolutions(ExecutionContext^ c, NameValueCollection ^query, RenderOptions^ addTo){
-                    //No unsharp mask support until it is higher quality
-          /*          int kernel_radius = (int)GetDouble(query, "f.unsharp.radius", 0);
-                    double unsharp_sigma = GetDouble (query, "f.unsharp.sigma", 1.4);
-                    double threshold = GetDouble (query, "f.unsharp.threshold", 0);
-
-                    if (kernel_radius > 0){
-
-                        addTo->KernelA_Struct = ConvolutionKernel_create_guassian_sharpen (c->GetContext (), unsharp_sigma, kernel_radius);
-
-                    }*/
-
+                    double amount = GetDouble (query, "f.unsharp", 0);
+                    if (amount > 0){
+                        addTo->UnsharpAmount = (float)(amount / 100.0);
+                        addTo->UnsharpSigma = (float)GetDouble (query, "f.unsharp.sigma", 1.4);
+                        //Byte units, summed over channels
+                        addTo->UnsharpThreshold = (float)(GetDouble (query, "f.unsharp.threshold", 0) / 255.0);
+                    }
                 }
 			protected:
 
@@ -148,7 +144,7 @@ namespace ImageResizer{
                         throw gcnew Exception ("&f is deprecated. Used &down.filter instead.");
                     }
 
-                    if (System::String::IsNullOrEmpty (query->Get ("f.sharpen")) && (fastScale == nullptr || fastScale->ToLowerInvariant () != sTrue)){
+                    if (System::String::IsNullOrEmpty (query->Get ("f.sharpen")) && System::String::IsNullOrEmpty (query->Get ("f.unsharp")) && (fastScale == nullptr || fastScale->ToLowerInvariant () != sTrue)){
 						return RequestedAction::None;
 					}
 
@@ -169,14 +165,17 @@ namespace ImageResizer{
                     opts->SharpeningPercentGoal = (float)(GetDouble (query, "f.sharpen", 0) / 200.0);
 
 
-                    bool mayIgnoreAlpha = colorMatrix == nullptr && source->PixelFormat == PixelFormat::Format24bppRgb;
+                    //Grayscale scans stay single-channel all the way through
+                    bool sourceIsGray = WrappedBitmap::HasGrayRampPalette (source);
+
+                    bool mayIgnoreAlpha = colorMatrix == nullptr && (source->PixelFormat == PixelFormat::Format24bppRgb || sourceIsGray);
 
 
                     bool ignorealpha = ImageResizer::ExtensionMethods::NameValueCollectionExtensions::Get<bool> (query, "f.ignorealpha", mayIgnoreAlpha);
 
                     bool sourceFormatInvalid = (source->PixelFormat != PixelFormat::Format32bppArgb &&
                         source->PixelFormat != PixelFormat::Format24bppRgb &&
-                        source->PixelFormat != PixelFormat::Format32bppRgb);
+                        source->PixelFormat != PixelFormat::Format32bppRgb && !sourceIsGray);
 
                     Bitmap^ copy = nullptr;
                     Graphics^ copyGraphics = nullptr;
@@ -246,7 +245,7 @@ namespace ImageResizer{
 				}
 
                 virtual System::Collections::Generic::IEnumerable<System::String^>^ GetSupportedQuerystringKeys (){
-                    return gcnew array < String^, 1 > {"f.sharpen"}; //Only list the keys that would activate image processing by themselves, in the absence of any other commands
+                    return gcnew array < String^, 1 > {"f.sharpen", "f.unsharp"}; //Only list the keys that would activate image processing by themselves, in the absence of any other commands
                 }
 
 			};
@@ -49,6 +49,29 @@ typedef struct {
 
 ProfilingLog * Context_get_profiler_log(Context * context);
 
+/** Context: stage timers **/
+
+//Totals for one render stage. Pixels and bytes are what the stage read, where it reports them.
+typedef struct {
+    //NULL for the stages that didn't fit in the table
+    const char * name;
+    uint64_t calls;
+    uint64_t nanoseconds;
+    uint64_t pixels;
+    uint64_t bytes;
+} StageTimer;
+
+//Accumulates time, calls, pixels and bytes per render stage, across every render on the context. Unlike the
+//profiling log, which records each batch of rows, the table has a fixed size and never fills, so it can be left enabled.
+void Context_enable_stage_timers(Context * context, bool enabled);
+void Context_reset_stage_timers(Context * context);
+
+//Copies up to capacity stages, in order of first use, and returns how many there are
+uint32_t Context_get_stage_timers(Context * context, StageTimer * timers, uint32_t capacity);
+
+//One line per stage, for logs
+const char * Context_stage_timers_summary(Context * context, char * buffer, size_t buffer_size);
+
 
 Context * Context_create(void);
 void Context_destroy(Context * context);
@@ -62,6 +85,52 @@ int  Context_error_reason(Context * context);
 
 void Context_free_static_caches(void);
 
+//Switches the context to an arena heap, for contexts that run one job at a time: allocations are carved from reused
+//chunks of chunk_size bytes (0 for 1MB), and memory only returns to the arena when Context_reset_arena_heap is called.
+//Fails if the context has anything allocated, or already uses another heap. Context_terminate releases the arena.
+bool Context_use_arena_heap(Context * context, size_t chunk_size);
+
+//Discards everything allocated from the arena at once, keeping its chunks for the next job. Nothing allocated before
+//the reset may be used afterwards; that includes the profiling log, which is emptied. Does nothing if the context isn't
+//using an arena.
+void Context_reset_arena_heap(Context * context);
+
+//The bytes the arena currently holds from the system heap
+size_t Context_arena_heap_reserved_bytes(Context * context);
+
+/** Context: memory statistics **/
+
+//Byte counts are as requested, excluding the heap's own overhead
+typedef struct {
+    //Bytes allocated through the context and not yet freed
+    size_t current_bytes;
+    //The highest current_bytes since the context was initialized, or since Context_reset_memory_peak
+    size_t peak_bytes;
+    //Allocations made, including those since freed
+    uint64_t allocation_count;
+    //Allocations not yet freed
+    uint32_t live_allocation_count;
+    size_t largest_allocation;
+} MemoryStats;
+
+//The same, for every allocation made by one line of source
+typedef struct {
+    const char * file;
+    int line;
+    size_t current_bytes;
+    size_t peak_bytes;
+    uint64_t allocation_count;
+} MemorySiteStats;
+
+void Context_get_memory_stats(Context * context, MemoryStats * stats);
+
+//Copies up to site_capacity allocation sites, in order of first allocation, and returns how many there are.
+//Past 128 sites, the rest are counted together under a NULL file.
+uint32_t Context_get_memory_sites(Context * context, MemorySiteStats * sites, uint32_t site_capacity);
+
+//Restarts peak tracking from the current usage, e.g. before each render on a reused context
+void Context_reset_memory_peak(Context * context);
+
 
 //non-indexed bitmap
 typedef struct BitmapBgraStruct {
@@ -70,9 +139,11 @@ typedef struct BitmapBgraStruct {
     uint32_t w;
     //bitmap height in pixels
     uint32_t h;
-    //byte length of each row (may include any amount of padding)
+    //byte length of each row (may include any amount of padding).
+    //BitmapBgra_create rounds it up to a multiple of 64, plus another 64 when that would be a multiple of 512.
     uint32_t stride;
-    //pointer to pixel 0,0; should be of length > h * stride
+    //pointer to pixel 0,0; should be of length > h * stride.
+    //Pixels allocated by BitmapBgra_create start on a 64-byte boundary, and so does every row; borrowed pixels may not.
     unsigned char *pixels;
     //If true, we don't dispose of *pixels when we dispose the struct
     bool borrowed_pixels;
@@ -115,6 +186,8 @@ typedef struct RendererStruct Renderer;
 struct InterpolationDetailsStruct;
 typedef double (*detailed_interpolation_method)(const struct InterpolationDetailsStruct *, double);
 
+struct InterpolationKernelTableStruct;
+
 
 typedef struct InterpolationDetailsStruct {
     //1 is the default; near-zero overlapping between windows. 2 overlaps 50% on each side.
@@ -129,6 +202,10 @@ typedef struct InterpolationDetailsStruct {
     //How much sharpening we are requesting
     float sharpen_percent_goal;
 
+    //Sampled copy of the filter, built by InterpolationDetails_prepare_table. NULL until then.
+    //Ignored (and rebuilt on the next prepare) if window, blur, the coefficients, or filter change afterwards.
+    struct InterpolationKernelTableStruct * table;
+
 } InterpolationDetails;
 
 
@@ -138,7 +215,9 @@ typedef struct ConvolutionKernelStruct {
     uint32_t radius;
     float threshold_min_change; //These change values are on a somewhat arbitrary scale between 0 and 4;
     float threshold_max_change;
-    float * buffer;
+    //If box_radii[0] > 0, rows are blurred by three running-sum box filters of these radii, at a cost per pixel that
+    //doesn't depend on the radius. 'kernel' then holds the equivalent weights, but isn't used to convolve.
+    uint32_t box_radii[3];
 } ConvolutionKernel;
 
 typedef struct RenderDetailsStruct {
@@ -167,6 +246,13 @@ typedef struct RenderDetailsStruct {
     //If greater than 0, a percentage to sharpen the result along each axis;
     float sharpen_percent_goal;
 
+    //If both unsharp_amount and unsharp_sigma are greater than 0, an unsharp mask is applied along each axis after scaling:
+    //every pixel gains unsharp_amount times its difference from a gaussian blur of unsharp_sigma (in output pixels).
+    //Pixels whose difference, summed over channels on the 0..1 scale, is below unsharp_threshold are left alone.
+    float unsharp_sigma;
+    float unsharp_amount;
+    float unsharp_threshold;
+
     //If true, we should apply the color matrix
     bool apply_color_matrix;
 
@@ -181,6 +267,17 @@ typedef struct RenderDetailsStruct {
     //Enables profiling
     bool enable_profiling;
 
+    //If true (the default), Bgra32 rows whose alpha is all 0xFF are processed as 3 channels, skipping premultiplication
+    bool detect_opaque_alpha;
+
+    //Optional. If set, the render counts the source into these histograms as it reads it, exactly as
+    //BitmapBgra_populate_histogram would (counts are added, so zero them first). Halved sources are counted while halving.
+    uint64_t * histograms;
+    uint32_t histogram_size_per_channel;
+    uint32_t histogram_count;
+    //Set by the render to the number of pixels counted
+    uint64_t histogram_pixels_sampled;
+
 } RenderDetails;
 
 
@@ -202,6 +299,7 @@ InterpolationDetails * InterpolationDetails_create_bicubic_custom(Context * cont
 InterpolationDetails * InterpolationDetails_create_custom(Context * context,double window, double blur, detailed_interpolation_method filter);
 InterpolationDetails * InterpolationDetails_create_from(Context * context,InterpolationFilter filter);
 double InterpolationDetails_percent_negative_weight(const InterpolationDetails * details);
+bool InterpolationDetails_prepare_table(Context * context, InterpolationDetails * details);
 void InterpolationDetails_destroy(Context * context, InterpolationDetails *);
 
 uint32_t BitmapPixelFormat_bytes_per_pixel (BitmapPixelFormat format);
@@ -222,6 +320,21 @@ typedef struct {
 LineContributions * LineContributions_create(Context * context, const uint32_t output_line_size, const uint32_t input_line_size, const InterpolationDetails * details);
 void LineContributions_destroy(Context * context, LineContributions * p);
 
+//Returns read-only contributions shared through a process-wide cache, building them on a miss. Pair with LineContributions_release.
+LineContributions * LineContributions_acquire(Context * context, const uint32_t output_line_size, const uint32_t input_line_size, const InterpolationDetails * details);
+void LineContributions_release(Context * context, LineContributions * p);
+//Caps the bytes held by the contributions cache (16MiB by default); 0 disables caching.
+void LineContributions_set_cache_limit(size_t byte_limit);
+
+//Caps the bytes of idle bitmap and row buffers kept for reuse by later renders (64MiB by default); 0 disables pooling.
+//Contexts with a custom heap manager don't use the pool.
+void BufferPool_set_limit(size_t idle_byte_limit);
+//Below the cap, the pool keeps only enough idle buffers to return to the most bytes renders held at once during this
+//trim window or the last (5 seconds by default), so a burst of large renders doesn't pin memory long after it ends.
+void BufferPool_set_trim_window(uint32_t milliseconds);
+//The bytes of idle buffers the pool currently holds
+size_t BufferPool_idle_bytes(void);
+
 ConvolutionKernel * ConvolutionKernel_create(Context * context, uint32_t radius);
 void ConvolutionKernel_destroy(Context * context, ConvolutionKernel * kernel);
 
@@ -232,10 +345,19 @@ double ConvolutionKernel_sum(ConvolutionKernel* kernel);
 void ConvolutionKernel_normalize(ConvolutionKernel* kernel, float desiredSum);
 ConvolutionKernel* ConvolutionKernel_create_guassian_normalized(Context * context, double stdDev, uint32_t radius);
 ConvolutionKernel* ConvolutionKernel_create_guassian_sharpen(Context * context, double stdDev, uint32_t radius);
+//A gaussian blur approximated by three box filters; suited to large radii.
+ConvolutionKernel* ConvolutionKernel_create_box_guassian(Context * context, double stdDev);
 
 
 bool BitmapBgra_populate_histogram (Context * context, BitmapBgra * bmp, uint64_t * histograms, uint32_t histogram_size_per_channel, uint32_t histogram_count, uint64_t * pixels_sampled);
 
+//Samples every sample_step'th pixel of every sample_step'th row; pixels_sampled receives the number of pixels counted.
+//Large bitmaps are split into bands counted on separate threads.
+bool BitmapBgra_populate_histogram_sampled (Context * context, BitmapBgra * bmp, uint64_t * histograms, uint32_t histogram_size_per_channel, uint32_t histogram_count, uint32_t sample_step, uint64_t * pixels_sampled);
+
+//The smallest sample_step that counts at most target_sample_count pixels (1 if target_sample_count is 0)
+uint32_t BitmapBgra_histogram_sample_step (const BitmapBgra * bmp, uint64_t target_sample_count);
+
 
 #ifdef __cplusplus
 }
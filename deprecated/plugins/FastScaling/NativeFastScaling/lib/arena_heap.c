@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//A bump allocator for Contexts that do one job at a time. Small allocations are carved from a list of chunks, which are
+//kept when the arena is reset, so a worker reusing its Context stops calling malloc after its first few renders.
+//Frees only roll back the most recent allocation (the common alloc/free pair around a batch of rows). Allocations too
+//large to share a chunk get a chunk of their own, which is released as soon as they are freed.
+//All chunks come from the buffer pool, so dedicated chunks (float buffers, transposed bitmaps) go back to it for the next
+//render on any Context, and very large ones are mapped in huge pages, just as with the default heap.
+
+#define ARENA_DEFAULT_CHUNK_SIZE (1024 * 1024)
+//Sizes are rounded up to this; allocations themselves start on a HEAP_ALIGNMENT boundary, like the default heap's
+#define ARENA_ALIGNMENT 16
+#define ARENA_ROUND_UP(bytes) (((bytes) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+typedef struct ArenaChunkStruct {
+    struct ArenaChunkStruct * next;
+    struct ArenaChunkStruct * prev;
+    size_t capacity;
+    size_t used;
+} ArenaChunk;
+
+//Immediately precedes every allocation
+typedef struct {
+    //Bytes taken from the chunk before the allocation, for the header and alignment
+    size_t leading;
+    //Rounded size of the allocation
+    size_t size;
+    //Non-NULL if the allocation has the chunk to itself
+    ArenaChunk * dedicated;
+} ArenaAllocationHeader;
+
+#define ARENA_CHUNK_HEADER_SIZE ARENA_ROUND_UP(sizeof(ArenaChunk))
+//The most an allocation can take from a chunk beyond its rounded size
+#define ARENA_ALLOCATION_OVERHEAD (sizeof(ArenaAllocationHeader) + HEAP_ALIGNMENT - 1)
+
+typedef struct {
+    size_t chunk_size;
+    //The head is the chunk being filled
+    ArenaChunk * chunks;
+    //Emptied by resets, waiting to be filled again
+    ArenaChunk * spare;
+    //One per large allocation
+    ArenaChunk * dedicated;
+    size_t reserved_bytes;
+} ArenaHeap;
+
+static uint8_t * ArenaChunk_data(ArenaChunk * chunk)
+{
+    return (uint8_t *)chunk + ARENA_CHUNK_HEADER_SIZE;
+}
+
+static ArenaChunk * ArenaHeap_new_chunk(ArenaHeap * arena, size_t capacity, bool zeroed)
+{
+    ArenaChunk * chunk = (ArenaChunk *)BufferPool_malloc(ARENA_CHUNK_HEADER_SIZE + capacity, zeroed);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->prev = NULL;
+    chunk->capacity = capacity;
+    chunk->used = 0;
+    arena->reserved_bytes += ARENA_CHUNK_HEADER_SIZE + capacity;
+    return chunk;
+}
+
+static void ArenaHeap_free_list(ArenaHeap * arena, ArenaChunk * chunk)
+{
+    while (chunk != NULL) {
+        ArenaChunk * next = chunk->next;
+        arena->reserved_bytes -= ARENA_CHUNK_HEADER_SIZE + chunk->capacity;
+        BufferPool_free(chunk);
+        chunk = next;
+    }
+}
+
+static void * ArenaHeap_allocate(ArenaHeap * arena, size_t byte_count, bool zeroed)
+{
+    if (byte_count > SIZE_MAX - ARENA_ALLOCATION_OVERHEAD - ARENA_CHUNK_HEADER_SIZE - ARENA_ALIGNMENT) {
+        return NULL;
+    }
+    const size_t size = ARENA_ROUND_UP(byte_count);
+    const size_t needed = ARENA_ALLOCATION_OVERHEAD + size;
+    ArenaChunk * chunk;
+    ArenaChunk * dedicated = NULL;
+
+    if (needed > arena->chunk_size / 4) {
+        //The pool only clears reused buffers
+        chunk = ArenaHeap_new_chunk(arena, needed, zeroed);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next = arena->dedicated;
+        if (arena->dedicated != NULL) {
+            arena->dedicated->prev = chunk;
+        }
+        arena->dedicated = chunk;
+        dedicated = chunk;
+    } else {
+        chunk = arena->chunks;
+        //Checked against the worst case for alignment
+        if (chunk == NULL || chunk->capacity - chunk->used < needed) {
+            //Whatever is left of the current chunk goes unused until the next reset
+            if (arena->spare != NULL) {
+                chunk = arena->spare;
+                arena->spare = chunk->next;
+            } else {
+                chunk = ArenaHeap_new_chunk(arena, arena->chunk_size, false);
+                if (chunk == NULL) {
+                    return NULL;
+                }
+            }
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+    }
+    uint8_t * start = ArenaChunk_data(chunk) + chunk->used;
+    uint8_t * data = (uint8_t *)(((uintptr_t)start + sizeof(ArenaAllocationHeader) + HEAP_ALIGNMENT - 1) & ~(uintptr_t)(HEAP_ALIGNMENT - 1));
+    ArenaAllocationHeader * header = (ArenaAllocationHeader *)(data - sizeof(ArenaAllocationHeader));
+    header->leading = (size_t)(data - start);
+    header->size = size;
+    header->dedicated = dedicated;
+    chunk->used += header->leading + size;
+    //Shared chunks are reused, so they can't be assumed zeroed
+    if (zeroed && dedicated == NULL) {
+        memset(data, 0, byte_count);
+    }
+    return data;
+}
+
+static void * ArenaHeap_malloc(struct ContextStruct * context, size_t byte_count, const char * file, int line)
+{
+    return ArenaHeap_allocate((ArenaHeap *)context->heap._private_state, byte_count, false);
+}
+
+static void * ArenaHeap_calloc(struct ContextStruct * context, size_t count, size_t element_size, const char * file, int line)
+{
+    if (element_size != 0 && count > SIZE_MAX / element_size) {
+        return NULL;
+    }
+    return ArenaHeap_allocate((ArenaHeap *)context->heap._private_state, count * element_size, true);
+}
+
+static void ArenaHeap_free(struct ContextStruct * context, void * pointer, const char * file, int line)
+{
+    if (pointer == NULL) {
+        return;
+    }
+    ArenaHeap * arena = (ArenaHeap *)context->heap._private_state;
+    ArenaAllocationHeader * header = (ArenaAllocationHeader *)((uint8_t *)pointer - sizeof(ArenaAllocationHeader));
+    ArenaChunk * dedicated = header->dedicated;
+    if (dedicated != NULL) {
+        if (dedicated->prev != NULL) {
+            dedicated->prev->next = dedicated->next;
+        } else {
+            arena->dedicated = dedicated->next;
+        }
+        if (dedicated->next != NULL) {
+            dedicated->next->prev = dedicated->prev;
+        }
+        arena->reserved_bytes -= ARENA_CHUNK_HEADER_SIZE + dedicated->capacity;
+        BufferPool_free(dedicated);
+        return;
+    }
+    ArenaChunk * chunk = arena->chunks;
+    if (chunk != NULL && (uint8_t *)pointer + header->size == ArenaChunk_data(chunk) + chunk->used) {
+        chunk->used -= header->leading + header->size;
+    }
+}
+
+static void ArenaHeap_terminate(struct ContextStruct * context)
+{
+    ArenaHeap * arena = (ArenaHeap *)context->heap._private_state;
+    ArenaHeap_free_list(arena, arena->chunks);
+    ArenaHeap_free_list(arena, arena->spare);
+    ArenaHeap_free_list(arena, arena->dedicated);
+    free(arena);
+    DefaultHeapManager_initialize(&context->heap);
+}
+
+bool Context_use_arena_heap(Context * context, size_t chunk_size)
+{
+    //Anything already allocated would later be handed to the arena's free; that includes custom heaps, and a second arena
+    if (!DefaultHeapManager_is_installed(&context->heap) || context->memory.totals.live_allocation_count > 0) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+    ArenaHeap * arena = (ArenaHeap *)calloc(1, sizeof(ArenaHeap));
+    if (arena == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return false;
+    }
+    arena->chunk_size = chunk_size == 0 ? ARENA_DEFAULT_CHUNK_SIZE : ARENA_ROUND_UP(chunk_size);
+    context->heap._calloc = ArenaHeap_calloc;
+    context->heap._malloc = ArenaHeap_malloc;
+    context->heap._free = ArenaHeap_free;
+    context->heap._context_terminate = ArenaHeap_terminate;
+    context->heap._private_state = arena;
+    return true;
+}
+
+void Context_reset_arena_heap(Context * context)
+{
+    if (context->heap._free != ArenaHeap_free) {
+        return;
+    }
+    ArenaHeap * arena = (ArenaHeap *)context->heap._private_state;
+    //The profiling log is allocated from the arena too; drop it with everything else, or profiling would write into
+    //whatever reuses its space
+    context->log.log = NULL;
+    context->log.capacity = 0;
+    context->log.count = 0;
+    while (arena->chunks != NULL) {
+        ArenaChunk * chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        chunk->used = 0;
+        chunk->next = arena->spare;
+        arena->spare = chunk;
+    }
+    ArenaHeap_free_list(arena, arena->dedicated);
+    arena->dedicated = NULL;
+    MemoryAccounting_forget_all(&context->memory);
+}
+
+size_t Context_arena_heap_reserved_bytes(Context * context)
+{
+    if (context->heap._free != ArenaHeap_free) {
+        return 0;
+    }
+    return ((ArenaHeap *)context->heap._private_state)->reserved_bytes;
+}
@@ -10,6 +10,7 @@
 #endif
 
 #include "fastscaling_private.h"
+#include "simd.h"
 
 const int MAX_BYTES_PP = 16;
 
@@ -22,7 +23,7 @@ static bool are_valid_bitmap_dimensions(int sx, int sy)
     return (
                sx > 0 && sy > 0 // positive dimensions
                && sx < INT_MAX / sy // no integer overflow
-               && sx * MAX_BYTES_PP < ((INT_MAX - MAX_BYTES_PP) / sy)); // then we can safely check
+               && sx <= ((INT_MAX - MAX_BYTES_PP) / sy - 1) / MAX_BYTES_PP); // sx * MAX_BYTES_PP < that, divided so it can't overflow
 }
 
 
@@ -31,6 +32,21 @@ uint32_t BitmapPixelFormat_bytes_per_pixel (BitmapPixelFormat format)
     return (uint32_t)format;
 }
 
+//Rows are padded to whole cache lines, so they start wherever the (aligned) allocation does. A stride that is a
+//multiple of 512 bytes would map a column of pixels onto 1/8th or less of the L1 sets, and at multiples of 4KB every row
+//aliases every other; one more cache line spreads the rows over all of them.
+//Rounding up and the extra line add at most two lines, so wider rows would wrap around.
+#define BITMAP_MAX_ROW_BYTES (UINT32_MAX - 2 * HEAP_ALIGNMENT)
+
+static uint32_t bitmap_padded_stride(uint32_t row_bytes)
+{
+    uint32_t stride = (row_bytes + HEAP_ALIGNMENT - 1) & ~(uint32_t)(HEAP_ALIGNMENT - 1);
+    if (stride % 512 == 0) {
+        stride += HEAP_ALIGNMENT;
+    }
+    return stride;
+}
+
 
 BitmapBgra * BitmapBgra_create_header(Context * context, int sx, int sy)
 {
@@ -55,6 +71,32 @@ BitmapBgra * BitmapBgra_create_header(Context * context, int sx, int sy)
 }
 
 
+bool BitmapBgra_rows_are_opaque(const BitmapBgra * b, uint32_t from_row, uint32_t row_count)
+{
+    const uint32_t row_bytes = b->w * 4;
+    for (uint32_t y = from_row; y < from_row + row_count; y++) {
+        const uint8_t * row = b->pixels + y * b->stride;
+        uint32_t i = 0;
+#ifdef FASTSCALING_SSE2
+        //Force the color bytes to 0xFF, then every byte must compare equal to 0xFF
+        const __m128i color_bytes = _mm_set1_epi32(0x00FFFFFF);
+        const __m128i all_set = _mm_set1_epi32(-1);
+        for (; i + 16 <= row_bytes; i += 16) {
+            const __m128i pixels = _mm_or_si128(_mm_loadu_si128((const __m128i *)(row + i)), color_bytes);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(pixels, all_set)) != 0xFFFF) {
+                return false;
+            }
+        }
+#endif
+        for (i += 3; i < row_bytes; i += 4) {
+            if (row[i] != 0xFF) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 BitmapBgra * BitmapBgra_create(Context * context, int sx, int sy, bool zeroed, BitmapPixelFormat format)
 {
     BitmapBgra * im = BitmapBgra_create_header(context, sx, sy);
@@ -63,11 +105,22 @@ BitmapBgra * BitmapBgra_create(Context * context, int sx, int sy, bool zeroed, B
         return NULL;
     }
     im->fmt = format;
-    im->stride = im->w * BitmapPixelFormat_bytes_per_pixel(im->fmt);
+    if ((uint64_t)im->w * BitmapPixelFormat_bytes_per_pixel(im->fmt) > BITMAP_MAX_ROW_BYTES) {
+        CONTEXT_free(context, im);
+        CONTEXT_error(context, Invalid_BitmapBgra_dimensions);
+        return NULL;
+    }
+    im->stride = bitmap_padded_stride(im->w * BitmapPixelFormat_bytes_per_pixel(im->fmt));
     im->pixels_readonly = false;
     im->stride_readonly = false;
     im->borrowed_pixels = false;
     im->alpha_meaningful = im->fmt == Bgra32;
+    //Padding can push very narrow, very tall bitmaps past the limit
+    if (im->h > UINT32_MAX / im->stride) {
+        CONTEXT_free(context, im);
+        CONTEXT_error(context, Invalid_BitmapBgra_dimensions);
+        return NULL;
+    }
     if (zeroed) {
         im->pixels = (unsigned char *)CONTEXT_calloc(context, im->h * im->stride, sizeof(unsigned char));
     } else {
@@ -97,6 +150,7 @@ BitmapFloat * BitmapFloat_create_header(Context* context,int sx, int sy, int cha
 
     if (!are_valid_bitmap_dimensions(sx, sy)) {
         CONTEXT_error(context, Invalid_BitmapFloat_dimensions);
+        return NULL;
     }
 
     im = (BitmapFloat *)CONTEXT_calloc(context,1,sizeof(BitmapFloat));
@@ -125,6 +179,18 @@ BitmapFloat * BitmapFloat_create(Context* context, int sx, int sy, int channels,
         return NULL;
     }
     im->pixels_borrowed = false;
+    if ((uint64_t)im->w * (uint32_t)im->channels > BITMAP_MAX_ROW_BYTES / sizeof(float)) {
+        CONTEXT_free(context, im);
+        CONTEXT_error(context, Invalid_BitmapFloat_dimensions);
+        return NULL;
+    }
+    im->float_stride = bitmap_padded_stride(im->float_stride * sizeof(float)) / sizeof(float);
+    if (im->h > UINT32_MAX / sizeof(float) / im->float_stride) {
+        CONTEXT_free(context, im);
+        CONTEXT_error(context, Invalid_BitmapFloat_dimensions);
+        return NULL;
+    }
+    im->float_count = im->float_stride * im->h;
     if (zeroed) {
         im->pixels = (float*)CONTEXT_calloc(context,im->float_count, sizeof(float));
     } else {
@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+#include "concurrency.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+//Process-wide pool of large buffers, behind the default HeapManager.
+//Bitmaps, row buffers and contributions are all allocated through the Context, so renders in any thread hand their
+//transposed, halving and scaling buffers back here instead of to the system, and the next render skips the page faults.
+//Requests are rounded up to size classes four per power of two apart, wasting at most a fifth. Idle buffers are freed,
+//least recently returned first, beyond what it would take to get back to the high-water mark: the most pooled bytes in
+//use at once during this trim window or the last. A fixed limit caps them regardless. Trimming happens as buffers are
+//returned, so a pool left idle keeps its buffers until the next render, or BufferPool_clear.
+//Every allocation carries a small header recording its class; allocations smaller than a class bypass the pool.
+//Data is aligned to HEAP_ALIGNMENT within a slightly larger malloc/calloc block, so fresh zeroed buffers still come from calloc.
+//Buffers too large to be worth keeping (panoramas, print scans) are mapped straight from the OS instead, in huge pages
+//where it allows, and unmapped when freed. Mapped pages are already zero, and huge pages cut the page faults and the TLB
+//misses of walking them column by column during transposition.
+
+#define BUFFER_POOL_MIN_SIZE (64 * 1024)
+//The largest class holds 7 * 2^29 bytes; larger allocations bypass the pool
+#define BUFFER_POOL_CLASSES 64
+#define BUFFER_POOL_DEFAULT_LIMIT (64 * 1024 * 1024)
+#define BUFFER_POOL_DEFAULT_TRIM_WINDOW_MS 5000
+#define BUFFER_NOT_POOLED UINT32_MAX
+#define BUFFER_MAPPED (UINT32_MAX - 1)
+//As large as the default pool limit; a buffer this size would evict everything else
+#define BUFFER_MAPPED_MIN_SIZE ((size_t)64 * 1024 * 1024)
+#define BUFFER_HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+//Immediately precedes the data
+typedef struct {
+    //What malloc or calloc returned, or the start of the mapping
+    void * block;
+    //The class size, or the length of the mapping
+    size_t size;
+    uint32_t pool_class;
+    uint32_t reserved;
+} BufferHeader;
+
+//Room for the header and for aligning the data after it
+#define BUFFER_OVERHEAD (sizeof(BufferHeader) + HEAP_ALIGNMENT - 1)
+
+//Lives in the data of an idle buffer
+typedef struct IdleBufferStruct {
+    struct IdleBufferStruct * newer;
+    struct IdleBufferStruct * older;
+    int64_t returned_at;
+} IdleBuffer;
+
+typedef struct {
+    IdleBuffer * newest;
+    IdleBuffer * oldest;
+} IdleBufferList;
+
+//Protected by pool_lock
+static IdleBufferList pool_classes[BUFFER_POOL_CLASSES];
+static size_t pool_idle_bytes = 0;
+static size_t pool_limit = BUFFER_POOL_DEFAULT_LIMIT;
+static int64_t pool_clock = 0;
+//Pooled buffers handed out and not yet returned, and the most of them at once during the current and previous windows
+static size_t pool_in_use_bytes = 0;
+static size_t pool_window_peak = 0;
+static size_t pool_previous_window_peak = 0;
+static int64_t pool_window_start = 0;
+static uint32_t pool_trim_window_ms = BUFFER_POOL_DEFAULT_TRIM_WINDOW_MS;
+static SpinLock pool_lock = SPINLOCK_INIT;
+
+static size_t BufferPool_class_size(uint32_t pool_class)
+{
+    return (size_t)(4 + pool_class % 4) << (pool_class / 4 + 14);
+}
+
+static uint32_t BufferPool_class_for(size_t byte_count)
+{
+    if (byte_count < BUFFER_POOL_MIN_SIZE) {
+        return BUFFER_NOT_POOLED;
+    }
+    for (uint32_t c = 0; c < BUFFER_POOL_CLASSES; c++) {
+        if (BufferPool_class_size(c) >= byte_count) {
+            return c;
+        }
+    }
+    return BUFFER_NOT_POOLED;
+}
+
+static BufferHeader * BufferHeader_of(void * pointer)
+{
+    return (BufferHeader *)((uint8_t *)pointer - sizeof(BufferHeader));
+}
+
+static void IdleBufferList_remove(IdleBufferList * list, IdleBuffer * idle)
+{
+    if (idle->newer != NULL) {
+        idle->newer->older = idle->older;
+    } else {
+        list->newest = idle->older;
+    }
+    if (idle->older != NULL) {
+        idle->older->newer = idle->newer;
+    } else {
+        list->oldest = idle->newer;
+    }
+}
+
+//Lock must be held. Detaches the least recently returned buffer; the caller frees it after unlocking.
+static BufferHeader * BufferPool_evict_oldest(void)
+{
+    IdleBufferList * oldest_list = NULL;
+    for (uint32_t c = 0; c < BUFFER_POOL_CLASSES; c++) {
+        IdleBuffer * candidate = pool_classes[c].oldest;
+        if (candidate != NULL && (oldest_list == NULL || candidate->returned_at < oldest_list->oldest->returned_at)) {
+            oldest_list = &pool_classes[c];
+        }
+    }
+    if (oldest_list == NULL) {
+        return NULL;
+    }
+    IdleBuffer * idle = oldest_list->oldest;
+    IdleBufferList_remove(oldest_list, idle);
+    BufferHeader * header = BufferHeader_of(idle);
+    pool_idle_bytes -= header->size;
+    return header;
+}
+
+//Lock must be held. Chains evicted buffers through their data for freeing after unlocking.
+static IdleBuffer * BufferPool_shrink_to(size_t byte_limit)
+{
+    IdleBuffer * garbage = NULL;
+    while (pool_idle_bytes > byte_limit) {
+        BufferHeader * header = BufferPool_evict_oldest();
+        if (header == NULL) {
+            break;
+        }
+        IdleBuffer * idle = (IdleBuffer *)((uint8_t *)header + sizeof(BufferHeader));
+        idle->older = garbage;
+        garbage = idle;
+    }
+    return garbage;
+}
+
+//Lock must be held. Call before changing pool_in_use_bytes.
+static void BufferPool_advance_window(void)
+{
+    const int64_t now = get_high_precision_ticks();
+    const int64_t window = get_profiler_ticks_per_second() * pool_trim_window_ms / 1000;
+    if (now - pool_window_start >= window) {
+        //Nothing changed during windows that passed without calls
+        pool_previous_window_peak = now - pool_window_start >= 2 * window ? pool_in_use_bytes : pool_window_peak;
+        pool_window_peak = pool_in_use_bytes;
+        pool_window_start = now;
+    }
+}
+
+//Lock must be held
+static size_t BufferPool_idle_bytes_wanted(void)
+{
+    const size_t high_water = pool_window_peak > pool_previous_window_peak ? pool_window_peak : pool_previous_window_peak;
+    const size_t wanted = high_water > pool_in_use_bytes ? high_water - pool_in_use_bytes : 0;
+    return wanted < pool_limit ? wanted : pool_limit;
+}
+
+static void BufferPool_free_list(IdleBuffer * garbage)
+{
+    while (garbage != NULL) {
+        IdleBuffer * next = garbage->older;
+        free(BufferHeader_of(garbage)->block);
+        garbage = next;
+    }
+}
+
+//Returns the data, HEAP_ALIGNMENT bytes into the mapping, or NULL to fall back to malloc
+static void * BufferPool_map(size_t byte_count)
+{
+    if (byte_count > SIZE_MAX - HEAP_ALIGNMENT - BUFFER_HUGE_PAGE_SIZE) {
+        return NULL;
+    }
+    //Whole huge pages, so the tail gets one too
+    const size_t length = (byte_count + HEAP_ALIGNMENT + BUFFER_HUGE_PAGE_SIZE - 1) & ~(BUFFER_HUGE_PAGE_SIZE - 1);
+#ifdef _WIN32
+    //Large pages need a privilege services rarely hold; committed pages are zeroed on first touch
+    void * block = VirtualAlloc(NULL, length, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (block == NULL) {
+        return NULL;
+    }
+#else
+    void * block = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    //Only succeeds if the administrator reserved huge pages, and then they are ours up front
+    block = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (block == MAP_FAILED) {
+        block = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        //Transparent huge pages back whichever 2MB-aligned ranges the mapping covers; failure just means small pages
+        madvise(block, length, MADV_HUGEPAGE);
+#endif
+    }
+#endif
+    BufferHeader * header = (BufferHeader *)((uint8_t *)block + HEAP_ALIGNMENT - sizeof(BufferHeader));
+    header->block = block;
+    header->size = length;
+    header->pool_class = BUFFER_MAPPED;
+    header->reserved = 0;
+    return (uint8_t *)block + HEAP_ALIGNMENT;
+}
+
+static void BufferPool_unmap(BufferHeader * header)
+{
+#ifdef _WIN32
+    VirtualFree(header->block, 0, MEM_RELEASE);
+#else
+    munmap(header->block, header->size);
+#endif
+}
+
+bool BufferPool_is_mapped(void * pointer)
+{
+    return BufferHeader_of(pointer)->pool_class == BUFFER_MAPPED;
+}
+
+void * BufferPool_malloc(size_t byte_count, bool zeroed)
+{
+    if (byte_count >= BUFFER_MAPPED_MIN_SIZE) {
+        //Fresh pages are zero, so there is nothing to clear
+        void * mapped = BufferPool_map(byte_count);
+        if (mapped != NULL) {
+            return mapped;
+        }
+    }
+    const uint32_t pool_class = BufferPool_class_for(byte_count);
+    if (pool_class != BUFFER_NOT_POOLED) {
+        IdleBuffer * idle = NULL;
+        SpinLock_acquire(&pool_lock);
+        IdleBufferList * list = &pool_classes[pool_class];
+        if (list->newest != NULL) {
+            idle = list->newest;
+            IdleBufferList_remove(list, idle);
+            pool_idle_bytes -= BufferPool_class_size(pool_class);
+        }
+        //Counted before allocating a fresh buffer too, and taken back if that fails
+        BufferPool_advance_window();
+        pool_in_use_bytes += BufferPool_class_size(pool_class);
+        pool_window_peak = pool_in_use_bytes > pool_window_peak ? pool_in_use_bytes : pool_window_peak;
+        SpinLock_release(&pool_lock);
+        if (idle != NULL) {
+            if (zeroed) {
+                memset(idle, 0, byte_count);
+            }
+            return idle;
+        }
+    }
+    const size_t size = pool_class != BUFFER_NOT_POOLED ? BufferPool_class_size(pool_class) : byte_count;
+    if (size > SIZE_MAX - BUFFER_OVERHEAD) {
+        return NULL;
+    }
+    //Fresh memory from calloc is often zeroed by the OS already
+    void * block = zeroed ? calloc(1, BUFFER_OVERHEAD + size) : malloc(BUFFER_OVERHEAD + size);
+    if (block == NULL) {
+        if (pool_class != BUFFER_NOT_POOLED) {
+            SpinLock_acquire(&pool_lock);
+            pool_in_use_bytes -= size;
+            SpinLock_release(&pool_lock);
+        }
+        return NULL;
+    }
+    const uintptr_t data = ((uintptr_t)block + sizeof(BufferHeader) + HEAP_ALIGNMENT - 1) & ~(uintptr_t)(HEAP_ALIGNMENT - 1);
+    BufferHeader * header = BufferHeader_of((void *)data);
+    header->block = block;
+    header->size = size;
+    header->pool_class = pool_class;
+    header->reserved = 0;
+    return (void *)data;
+}
+
+void BufferPool_free(void * pointer)
+{
+    if (pointer == NULL) {
+        return;
+    }
+    BufferHeader * header = BufferHeader_of(pointer);
+    if (header->pool_class == BUFFER_MAPPED) {
+        BufferPool_unmap(header);
+        return;
+    }
+    if (header->pool_class == BUFFER_NOT_POOLED) {
+        free(header->block);
+        return;
+    }
+    IdleBuffer * idle = (IdleBuffer *)pointer;
+    SpinLock_acquire(&pool_lock);
+    IdleBufferList * list = &pool_classes[header->pool_class];
+    idle->returned_at = ++pool_clock;
+    idle->newer = NULL;
+    idle->older = list->newest;
+    if (list->newest != NULL) {
+        list->newest->newer = idle;
+    } else {
+        list->oldest = idle;
+    }
+    list->newest = idle;
+    pool_idle_bytes += header->size;
+    BufferPool_advance_window();
+    pool_in_use_bytes -= header->size;
+    IdleBuffer * garbage = BufferPool_shrink_to(BufferPool_idle_bytes_wanted());
+    SpinLock_release(&pool_lock);
+    BufferPool_free_list(garbage);
+}
+
+void BufferPool_set_limit(size_t idle_byte_limit)
+{
+    SpinLock_acquire(&pool_lock);
+    pool_limit = idle_byte_limit;
+    IdleBuffer * garbage = BufferPool_shrink_to(idle_byte_limit);
+    SpinLock_release(&pool_lock);
+    BufferPool_free_list(garbage);
+}
+
+void BufferPool_set_trim_window(uint32_t milliseconds)
+{
+    SpinLock_acquire(&pool_lock);
+    pool_trim_window_ms = milliseconds;
+    SpinLock_release(&pool_lock);
+}
+
+size_t BufferPool_idle_bytes(void)
+{
+    SpinLock_acquire(&pool_lock);
+    const size_t bytes = pool_idle_bytes;
+    SpinLock_release(&pool_lock);
+    return bytes;
+}
+
+void BufferPool_clear(void)
+{
+    SpinLock_acquire(&pool_lock);
+    IdleBuffer * garbage = BufferPool_shrink_to(0);
+    SpinLock_release(&pool_lock);
+    BufferPool_free_list(garbage);
+}
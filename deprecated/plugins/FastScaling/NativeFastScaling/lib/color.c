@@ -10,6 +10,7 @@
 #endif
 
 #include "fastscaling_private.h"
+#include "simd.h"
 
 
 bool BitmapFloat_linear_to_luv_rows(Context * context, BitmapFloat * bit, const uint32_t start_row, const  uint32_t row_count)
@@ -18,16 +19,13 @@ bool BitmapFloat_linear_to_luv_rows(Context * context, BitmapFloat * bit, const
         CONTEXT_error(context, Invalid_internal_state); //Don't access rows past the end of the bitmap
         return false;
     }
-    if ((bit->w * bit->channels) != bit->float_stride) {
-        CONTEXT_error(context, Invalid_internal_state); //This algorithm can't handle padding, if present
-        return false;
-    }
-    float * start_at = bit->float_stride * start_row  + bit->pixels;
-
-    const float * end_at = bit->float_stride * (start_row + row_count) + bit->pixels;
-
-    for (float* pix = start_at; pix < end_at; pix++) {
-        linear_to_luv(pix);
+    //Rows may be padded
+    for (uint32_t row = start_row; row < start_row + row_count; row++) {
+        float * start_at = bit->float_stride * row + bit->pixels;
+        const float * end_at = start_at + bit->w * bit->channels;
+        for (float* pix = start_at; pix < end_at; pix += bit->channels) {
+            linear_to_luv(pix);
+        }
     }
     return true;
 }
@@ -38,16 +36,12 @@ bool BitmapFloat_luv_to_linear_rows(Context * context, BitmapFloat * bit, const
         CONTEXT_error(context, Invalid_internal_state);
         return false;
     }
-    if ((bit->w * bit->channels) != bit->float_stride) {
-        CONTEXT_error(context, Invalid_internal_state);
-        return false;
-    }
-    float * start_at = bit->float_stride * start_row + bit->pixels;
-
-    const float * end_at = bit->float_stride * (start_row + row_count) + bit->pixels;
-
-    for (float* pix = start_at; pix < end_at; pix++) {
-        luv_to_linear(pix);
+    for (uint32_t row = start_row; row < start_row + row_count; row++) {
+        float * start_at = bit->float_stride * row + bit->pixels;
+        const float * end_at = start_at + bit->w * bit->channels;
+        for (float* pix = start_at; pix < end_at; pix += bit->channels) {
+            luv_to_linear(pix);
+        }
     }
     return true;
 }
@@ -60,6 +54,37 @@ bool BitmapBgra_apply_color_matrix(Context * context, BitmapBgra * bmp, const ui
     const uint32_t ch = BitmapPixelFormat_bytes_per_pixel(bmp->fmt);
     const uint32_t w = bmp->w;
     const uint32_t h = umin(row + count, bmp->h);
+    ColorMatrixBgra cm;
+    ColorMatrixBgra_init(&cm, m);
+    if (cm.kind == ColorMatrix_identity && ch != 1) {
+        return true;
+    }
+    //Every output byte depends on a single input byte, so each channel becomes a lookup table
+    if (ch == 1 || (cm.kind == ColorMatrix_diagonal && (ch == 3 || ch == 4))) {
+        uint8_t lut[4][256];
+        for (uint32_t v = 0; v < 256; v++) {
+            if (ch == 1) {
+                //Gray is treated as r=g=b; the result is reduced back to its luma
+                const float r = (m[0][0] + m[1][0] + m[2][0]) * v + m[4][0];
+                const float g = (m[0][1] + m[1][1] + m[2][1]) * v + m[4][1];
+                const float b = (m[0][2] + m[1][2] + m[2][2]) * v + m[4][2];
+                lut[0][v] = uchar_clamp_ff(linear_luma(b, g, r));
+            } else {
+                for (uint32_t c = 0; c < ch; c++) {
+                    lut[c][v] = uchar_clamp_ff(cm.m[c][c] * v + cm.offset[c]);
+                }
+            }
+        }
+        for (uint32_t y = row; y < h; y++) {
+            uint8_t * const __restrict data = bmp->pixels + stride * y;
+            for (uint32_t i = 0; i < w * ch; i += ch) {
+                for (uint32_t c = 0; c < ch; c++) {
+                    data[i + c] = lut[c][data[i + c]];
+                }
+            }
+        }
+        return true;
+    }
     if (ch == 4) {
 
         for (uint32_t y = row; y < h; y++)
@@ -100,48 +125,177 @@ bool BitmapBgra_apply_color_matrix(Context * context, BitmapBgra * bmp, const ui
 }
 
 
-bool BitmapFloat_apply_color_matrix(Context * context, BitmapFloat * bmp, const uint32_t row, const uint32_t count, float*  m[5])
+void ColorMatrixBgra_init(ColorMatrixBgra * cm, float * const __restrict m[5])
+{
+    //Which RGBA row/column of m each BGRA channel corresponds to
+    static const int rgba_index[4] = { 2, 1, 0, 3 };
+    for (int in = 0; in < 4; in++) {
+        for (int out = 0; out < 4; out++) {
+            cm->m[in][out] = m[rgba_index[in]][rgba_index[out]];
+        }
+    }
+    for (int out = 0; out < 4; out++) {
+        cm->offset[out] = m[4][rgba_index[out]];
+    }
+    bool diagonal = true;
+    bool identity = true;
+    for (int in = 0; in < 4; in++) {
+        for (int out = 0; out < 4; out++) {
+            diagonal = diagonal && (in == out || cm->m[in][out] == 0);
+        }
+        identity = identity && cm->m[in][in] == 1 && cm->offset[in] == 0;
+    }
+    cm->kind = !diagonal ? ColorMatrix_general : (identity ? ColorMatrix_identity : ColorMatrix_diagonal);
+}
+
+//out = in * scale + offset, per channel
+static void apply_diagonal_color_matrix_rows(BitmapFloat * bmp, const uint32_t row, const uint32_t h, const ColorMatrixBgra * cm)
+{
+    const uint32_t ch = bmp->channels;
+    const float scale[4] = { cm->m[0][0], cm->m[1][1], cm->m[2][2], cm->m[3][3] };
+#ifdef FASTSCALING_SSE2
+    const bool use_sse2 = ch == 4 && simd_level() >= Simd_sse2;
+    const __m128 scale4 = _mm_loadu_ps(scale);
+    const __m128 offset4 = _mm_loadu_ps(cm->offset);
+#endif
+    for (uint32_t y = row; y < h; y++) {
+        float * const __restrict data = bmp->pixels + bmp->float_stride * y;
+        const uint32_t count = bmp->w * ch;
+        uint32_t i = 0;
+#ifdef FASTSCALING_SSE2
+        if (use_sse2) {
+            for (; i < count; i += 4) {
+                _mm_storeu_ps(data + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(data + i), scale4), offset4));
+            }
+        }
+#endif
+        for (; i < count; i += ch) {
+            for (uint32_t c = 0; c < ch; c++) {
+                data[i + c] = data[i + c] * scale[c] + cm->offset[c];
+            }
+        }
+    }
+}
+
+#ifdef FASTSCALING_AVX2
+//Two pixels per iteration; returns how many pixels were handled
+static AVX2_FUNCTION uint32_t apply_color_matrix_row_avx2(float * data, const uint32_t w, const ColorMatrixBgra * cm)
+{
+    const __m256 row_b = _mm256_broadcast_ps((const __m128 *)cm->m[0]);
+    const __m256 row_g = _mm256_broadcast_ps((const __m128 *)cm->m[1]);
+    const __m256 row_r = _mm256_broadcast_ps((const __m128 *)cm->m[2]);
+    const __m256 row_a = _mm256_broadcast_ps((const __m128 *)cm->m[3]);
+    const __m256 offset = _mm256_broadcast_ps((const __m128 *)cm->offset);
+    uint32_t x = 0;
+    for (; x + 2 <= w; x += 2) {
+        const __m256 p = _mm256_loadu_ps(data + x * 4);
+        __m256 acc = _mm256_fmadd_ps(_mm256_permute_ps(p, _MM_SHUFFLE(2, 2, 2, 2)), row_r, offset);
+        acc = _mm256_fmadd_ps(_mm256_permute_ps(p, _MM_SHUFFLE(1, 1, 1, 1)), row_g, acc);
+        acc = _mm256_fmadd_ps(_mm256_permute_ps(p, _MM_SHUFFLE(0, 0, 0, 0)), row_b, acc);
+        acc = _mm256_fmadd_ps(_mm256_permute_ps(p, _MM_SHUFFLE(3, 3, 3, 3)), row_a, acc);
+        _mm256_storeu_ps(data + x * 4, acc);
+    }
+    return x;
+}
+#endif
+
+bool BitmapFloat_apply_color_matrix_bgra(Context * context, BitmapFloat * bmp, const uint32_t row, const uint32_t count, const ColorMatrixBgra * cm)
 {
     const uint32_t stride = bmp->float_stride;
     const uint32_t ch = bmp->channels;
     const uint32_t w = bmp->w;
     const uint32_t h = umin(row + count,bmp->h);
+    if (cm->kind == ColorMatrix_identity && ch != 1) {
+        return true;
+    }
+    if (cm->kind == ColorMatrix_diagonal && (ch == 3 || ch == 4)) {
+        apply_diagonal_color_matrix_rows(bmp, row, h, cm);
+        return true;
+    }
     switch (ch) {
     case 4: {
-        for (uint32_t y = row; y < h; y++)
-            for (uint32_t x = 0; x < w; x++) {
-                float* const __restrict data = bmp->pixels + stride * y + x * ch;
-
-                const float r = (m[0][0] * data[2] + m[1][0] * data[1] + m[2][0] * data[0] + m[3][0] * data[3] + m[4][0]);
-                const float g = (m[0][1] * data[2] + m[1][1] * data[1] + m[2][1] * data[0] + m[3][1] * data[3] + m[4][1]);
-                const float b = (m[0][2] * data[2] + m[1][2] * data[1] + m[2][2] * data[0] + m[3][2] * data[3] + m[4][2]);
-                const float a = (m[0][3] * data[2] + m[1][3] * data[1] + m[2][3] * data[0] + m[3][3] * data[3] + m[4][3]);
-
-                float * newdata = bmp->pixels + stride * y + x * ch;
-                newdata[0] = b;
-                newdata[1] = g;
-                newdata[2] = r;
-                newdata[3] = a;
-
+#if defined(FASTSCALING_SSE2) || defined(FASTSCALING_AVX2)
+        const SimdLevel simd = simd_level();
+#endif
+        for (uint32_t y = row; y < h; y++) {
+            float * const data = bmp->pixels + stride * y;
+            uint32_t x = 0;
+#ifdef FASTSCALING_AVX2
+            if (simd >= Simd_avx2) {
+                x = apply_color_matrix_row_avx2(data, w, cm);
+            }
+#endif
+#ifdef FASTSCALING_SSE2
+            //Broadcast each input channel and accumulate whole output pixels
+            const __m128 row_b = _mm_loadu_ps(cm->m[0]);
+            const __m128 row_g = _mm_loadu_ps(cm->m[1]);
+            const __m128 row_r = _mm_loadu_ps(cm->m[2]);
+            const __m128 row_a = _mm_loadu_ps(cm->m[3]);
+            const __m128 offset = _mm_loadu_ps(cm->offset);
+            for (; simd >= Simd_sse2 && x < w; x++) {
+                const __m128 p = _mm_loadu_ps(data + x * 4);
+                __m128 acc = _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2)), row_r);
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)), row_g));
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(0, 0, 0, 0)), row_b));
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 3, 3, 3)), row_a));
+                _mm_storeu_ps(data + x * 4, _mm_add_ps(acc, offset));
             }
+#endif
+            for (; x < w; x++) {
+                float * const __restrict pixel = data + x * 4;
+                const float b = pixel[0], g = pixel[1], r = pixel[2], a = pixel[3];
+                for (int out = 0; out < 4; out++) {
+                    pixel[out] = r * cm->m[2][out] + g * cm->m[1][out] + b * cm->m[0][out] + a * cm->m[3][out] + cm->offset[out];
+                }
+            }
+        }
         return true;
     }
     case 3: {
-
-        for (uint32_t y = row; y < h; y++)
+#ifdef FASTSCALING_SSE2
+        const SimdLevel simd = simd_level();
+#endif
+        for (uint32_t y = row; y < h; y++) {
+            float * const data = bmp->pixels + stride * y;
+            uint32_t x = 0;
+#ifdef FASTSCALING_SSE2
+            const __m128 row_b = _mm_loadu_ps(cm->m[0]);
+            const __m128 row_g = _mm_loadu_ps(cm->m[1]);
+            const __m128 row_r = _mm_loadu_ps(cm->m[2]);
+            const __m128 offset = _mm_loadu_ps(cm->offset);
+            //Each load also picks up the next pixel's first channel; it is never used, and only 3 floats are stored
+            for (; simd >= Simd_sse2 && x + 1 < w; x++) {
+                const __m128 p = _mm_loadu_ps(data + x * 3);
+                __m128 acc = _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2)), row_r);
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)), row_g));
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(0, 0, 0, 0)), row_b));
+                acc = _mm_add_ps(acc, offset);
+                _mm_storel_pi((__m64 *)(data + x * 3), acc);
+                _mm_store_ss(data + x * 3 + 2, _mm_movehl_ps(acc, acc));
+            }
+#endif
+            for (; x < w; x++) {
+                float * const __restrict pixel = data + x * 3;
+                const float b = pixel[0], g = pixel[1], r = pixel[2];
+                for (int out = 0; out < 3; out++) {
+                    pixel[out] = r * cm->m[2][out] + g * cm->m[1][out] + b * cm->m[0][out] + cm->offset[out];
+                }
+            }
+        }
+        return true;
+    }
+    case 1: {
+        //Gray is treated as r=g=b; the result is reduced back to its luma
+        const float b_coeff = cm->m[0][0] + cm->m[1][0] + cm->m[2][0];
+        const float g_coeff = cm->m[0][1] + cm->m[1][1] + cm->m[2][1];
+        const float r_coeff = cm->m[0][2] + cm->m[1][2] + cm->m[2][2];
+        for (uint32_t y = row; y < h; y++) {
+            float* const __restrict data = bmp->pixels + stride * y;
             for (uint32_t x = 0; x < w; x++) {
-
-                float* const __restrict data = bmp->pixels + stride * y + x * ch;
-
-                const float  r =  (m[0][0] * data[2] + m[1][0] * data[1] + m[2][0] * data[0] + m[4][0]);
-                const float g =  (m[0][1] * data[2] + m[1][1] * data[1] + m[2][1] * data[0] + m[4][1]);
-                const float b = (m[0][2] * data[2] + m[1][2] * data[1] + m[2][2] * data[0] + m[4][2]);
-
-                float * newdata = bmp->pixels + stride * y + x * ch;
-                newdata[0] = b;
-                newdata[1] = g;
-                newdata[2] = r;
+                const float v = data[x];
+                data[x] = linear_luma(b_coeff * v + cm->offset[0], g_coeff * v + cm->offset[1], r_coeff * v + cm->offset[2]);
             }
+        }
         return true;
     }
     default: {
@@ -151,62 +305,11 @@ bool BitmapFloat_apply_color_matrix(Context * context, BitmapFloat * bmp, const
     }
 }
 
-
-
-bool BitmapBgra_populate_histogram (Context * context, BitmapBgra * bmp, uint64_t * histograms, const uint32_t histogram_size_per_channel, const uint32_t histogram_count, uint64_t * pixels_sampled)
+bool BitmapFloat_apply_color_matrix(Context * context, BitmapFloat * bmp, const uint32_t row, const uint32_t count, float*  m[5])
 {
-    const uint32_t row = 0;
-    const uint32_t count = bmp->h;
-    const uint32_t stride = bmp->stride;
-    const uint32_t ch = BitmapPixelFormat_bytes_per_pixel (bmp->fmt);
-    const uint32_t w = bmp->w;
-    const uint32_t h = umin (row + count, bmp->h);
-
-    const int shift = 8 - intlog2 (histogram_size_per_channel);
-
-    if (ch == 4 || ch == 3) {
-
-        if (histogram_count == 1){
-
-            for (uint32_t y = row; y < h; y++){
-                for (uint32_t x = 0; x < w; x++) {
-                    uint8_t* const __restrict data = bmp->pixels + stride * y + x * ch;
-
-                    histograms[(306 * data[2] + 601 * data[1] + 117 * data[0]) >> shift]++;
-                }
-            }
-        } else if (histogram_count == 3){
-            for (uint32_t y = row; y < h; y++){
-                for (uint32_t x = 0; x < w; x++) {
-                    uint8_t* const __restrict data = bmp->pixels + stride * y + x * ch;
-                    histograms[data[2] >> shift]++;
-                    histograms[(data[1] >> shift) + histogram_size_per_channel]++;
-                    histograms[(data[0] >> shift) + 2 * histogram_size_per_channel]++;
-                }
-            }
-        }
-        else if (histogram_count == 2){
-            for (uint32_t y = row; y < h; y++){
-                for (uint32_t x = 0; x < w; x++) {
-                    uint8_t* const __restrict data = bmp->pixels + stride * y + x * ch;
-                    //Calculate luminosity and saturation
-                    histograms[(306 * data[2] + 601 * data[1] + 117 * data[0]) >> shift]++;
-                    histograms[histogram_size_per_channel + (int_max(255,int_max(abs ((int)data[2] - (int)data[1]),abs ((int)data[1] - (int)data[0]))) >> shift)]++;
-                }
-            }
-        }
-        else{
-            CONTEXT_error (context, Invalid_internal_state);
-            return false;
-        }
-
-        *(pixels_sampled) = (h - row) * w;
-    }
-    else {
-        CONTEXT_error (context, Unsupported_pixel_format);
-        return false;
-    }
-    return true;
+    ColorMatrixBgra cm;
+    ColorMatrixBgra_init(&cm, m);
+    return BitmapFloat_apply_color_matrix_bgra(context, bmp, row, count, &cm);
 }
 
 
@@ -264,6 +367,13 @@ bool BitmapBgra_populate_histogram (Context * context, BitmapBgra * bmp, uint64_
      for (uint32_t n = 0; n < 256; n++) {
          context->colorspace.byte_to_float[n] = Context_srgb_to_floatspace_uncached (context, n);
      }
+     //Scaling by 255 is already cheaper than a lookup
+     context->colorspace.tabulate_encoding = context->colorspace.apply_srgb || context->colorspace.apply_gamma;
+     if (context->colorspace.tabulate_encoding) {
+         for (uint32_t n = 0; n <= FLOATSPACE_TO_BYTE_TABLE_SIZE; n++) {
+             context->colorspace.float_to_byte[n] = Context_floatspace_to_srgb_uncached (context, (float)n / (float)FLOATSPACE_TO_BYTE_TABLE_SIZE);
+         }
+     }
  }
 
 
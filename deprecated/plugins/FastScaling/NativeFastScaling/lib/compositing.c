@@ -10,13 +10,56 @@
 #endif
 
 #include "fastscaling_private.h"
+#include "simd.h"
 
 #include <string.h>
 
+#ifdef FASTSCALING_AVX2
+//Converts the leading pixels of a row with gathers from the lookup table, and returns how many pixels it handled.
+//Premultiplies when both sides have 4 channels; drops alpha when a 4-byte source becomes 3 channels.
+static AVX2_FUNCTION uint32_t convert_srgb_to_linear_row_avx2(const float * lut, const uint8_t * src, float * dest, const uint32_t w, const uint32_t from_step, const uint32_t to_step)
+{
+    uint32_t x = 0;
+    if (from_step == to_step && from_step != 4) {
+        //Each byte becomes one float
+        const uint32_t units = w * from_step;
+        uint32_t i = 0;
+        for (; i + 8 <= units; i += 8) {
+            const __m256i indexes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+            _mm256_storeu_ps(dest + i, _mm256_i32gather_ps(lut, indexes, 4));
+        }
+        //The caller redoes any partial pixel
+        return i / from_step;
+    }
+    if (from_step == 4 && to_step == 4) {
+        const __m256 byte_max = _mm256_set1_ps(255.0f);
+        for (; x + 2 <= w; x += 2) {
+            const __m256i bytes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + x * 4)));
+            const __m256 linear = _mm256_i32gather_ps(lut, bytes, 4);
+            const __m256 raw = _mm256_div_ps(_mm256_cvtepi32_ps(bytes), byte_max);
+            const __m256 alpha = _mm256_shuffle_ps(raw, raw, _MM_SHUFFLE(3, 3, 3, 3));
+            _mm256_storeu_ps(dest + x * 4, _mm256_blend_ps(_mm256_mul_ps(alpha, linear), alpha, 0x88));
+        }
+        return x;
+    }
+    if (from_step == 4 && to_step == 3) {
+        const __m128i drop_alpha = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        for (; x + 4 <= w; x += 4) {
+            const __m128i packed = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + x * 4)), drop_alpha);
+            _mm256_storeu_ps(dest + x * 3, _mm256_i32gather_ps(lut, _mm256_cvtepu8_epi32(packed), 4));
+            _mm_storeu_ps(dest + x * 3 + 8, _mm_i32gather_ps(lut, _mm_cvtepu8_epi32(_mm_srli_si128(packed, 8)), 4));
+        }
+        return x;
+    }
+    return 0;
+}
+#endif
+
 
-bool BitmapBgra_convert_srgb_to_linear(Context * context, BitmapBgra * src, uint32_t from_row, BitmapFloat * dest, uint32_t dest_row, uint32_t row_count)
+bool BitmapBgra_convert_srgb_to_linear(Context * context, BitmapBgra * src, uint32_t from_row, BitmapFloat * dest, uint32_t dest_row, uint32_t row_count, HistogramAccumulator * histogram)
 {
-    if (src->w != dest->w || BitmapPixelFormat_bytes_per_pixel(src->fmt) < dest->channels) {
+    //Gray8 may be expanded into 3 or 4 channels; otherwise we never invent channels
+    if (src->w != dest->w || (BitmapPixelFormat_bytes_per_pixel(src->fmt) < dest->channels && src->fmt != Gray8)) {
         CONTEXT_error(context, Invalid_internal_state);
         return false;
     }
@@ -31,20 +74,61 @@ bool BitmapBgra_convert_srgb_to_linear(Context * context, BitmapBgra * src, uint
     const uint32_t from_step = BitmapPixelFormat_bytes_per_pixel(src->fmt);
     const uint32_t to_step = dest->channels;
     const uint32_t copy_step = umin(from_step, to_step);
+#ifdef FASTSCALING_AVX2
+    const bool use_avx2 = simd_level() >= Simd_avx2;
+#endif
+#ifdef FASTSCALING_SSE2
+    const bool use_sse2 = simd_level() >= Simd_sse2;
+#endif
 
     for (uint32_t row = 0; row < row_count; row++) {
         uint8_t*    src_start = src->pixels + (from_row + row)*src->stride;
 
         float* buf = dest->pixels + (dest->float_stride * (row + dest_row));
-        if (copy_step == 3) {
-            for (uint32_t to_x = 0, bix = 0; bix < units; to_x += to_step, bix += from_step) {
+        //Pixels already converted
+        uint32_t first = 0;
+#ifdef FASTSCALING_AVX2
+        if (use_avx2) {
+            first = convert_srgb_to_linear_row_avx2(context->colorspace.byte_to_float, src_start, buf, w, from_step, to_step);
+        }
+#endif
+        if (from_step == 1) {
+            if (to_step == 1) {
+                for (uint32_t x = first; x < w; x++) {
+                    buf[x] = Context_srgb_to_floatspace(context, src_start[x]);
+                }
+            } else {
+                for (uint32_t to_x = 0, bix = 0; bix < w; to_x += to_step, bix++) {
+                    const float v = Context_srgb_to_floatspace(context, src_start[bix]);
+                    buf[to_x] = v;
+                    buf[to_x + 1] = v;
+                    buf[to_x + 2] = v;
+                    if (to_step == 4) {
+                        buf[to_x + 3] = 1.0f;
+                    }
+                }
+            }
+        } else if (copy_step == 3) {
+            for (uint32_t to_x = first * to_step, bix = first * from_step; bix < units; to_x += to_step, bix += from_step) {
                 buf[to_x] =     Context_srgb_to_floatspace(context, src_start[bix]);
                 buf[to_x + 1] = Context_srgb_to_floatspace (context, src_start[bix + 1]);
                 buf[to_x + 2] = Context_srgb_to_floatspace (context, src_start[bix + 2]);
             }
             //We're only working on a portion... dest->alpha_premultiplied = false;
         } else if (copy_step == 4) {
-            for (uint32_t to_x = 0, bix = 0; bix < units; to_x += to_step, bix += from_step) {
+#ifdef FASTSCALING_SSE2
+            if (use_sse2) {
+                //One multiply premultiplies the whole pixel; the alpha lane starts at 1
+                const float * lut = context->colorspace.byte_to_float;
+                for (uint32_t bix = first * 4; bix < units; bix += 4) {
+                    const float alpha = ((float)src_start[bix + 3]) / 255.0f;
+                    const __m128 linear = _mm_setr_ps(lut[src_start[bix]], lut[src_start[bix + 1]], lut[src_start[bix + 2]], 1.0f);
+                    _mm_storeu_ps(buf + bix, _mm_mul_ps(linear, _mm_set1_ps(alpha)));
+                }
+                first = w;
+            }
+#endif
+            for (uint32_t to_x = first * to_step, bix = first * from_step; bix < units; to_x += to_step, bix += from_step) {
                 {
                     const float alpha = ((float)src_start[bix + 3]) / 255.0f;
                     buf[to_x] = alpha * Context_srgb_to_floatspace (context, src_start[bix]);
@@ -58,7 +142,11 @@ bool BitmapBgra_convert_srgb_to_linear(Context * context, BitmapBgra * src, uint
             CONTEXT_error (context, Unsupported_pixel_format);
             return false;
         }
-
+        //The row is still in cache
+        if (histogram != NULL && !HistogramAccumulator_add_rows(context, histogram, src, from_row + row, 1)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
     }
     return true;
 }
@@ -120,60 +208,252 @@ static int  copy_bitmap_bgra(BitmapBgra * src, BitmapBgra * dst)
 }
 */
 
-static bool BitmapFloat_blend_matte(Context * context, BitmapFloat * src, const uint32_t from_row, const uint32_t row_count, const uint8_t* const matte)
+#ifdef FASTSCALING_AVX2
+//Two pixels per iteration; returns how many pixels it handled
+static AVX2_FUNCTION uint32_t demultiply_row_avx2(float * row, const uint32_t w, const float * matte)
 {
-    //We assume that matte is BGRA, regardless.
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 matte_color = matte == NULL ? zero : _mm256_setr_ps(matte[0], matte[1], matte[2], 0, matte[0], matte[1], matte[2], 0);
+    const __m256 matte_alpha = _mm256_set1_ps(matte == NULL ? 0 : matte[3]);
+    uint32_t x = 0;
+    for (; x + 2 <= w; x += 2) {
+        const __m256 px = _mm256_loadu_ps(row + x * 4);
+        const __m256 src_alpha = _mm256_shuffle_ps(px, px, _MM_SHUFFLE(3, 3, 3, 3));
+        __m256 color = px;
+        __m256 alpha = src_alpha;
+        if (matte != NULL) {
+            const __m256 a = _mm256_mul_ps(_mm256_sub_ps(one, src_alpha), matte_alpha);
+            color = _mm256_fmadd_ps(matte_color, a, px);
+            alpha = _mm256_add_ps(src_alpha, a);
+        }
+        //One Newton step takes the ~12-bit estimate to nearly full precision
+        __m256 reciprocal = _mm256_rcp_ps(alpha);
+        reciprocal = _mm256_fmadd_ps(reciprocal, _mm256_fnmadd_ps(alpha, reciprocal, one), reciprocal);
+        const __m256 positive = _mm256_cmp_ps(alpha, zero, _CMP_GT_OQ);
+        const __m256 demultiplied = _mm256_blendv_ps(color, _mm256_mul_ps(color, reciprocal), positive);
+        _mm256_storeu_ps(row + x * 4, _mm256_blend_ps(demultiplied, alpha, 0x88));
+    }
+    return x;
+}
+#endif
 
-    const float matte_a = ((float)matte[3]) / 255.0f;
-    const float b = Context_srgb_to_floatspace (context, matte[0]);
-    const float g = Context_srgb_to_floatspace (context, matte[1]);
-    const float r = Context_srgb_to_floatspace (context, matte[2]);
+#ifdef FASTSCALING_SSE2
+static uint32_t demultiply_row_sse2(float * row, const uint32_t w, const float * matte)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 alpha_lane = _mm_castsi128_ps(_mm_setr_epi32(0, 0, 0, -1));
+    const __m128 matte_color = matte == NULL ? zero : _mm_setr_ps(matte[0], matte[1], matte[2], 0);
+    const __m128 matte_alpha = _mm_set1_ps(matte == NULL ? 0 : matte[3]);
+    for (uint32_t x = 0; x < w; x++) {
+        const __m128 px = _mm_loadu_ps(row + x * 4);
+        const __m128 src_alpha = _mm_shuffle_ps(px, px, _MM_SHUFFLE(3, 3, 3, 3));
+        __m128 color = px;
+        __m128 alpha = src_alpha;
+        if (matte != NULL) {
+            const __m128 a = _mm_mul_ps(_mm_sub_ps(one, src_alpha), matte_alpha);
+            color = _mm_add_ps(px, _mm_mul_ps(matte_color, a));
+            alpha = _mm_add_ps(src_alpha, a);
+        }
+        __m128 reciprocal = _mm_rcp_ps(alpha);
+        reciprocal = _mm_add_ps(reciprocal, _mm_mul_ps(reciprocal, _mm_sub_ps(one, _mm_mul_ps(alpha, reciprocal))));
+        const __m128 positive = _mm_cmpgt_ps(alpha, zero);
+        const __m128 demultiplied = _mm_or_ps(_mm_and_ps(positive, _mm_mul_ps(color, reciprocal)), _mm_andnot_ps(positive, color));
+        _mm_storeu_ps(row + x * 4, _mm_or_ps(_mm_and_ps(alpha_lane, alpha), _mm_andnot_ps(alpha_lane, demultiplied)));
+    }
+    return w;
+}
+#endif
 
+//Divides color by alpha in a 4-channel row, leaving pixels with zero alpha as they are.
+//If matte (linear B, G, R, then alpha) is given, each pixel is first blended over it; blending and demultiplying share one reciprocal.
+static void demultiply_row(float * row, const uint32_t w, const float * matte)
+{
+    uint32_t x = 0;
+#ifdef FASTSCALING_AVX2
+    if (simd_level() >= Simd_avx2) {
+        x = demultiply_row_avx2(row, w, matte);
+    }
+#endif
+#ifdef FASTSCALING_SSE2
+    if (simd_level() >= Simd_sse2) {
+        x += demultiply_row_sse2(row + x * 4, w - x, matte);
+    }
+#endif
+    for (; x < w; x++) {
+        float * px = row + x * 4;
+        float alpha = px[3];
+        if (matte != NULL) {
+            const float a = (1.0f - alpha) * matte[3];
+            px[0] += matte[0] * a;
+            px[1] += matte[1] * a;
+            px[2] += matte[2] * a;
+            alpha += a;
+            px[3] = alpha;
+        }
+        if (alpha > 0) {
+            const float reciprocal = 1.0f / alpha;
+            px[0] *= reciprocal;
+            px[1] *= reciprocal;
+            px[2] *= reciprocal;
+        }
+    }
+}
 
+bool BitmapFloat_blend_matte(Context * context, BitmapFloat * src, const uint32_t from_row, const uint32_t row_count, const uint8_t* const matte)
+{
+    if (src->channels != 4) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+    //We assume that matte is BGRA, regardless.
+    const float linear_matte[4] = {
+        Context_srgb_to_floatspace (context, matte[0]),
+        Context_srgb_to_floatspace (context, matte[1]),
+        Context_srgb_to_floatspace (context, matte[2]),
+        ((float)matte[3]) / 255.0f
+    };
+    for (uint32_t row = from_row; row < from_row + row_count; row++) {
+        demultiply_row(src->pixels + row * src->float_stride, src->w, linear_matte);
+    }
+    return true;
+}
 
+bool BitmapFloat_demultiply_alpha(Context * context, BitmapFloat * src, const uint32_t from_row, const uint32_t row_count)
+{
+    if (src->channels != 4) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
     for (uint32_t row = from_row; row < from_row + row_count; row++) {
-        uint32_t start_ix = row * src->float_stride;
-        uint32_t end_ix = start_ix + src->w * src->channels;
+        demultiply_row(src->pixels + row * src->float_stride, src->w, NULL);
+    }
+    return true;
+}
 
-        for (uint32_t ix = start_ix; ix < end_ix; ix += 4) {
-            const float src_a = src->pixels[ix + 3];
-            const float a = (1.0f - src_a) * matte_a;
-            const float final_alpha = src_a + a;
 
-            src->pixels[ix] = (src->pixels[ix] + b * a) / final_alpha;
-            src->pixels[ix + 1] = (src->pixels[ix + 1] + g * a) / final_alpha;
-            src->pixels[ix + 2] = (src->pixels[ix + 2] + r * a) / final_alpha;
-            src->pixels[ix + 3] = final_alpha;
+#ifdef FASTSCALING_AVX2
+//Floats encoded per pass over the scratch buffer; a multiple of 3, 4, and 8
+#define ENCODE_CHUNK_FLOATS 960
 
+//Matches Context_floatspace_to_srgb for floatspaces that are tabulated or as-is
+static AVX2_FUNCTION __m256i floatspace_to_srgb_avx2(Context * context, const __m256 v)
+{
+    //max_ps returns its second operand for NaN, so NaN becomes 0
+    const __m256 clamped = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+    __m256 encoded;
+    if (context->colorspace.tabulate_encoding) {
+        const float * table = context->colorspace.float_to_byte;
+        const __m256 position = _mm256_mul_ps(clamped, _mm256_set1_ps((float)FLOATSPACE_TO_BYTE_TABLE_SIZE));
+        const __m256i index = _mm256_cvttps_epi32(position);
+        //At 1.0, both ends are the last entry and the fraction is 0
+        const __m256i next = _mm256_min_epi32(_mm256_add_epi32(index, _mm256_set1_epi32(1)), _mm256_set1_epi32(FLOATSPACE_TO_BYTE_TABLE_SIZE));
+        const __m256 low = _mm256_i32gather_ps(table, index, 4);
+        const __m256 high = _mm256_i32gather_ps(table, next, 4);
+        const __m256 fraction = _mm256_sub_ps(position, _mm256_cvtepi32_ps(index));
+        //Multiply and add separately, exactly like the scalar version
+        encoded = _mm256_add_ps(low, _mm256_mul_ps(_mm256_sub_ps(high, low), fraction));
+        const int first_interval = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(index, _mm256_setzero_si256())));
+        if (context->colorspace.apply_gamma && first_interval != 0) {
+            float lanes[8];
+            float values[8];
+            _mm256_storeu_ps(lanes, encoded);
+            _mm256_storeu_ps(values, v);
+            for (int i = 0; i < 8; i++) {
+                if ((first_interval & (1 << i)) != 0) {
+                    lanes[i] = Context_floatspace_to_srgb_tabulated(context, values[i]);
+                }
+            }
+            encoded = _mm256_loadu_ps(lanes);
         }
+    } else {
+        encoded = _mm256_mul_ps(clamped, _mm256_set1_ps(255.0f));
     }
+    return _mm256_cvttps_epi32(_mm256_add_ps(encoded, _mm256_set1_ps(0.5f)));
+}
 
-
-    //Ensure alpha is demultiplied
-    return true;
+//Encodes count floats to bytes. If alpha_lanes is set, every 4th float is alpha, and is scaled rather than encoded.
+static AVX2_FUNCTION void encode_floats_avx2(Context * context, const float * src, uint8_t * out, const uint32_t count, const bool alpha_lanes)
+{
+    const __m256 byte_max = _mm256_set1_ps(255.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256 v = _mm256_loadu_ps(src + i);
+        __m256i values = floatspace_to_srgb_avx2(context, v);
+        if (alpha_lanes) {
+            const __m256 alpha = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+            values = _mm256_blend_epi32(values, _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(alpha, byte_max), half)), 0x88);
+        }
+        const __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(values), _mm256_extracti128_si256(values, 1));
+        _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(words, words));
+    }
+    for (; i < count; i++) {
+        out[i] = alpha_lanes && i % 4 == 3 ? uchar_clamp_ff(src[i] * 255.0f) : Context_floatspace_to_srgb(context, src[i]);
+    }
 }
 
-bool BitmapFloat_demultiply_alpha(Context * context, BitmapFloat * src, const uint32_t from_row, const uint32_t row_count)
+static AVX2_FUNCTION void BitmapFloat_copy_linear_over_srgb_avx2(Context * context, BitmapFloat * src, const uint32_t from_row, BitmapBgra * dest, const uint32_t dest_row, const uint32_t row_count, const uint32_t from_col, const uint32_t col_count, const bool transpose)
 {
-    for (uint32_t row = from_row; row < from_row + row_count; row++) {
-        uint32_t start_ix = row * src->float_stride;
-        uint32_t end_ix = start_ix + src->w * src->channels;
-
-        for (uint32_t ix = start_ix; ix < end_ix; ix += 4) {
-            const float alpha = src->pixels[ix + 3];
-            if (alpha > 0) {
-                src->pixels[ix] /= alpha;
-                src->pixels[ix + 1] /= alpha;
-                src->pixels[ix + 2] /= alpha;
+    const uint32_t dest_bytes_pp = BitmapPixelFormat_bytes_per_pixel (dest->fmt);
+    const uint32_t dest_row_stride = transpose ? dest_bytes_pp : dest->stride;
+    const uint32_t dest_pixel_stride = transpose ? dest->stride : dest_bytes_pp;
+    const uint32_t srcitems = umin(from_col + col_count, src->w) * src->channels;
+    const uint32_t ch = src->channels;
+    const bool copy_alpha = dest->fmt == Bgra32 && ch == 4 && src->alpha_meaningful;
+    const bool clean_alpha = !copy_alpha && dest->fmt == Bgra32;
+    //Identical layouts can be encoded straight into the destination
+    const bool direct = !transpose && ch == dest_bytes_pp && (ch != 4 || copy_alpha);
+    uint8_t encoded[ENCODE_CHUNK_FLOATS];
+
+    for (uint32_t row = 0; row < row_count; row++) {
+        const float * src_row = src->pixels + (row + from_row) * src->float_stride;
+        uint8_t * dest_row_bytes = dest->pixels + (dest_row + row) * dest_row_stride;
+
+        if (direct) {
+            encode_floats_avx2(context, src_row + from_col * ch, dest_row_bytes + from_col * ch, srcitems - from_col * ch, copy_alpha);
+            continue;
+        }
+        for (uint32_t start = from_col * ch; start < srcitems; start += ENCODE_CHUNK_FLOATS) {
+            const uint32_t count = umin(ENCODE_CHUNK_FLOATS, srcitems - start);
+            encode_floats_avx2(context, src_row + start, encoded, count, copy_alpha);
+
+            uint8_t * dest_pixel = dest_row_bytes + (start / ch) * dest_pixel_stride;
+            for (uint32_t ix = 0; ix < count; ix += ch) {
+                dest_pixel[0] = encoded[ix];
+                if (dest_bytes_pp > 1) {
+                    dest_pixel[1] = encoded[ch == 1 ? ix : ix + 1];
+                    dest_pixel[2] = encoded[ch == 1 ? ix : ix + 2];
+                }
+                if (copy_alpha) {
+                    dest_pixel[3] = encoded[ix + 3];
+                }
+                if (clean_alpha) {
+                    dest_pixel[3] = 0xff;
+                }
+                dest_pixel += dest_pixel_stride;
             }
         }
     }
-    return true;
 }
-
+#endif
 
 bool BitmapFloat_copy_linear_over_srgb(Context * context, BitmapFloat * src, const uint32_t from_row, BitmapBgra * dest, const uint32_t dest_row, const uint32_t row_count, const uint32_t from_col, const uint32_t col_count, const bool transpose)
 {
+#ifdef FASTSCALING_AVX2
+    //Luma conversion stays scalar
+    const bool vector_layout = src->channels == 1 || BitmapPixelFormat_bytes_per_pixel (dest->fmt) > 1;
+#ifdef EXPOSE_SIGMOID
+    const bool vector_floatspace = !context->colorspace.apply_sigmoid;
+#else
+    const bool vector_floatspace = true;
+#endif
+    if (vector_layout && vector_floatspace && simd_level() >= Simd_avx2) {
+        BitmapFloat_copy_linear_over_srgb_avx2(context, src, from_row, dest, dest_row, row_count, from_col, col_count, transpose);
+        return true;
+    }
+#endif
 
     const uint32_t dest_bytes_pp = BitmapPixelFormat_bytes_per_pixel (dest->fmt);
 
@@ -184,6 +464,28 @@ bool BitmapFloat_copy_linear_over_srgb(Context * context, BitmapFloat * src, con
     const bool copy_alpha = dest->fmt == Bgra32 && src->channels == 4 && src->alpha_meaningful;
     const bool clean_alpha = !copy_alpha && dest->fmt == Bgra32;
 
+    if (ch == 1 || dest_bytes_pp == 1) {
+        for (uint32_t row = 0; row < row_count; row++) {
+            float * src_row = src->pixels + (row + from_row) * src->float_stride;
+
+            uint8_t * dest_row_bytes = dest->pixels + (dest_row + row) * dest_row_stride + (from_col * dest_pixel_stride);
+
+            for (uint32_t ix = from_col * ch; ix < srcitems; ix += ch) {
+                const uint8_t v = Context_floatspace_to_srgb (context, ch == 1 ? src_row[ix] : linear_luma (src_row[ix], src_row[ix + 1], src_row[ix + 2]));
+                dest_row_bytes[0] = v;
+                if (dest_bytes_pp > 1) {
+                    dest_row_bytes[1] = v;
+                    dest_row_bytes[2] = v;
+                }
+                if (clean_alpha) {
+                    dest_row_bytes[3] = 0xff;
+                }
+                dest_row_bytes += dest_pixel_stride;
+            }
+        }
+        return true;
+    }
+
     for (uint32_t row = 0; row < row_count; row++) {
         float * src_row = src->pixels + (row + from_row) * src->float_stride;
 
@@ -207,6 +509,80 @@ bool BitmapFloat_copy_linear_over_srgb(Context * context, BitmapFloat * src, con
 
 }
 
+#ifdef FASTSCALING_AVX2
+//Blends four premultiplied pixels at a time over 3 or 4-byte destination pixels, which may be a column (transposed) or a row.
+//Returns how many pixels it handled.
+static AVX2_FUNCTION uint32_t compose_row_avx2(Context * context, const float * src, uint8_t * dest, const uint32_t count, const uint32_t dest_pixel_stride, const uint32_t dest_bytes_pp, const bool dest_alpha)
+{
+    const float * lut = context->colorspace.byte_to_float;
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 byte_max = _mm256_set1_ps(255.0f);
+    const __m256 to_unit = _mm256_set1_ps(1.0f / 255.0f);
+    //Destination bytes can be loaded and stored in place when they are packed BGRA
+    const bool contiguous = dest_pixel_stride == 4 && dest_bytes_pp == 4;
+    uint8_t gathered[16];
+    uint8_t encoded[16];
+    uint32_t x = 0;
+    for (; x + 4 <= count; x += 4) {
+        uint8_t * d = dest + x * dest_pixel_stride;
+        __m128i bytes;
+        if (contiguous) {
+            bytes = _mm_loadu_si128((const __m128i *)d);
+        } else {
+            for (int i = 0; i < 4; i++) {
+                const uint8_t * pixel = d + i * dest_pixel_stride;
+                gathered[i * 4] = pixel[0];
+                gathered[i * 4 + 1] = pixel[1];
+                gathered[i * 4 + 2] = pixel[2];
+                gathered[i * 4 + 3] = dest_bytes_pp == 4 ? pixel[3] : 0xff;
+            }
+            bytes = _mm_loadu_si128((const __m128i *)gathered);
+        }
+        __m256i values[2];
+        for (int half = 0; half < 2; half++) {
+            const __m256i dest_bytes = _mm256_cvtepu8_epi32(half == 0 ? bytes : _mm_srli_si128(bytes, 8));
+            const __m256 dest_linear = _mm256_i32gather_ps(lut, dest_bytes, 4);
+            const __m256 dest_raw_alpha = _mm256_mul_ps(_mm256_cvtepi32_ps(dest_bytes), to_unit);
+            const __m256 dest_a = dest_alpha ? _mm256_shuffle_ps(dest_raw_alpha, dest_raw_alpha, _MM_SHUFFLE(3, 3, 3, 3)) : one;
+
+            const __m256 px = _mm256_loadu_ps(src + (x + half * 2) * 4);
+            const __m256 src_a = _mm256_shuffle_ps(px, px, _MM_SHUFFLE(3, 3, 3, 3));
+            const __m256 a = _mm256_mul_ps(_mm256_sub_ps(one, src_a), dest_a);
+            const __m256 color = _mm256_fmadd_ps(dest_linear, a, px);
+            const __m256 final_alpha = _mm256_add_ps(src_a, a);
+
+            __m256 reciprocal = _mm256_rcp_ps(final_alpha);
+            reciprocal = _mm256_fmadd_ps(reciprocal, _mm256_fnmadd_ps(final_alpha, reciprocal, one), reciprocal);
+            const __m256 positive = _mm256_cmp_ps(final_alpha, zero, _CMP_GT_OQ);
+            const __m256 demultiplied = _mm256_and_ps(positive, _mm256_mul_ps(color, reciprocal));
+
+            const __m256 clamped_alpha = _mm256_min_ps(_mm256_max_ps(final_alpha, zero), one);
+            const __m256i alpha_bytes = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(clamped_alpha, byte_max), _mm256_set1_ps(0.5f)));
+            values[half] = _mm256_blend_epi32(floatspace_to_srgb_avx2(context, demultiplied), alpha_bytes, 0x88);
+        }
+        //packus interleaves the 128-bit lanes; the permute puts the four pixels back in order
+        const __m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(values[0], values[1]), _MM_SHUFFLE(3, 1, 2, 0));
+        const __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+        if (contiguous && dest_alpha) {
+            _mm_storeu_si128((__m128i *)d, packed);
+            continue;
+        }
+        _mm_storeu_si128((__m128i *)encoded, packed);
+        for (int i = 0; i < 4; i++) {
+            uint8_t * pixel = d + i * dest_pixel_stride;
+            pixel[0] = encoded[i * 4];
+            pixel[1] = encoded[i * 4 + 1];
+            pixel[2] = encoded[i * 4 + 2];
+            if (dest_alpha) {
+                pixel[3] = encoded[i * 4 + 3];
+            }
+        }
+    }
+    return x;
+}
+#endif
+
 static bool BitmapFloat_compose_linear_over_srgb(Context * context, BitmapFloat * src, const uint32_t from_row, BitmapBgra * dest, const uint32_t dest_row, const uint32_t row_count, const uint32_t from_col, const uint32_t col_count, const bool transpose)
 {
 
@@ -217,21 +593,37 @@ static bool BitmapFloat_compose_linear_over_srgb(Context * context, BitmapFloat
     const uint32_t ch = src->channels;
 
     const bool dest_alpha = dest->fmt == Bgra32 && dest->alpha_meaningful;
+    const bool dest_gray = dest_bytes_pp == 1;
 
     const uint8_t dest_alpha_index = dest_alpha ? 3 : 0;
     const float dest_alpha_to_float_coeff = dest_alpha ? 1.0f / 255.0f : 0.0f;
     const float dest_alpha_to_float_offset = dest_alpha ? 0.0f : 1.0f;
+#ifdef FASTSCALING_AVX2
+#ifdef EXPOSE_SIGMOID
+    const bool use_avx2 = !dest_gray && !context->colorspace.apply_sigmoid && simd_level() >= Simd_avx2;
+#else
+    const bool use_avx2 = !dest_gray && simd_level() >= Simd_avx2;
+#endif
+#endif
     for (uint32_t row = 0; row < row_count; row++) {
         //const float * const __restrict src_row = src->pixels + (row + from_row) * src->float_stride;
         float * src_row = src->pixels + (row + from_row) * src->float_stride;
 
         uint8_t * dest_row_bytes = dest->pixels + (dest_row + row) * dest_row_stride + (from_col * dest_pixel_stride);
+        //Pixels already composed
+        uint32_t first = from_col;
+#ifdef FASTSCALING_AVX2
+        if (use_avx2 && srcitems > from_col * ch) {
+            first += compose_row_avx2(context, src_row + from_col * ch, dest_row_bytes, srcitems / ch - from_col, dest_pixel_stride, dest_bytes_pp, dest_alpha);
+            dest_row_bytes += (first - from_col) * dest_pixel_stride;
+        }
+#endif
 
-        for (uint32_t ix = from_col * ch; ix < srcitems; ix += ch) {
+        for (uint32_t ix = first * ch; ix < srcitems; ix += ch) {
 
             const uint8_t dest_b = dest_row_bytes[0];
-            const uint8_t dest_g = dest_row_bytes[1];
-            const uint8_t dest_r = dest_row_bytes[2];
+            const uint8_t dest_g = dest_row_bytes[dest_gray ? 0 : 1];
+            const uint8_t dest_r = dest_row_bytes[dest_gray ? 0 : 2];
             const uint8_t dest_a = dest_row_bytes[dest_alpha_index];
 
             const float src_b = src_row[ix + 0];
@@ -246,6 +638,11 @@ static bool BitmapFloat_compose_linear_over_srgb(Context * context, BitmapFloat
 
             const float final_alpha = src_a + a;
 
+            if (dest_gray) {
+                dest_row_bytes[0] = Context_floatspace_to_srgb (context, linear_luma (b, g, r) / final_alpha);
+                dest_row_bytes += dest_pixel_stride;
+                continue;
+            }
             dest_row_bytes[0] = Context_floatspace_to_srgb (context, b / final_alpha);
             dest_row_bytes[1] = Context_floatspace_to_srgb (context,g / final_alpha);
             dest_row_bytes[2] = Context_floatspace_to_srgb (context,r / final_alpha);
@@ -262,28 +659,196 @@ static bool BitmapFloat_compose_linear_over_srgb(Context * context, BitmapFloat
 
 
 
-bool BitmapFloat_pivoting_composite_linear_over_srgb(Context * context, BitmapFloat * src, uint32_t from_row, BitmapBgra * dest, uint32_t dest_row, uint32_t row_count, bool transpose)
+//Opaque runs shorter than this are cheaper to blend than to hand to the copy path
+#define OPAQUE_SPAN_MIN_PIXELS 8
+
+typedef enum {
+    Alpha_clear, //Every channel is 0, so the destination is unchanged
+    Alpha_opaque, //Alpha is exactly 1, so the source replaces the destination
+    Alpha_partial
+} AlphaSpanKind;
+
+static inline AlphaSpanKind alpha_span_kind(const float * px)
 {
-    if (transpose ? src->w != dest->h : src->w != dest->w) {
-        //TODO: Add more bounds checks
-        CONTEXT_error(context, Invalid_internal_state);
-        return false;
+    if (px[3] == 1.0f) {
+        return Alpha_opaque;
+    }
+    return px[0] == 0 && px[1] == 0 && px[2] == 0 && px[3] == 0 ? Alpha_clear : Alpha_partial;
+}
+
+//How many pixels, starting at px, are of the given kind (which must not be Alpha_partial)
+static uint32_t alpha_span_length(const float * px, const uint32_t count, const AlphaSpanKind kind)
+{
+    uint32_t x = 0;
+#ifdef FASTSCALING_SSE2
+    if (simd_level() >= Simd_sse2) {
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 zero = _mm_setzero_ps();
+        for (; x + 4 <= count; x += 4) {
+            const __m128 p0 = _mm_loadu_ps(px + x * 4);
+            const __m128 p1 = _mm_loadu_ps(px + x * 4 + 4);
+            const __m128 p2 = _mm_loadu_ps(px + x * 4 + 8);
+            const __m128 p3 = _mm_loadu_ps(px + x * 4 + 12);
+            int mask;
+            if (kind == Alpha_opaque) {
+                //Gather the four alpha lanes into one register
+                const __m128 a01 = _mm_shuffle_ps(p0, p1, _MM_SHUFFLE(3, 3, 3, 3));
+                const __m128 a23 = _mm_shuffle_ps(p2, p3, _MM_SHUFFLE(3, 3, 3, 3));
+                mask = _mm_movemask_ps(_mm_cmpeq_ps(_mm_shuffle_ps(a01, a23, _MM_SHUFFLE(2, 0, 2, 0)), one));
+            } else {
+                //A pixel is clear when all four lanes compare equal to zero
+                const __m128 z0 = _mm_cmpeq_ps(p0, zero);
+                const __m128 z1 = _mm_cmpeq_ps(p1, zero);
+                const __m128 z2 = _mm_cmpeq_ps(p2, zero);
+                const __m128 z3 = _mm_cmpeq_ps(p3, zero);
+                mask = (_mm_movemask_ps(z0) == 0xF ? 1 : 0) | (_mm_movemask_ps(z1) == 0xF ? 2 : 0) |
+                       (_mm_movemask_ps(z2) == 0xF ? 4 : 0) | (_mm_movemask_ps(z3) == 0xF ? 8 : 0);
+            }
+            if (mask != 0xF) {
+                //Count the leading matches
+                while ((mask & 1) != 0) {
+                    mask >>= 1;
+                    x++;
+                }
+                return x;
+            }
+        }
     }
+#endif
+    for (; x < count && alpha_span_kind(px + x * 4) == kind; x++) {
+    }
+    return x;
+}
 
-    if (src->alpha_meaningful && src->channels == 4 && dest->compositing_mode == Blend_with_matte) {
-        if (!BitmapFloat_blend_matte(context, src, from_row, row_count, dest->matte_color)) {
+//Composes one row, skipping clear spans and copying opaque ones instead of blending them
+static bool BitmapFloat_compose_spans_linear_over_srgb(Context * context, BitmapFloat * src, const uint32_t row, BitmapBgra * dest, const uint32_t to_row, const bool transpose)
+{
+    const float * src_row = src->pixels + row * src->float_stride;
+    const uint32_t w = src->w;
+    uint32_t x = 0;
+    while (x < w) {
+        const uint32_t clear = alpha_span_length(src_row + x * 4, w - x, Alpha_clear);
+        if (clear > 0) {
+            x += clear;
+            continue;
+        }
+        const uint32_t opaque = alpha_span_length(src_row + x * 4, w - x, Alpha_opaque);
+        if (opaque >= OPAQUE_SPAN_MIN_PIXELS || opaque == w - x) {
+            if (!BitmapFloat_copy_linear_over_srgb(context, src, row, dest, to_row, 1, x, opaque, transpose)) {
+                CONTEXT_add_to_callstack (context);
+                return false;
+            }
+            x += opaque;
+            continue;
+        }
+        //Blend up to the next clear pixel or long opaque run; short opaque runs are blended along with it
+        uint32_t end = x + umax(opaque, 1);
+        while (end < w) {
+            const AlphaSpanKind kind = alpha_span_kind(src_row + end * 4);
+            if (kind == Alpha_clear) {
+                break;
+            }
+            if (kind == Alpha_opaque) {
+                const uint32_t run = alpha_span_length(src_row + end * 4, w - end, Alpha_opaque);
+                if (run >= OPAQUE_SPAN_MIN_PIXELS || run == w - end) {
+                    break;
+                }
+                end += run;
+                continue;
+            }
+            end++;
+        }
+        if (!BitmapFloat_compose_linear_over_srgb(context, src, row, dest, to_row, 1, x, end - x, transpose)) {
             CONTEXT_add_to_callstack (context);
             return false;
         }
-        src->alpha_premultiplied = false;
+        x = end;
     }
-    if (src->channels == 4 && src->alpha_premultiplied && dest->compositing_mode != Blend_with_self) {
-        //Demultiply
-        if (!BitmapFloat_demultiply_alpha(context, src, from_row, row_count)) {
+    return true;
+}
+
+//The matte in the floatspace (B, G, R, alpha), and the bytes a clear source pixel becomes over it
+typedef struct {
+    float linear[4];
+    uint8_t encoded[4];
+} MatteColor;
+
+static void MatteColor_init(Context * context, MatteColor * m, const uint8_t * const matte, const BitmapBgra * dest)
+{
+    //We assume that matte is BGRA, regardless.
+    for (int c = 0; c < 3; c++) {
+        m->linear[c] = Context_srgb_to_floatspace (context, matte[c]);
+    }
+    m->linear[3] = ((float)matte[3]) / 255.0f;
+    //Encoded exactly as blending and copying a clear pixel would; a fully transparent matte leaves it black
+    const float visible = m->linear[3] > 0 ? 1.0f : 0.0f;
+    if (dest->fmt == Gray8) {
+        m->encoded[0] = Context_floatspace_to_srgb (context, visible * linear_luma (m->linear[0], m->linear[1], m->linear[2]));
+    } else {
+        for (int c = 0; c < 3; c++) {
+            m->encoded[c] = Context_floatspace_to_srgb (context, visible * m->linear[c]);
+        }
+    }
+    m->encoded[3] = uchar_clamp_ff (m->linear[3] * 255.0f);
+}
+
+//Writes a row over the matte: clear spans become the precomputed matte bytes, opaque spans are copied as they are,
+//and only translucent pixels are blended with the matte in floating point.
+static bool BitmapFloat_copy_spans_over_matte(Context * context, BitmapFloat * src, const uint32_t row, BitmapBgra * dest, const uint32_t to_row, const bool transpose, const MatteColor * matte)
+{
+    const uint32_t dest_bytes_pp = BitmapPixelFormat_bytes_per_pixel (dest->fmt);
+    const uint32_t dest_row_stride = transpose ? dest_bytes_pp : dest->stride;
+    const uint32_t dest_pixel_stride = transpose ? dest->stride : dest_bytes_pp;
+    uint8_t * dest_row_bytes = dest->pixels + to_row * dest_row_stride;
+    float * src_row = src->pixels + row * src->float_stride;
+    const uint32_t w = src->w;
+    uint32_t x = 0;
+    while (x < w) {
+        const uint32_t clear = alpha_span_length(src_row + x * 4, w - x, Alpha_clear);
+        for (uint32_t i = x; i < x + clear; i++) {
+            memcpy(dest_row_bytes + i * dest_pixel_stride, matte->encoded, dest_bytes_pp);
+        }
+        x += clear;
+        if (x == w) {
+            break;
+        }
+        //Blend the translucent pixels up to the next clear one, then write the whole stretch at once
+        uint32_t end = x;
+        while (end < w) {
+            const AlphaSpanKind kind = alpha_span_kind(src_row + end * 4);
+            if (kind == Alpha_clear) {
+                break;
+            }
+            if (kind == Alpha_opaque) {
+                end += alpha_span_length(src_row + end * 4, w - end, Alpha_opaque);
+                continue;
+            }
+            const uint32_t translucent_start = end;
+            while (end < w && alpha_span_kind(src_row + end * 4) == Alpha_partial) {
+                end++;
+            }
+            demultiply_row(src_row + translucent_start * 4, end - translucent_start, matte->linear);
+        }
+        if (!BitmapFloat_copy_linear_over_srgb(context, src, row, dest, to_row, 1, x, end - x, transpose)) {
             CONTEXT_add_to_callstack (context);
             return false;
         }
+        x = end;
     }
+    return true;
+}
+
+bool BitmapFloat_pivoting_composite_linear_over_srgb(Context * context, BitmapFloat * src, uint32_t from_row, BitmapBgra * dest, uint32_t dest_row, uint32_t row_count, bool transpose, const ColorMatrixBgra * color_matrix)
+{
+    if (transpose ? src->w != dest->h : src->w != dest->w) {
+        //TODO: Add more bounds checks
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+
+    const bool blend_matte = src->alpha_meaningful && src->channels == 4 && dest->compositing_mode == Blend_with_matte;
+    //Blending with the matte leaves the row demultiplied
+    const bool demultiply = !blend_matte && src->channels == 4 && src->alpha_premultiplied && dest->compositing_mode != Blend_with_self;
 
     bool can_compose = dest->compositing_mode == Blend_with_self && src->alpha_meaningful && src->channels == 4;
 
@@ -293,44 +858,73 @@ bool BitmapFloat_pivoting_composite_linear_over_srgb(Context * context, BitmapFl
         return false;
     }
 
+    MatteColor matte;
+    if (blend_matte) {
+        MatteColor_init(context, &matte, dest->matte_color, dest);
+    }
+
     //Tiling does not appear to show benefits when benchmarking - only briefly investigated
     bool tile_when_transposing = false;
 
-    if (transpose && tile_when_transposing) {
+    //Each row goes through every step (color matrix included) while it is still in cache
+    for (uint32_t row = from_row; row < from_row + row_count; row++) {
+        const uint32_t to_row = dest_row + (row - from_row);
 
-        //Let's try to tile within 2kb, get some cache coherency
-        const float dest_opt_rows = 2048.0f / (float)dest->stride;
+        if (color_matrix != NULL && !BitmapFloat_apply_color_matrix_bgra(context, src, row, 1, color_matrix)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        if (blend_matte) {
+            if (!BitmapFloat_copy_spans_over_matte(context, src, row, dest, to_row, transpose, &matte)) {
+                CONTEXT_add_to_callstack (context);
+                return false;
+            }
+            continue;
+        }
+        if (demultiply && !BitmapFloat_demultiply_alpha(context, src, row, 1)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
 
-        const int tile_width = int_max(4, (int)dest_opt_rows);
-        const int tiles = src->w / tile_width;
+        if (transpose && tile_when_transposing) {
 
-        if (can_compose) {
-            for (int i = 0; i < tiles; i++) {
-                if (!BitmapFloat_compose_linear_over_srgb(context, src, from_row, dest, dest_row, row_count, i * tile_width, tile_width, transpose)) {
-                    CONTEXT_add_to_callstack (context);
-                    return false;
+            //Let's try to tile within 2kb, get some cache coherency
+            const float dest_opt_rows = 2048.0f / (float)dest->stride;
+
+            const int tile_width = int_max(4, (int)dest_opt_rows);
+            const int tiles = src->w / tile_width;
+
+            if (can_compose) {
+                for (int i = 0; i < tiles; i++) {
+                    if (!BitmapFloat_compose_linear_over_srgb(context, src, row, dest, to_row, 1, i * tile_width, tile_width, transpose)) {
+                        CONTEXT_add_to_callstack (context);
+                        return false;
+                    }
+                }
+            } else {
+                for (int i = 0; i < tiles; i++) {
+                    if (!BitmapFloat_copy_linear_over_srgb(context, src, row, dest, to_row, 1, i * tile_width, tile_width, transpose)) {
+                        CONTEXT_add_to_callstack (context);
+                        return false;
+                    }
                 }
             }
         } else {
-            for (int i = 0; i < tiles; i++) {
-                if (!BitmapFloat_copy_linear_over_srgb(context, src, from_row, dest, dest_row, row_count, i * tile_width, tile_width, transpose)) {
+            if (can_compose) {
+                if (!BitmapFloat_compose_spans_linear_over_srgb(context, src, row, dest, to_row, transpose)) {
+                    CONTEXT_add_to_callstack (context);
+                    return false;
+                }
+            } else {
+                if (!BitmapFloat_copy_linear_over_srgb(context, src, row, dest, to_row, 1, 0,src->w,transpose)) {
                     CONTEXT_add_to_callstack (context);
                     return false;
                 }
             }
         }
-    } else {
-        if (can_compose) {
-            if (!BitmapFloat_compose_linear_over_srgb(context, src, from_row, dest, dest_row, row_count, 0, src->w, transpose)) {
-                CONTEXT_add_to_callstack (context);
-                return false;
-            }
-        } else {
-            if (!BitmapFloat_copy_linear_over_srgb(context, src, from_row, dest, dest_row, row_count, 0,src->w,transpose)) {
-                CONTEXT_add_to_callstack (context);
-                return false;
-            }
-        }
+    }
+    if (blend_matte) {
+        src->alpha_premultiplied = false;
     }
 
     return true;
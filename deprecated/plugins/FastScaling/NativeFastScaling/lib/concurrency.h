@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#pragma once
+
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//Minimal atomics (sequentially consistent unless named otherwise) and a spinlock, for the few process-wide structures we keep.
+//Everything else in the library is per-Context and needs no synchronization.
+//Worker threads are only used for jobs that split into independent bands and never touch the Context.
+
+typedef void (*ThreadFunction)(void * arg);
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+
+static inline int64_t atomic_load_int64(volatile int64_t * target)
+{
+    return InterlockedCompareExchange64((volatile LONGLONG *)target, 0, 0);
+}
+static inline void atomic_store_int64(volatile int64_t * target, int64_t value)
+{
+    InterlockedExchange64((volatile LONGLONG *)target, value);
+}
+//Returns the new value
+static inline int64_t atomic_add_int64(volatile int64_t * target, int64_t value)
+{
+    return InterlockedExchangeAdd64((volatile LONGLONG *)target, value) + value;
+}
+//Relaxed: no ordering, only an untorn value. For hints such as timestamps, where a shared read-modify-write would cost
+//more than the hint is worth.
+static inline void atomic_store_int64_relaxed(volatile int64_t * target, int64_t value)
+{
+#ifdef _WIN64
+    *target = value;
+#else
+    InterlockedExchange64((volatile LONGLONG *)target, value);
+#endif
+}
+static inline void * atomic_load_pointer(void * volatile * target)
+{
+    return InterlockedCompareExchangePointer(target, NULL, NULL);
+}
+static inline void atomic_store_pointer(void * volatile * target, void * value)
+{
+    InterlockedExchangePointer(target, value);
+}
+static inline bool atomic_try_acquire_flag(volatile long * flag)
+{
+    return InterlockedExchange(flag, 1) == 0;
+}
+static inline void atomic_release_flag(volatile long * flag)
+{
+    InterlockedExchange(flag, 0);
+}
+static inline void thread_yield(void)
+{
+    SwitchToThread();
+}
+static inline uint32_t processor_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+typedef struct {
+    HANDLE handle;
+    ThreadFunction function;
+    void * arg;
+} Thread;
+
+static inline DWORD WINAPI Thread_trampoline(LPVOID thread)
+{
+    ((Thread *)thread)->function(((Thread *)thread)->arg);
+    return 0;
+}
+//Returns false if no thread could be started; the caller can run the function itself
+static inline bool Thread_start(Thread * thread, ThreadFunction function, void * arg)
+{
+    thread->function = function;
+    thread->arg = arg;
+    thread->handle = CreateThread(NULL, 0, Thread_trampoline, thread, 0, NULL);
+    return thread->handle != NULL;
+}
+static inline void Thread_join(Thread * thread)
+{
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+}
+
+#else
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+
+static inline int64_t atomic_load_int64(volatile int64_t * target)
+{
+    return __atomic_load_n(target, __ATOMIC_SEQ_CST);
+}
+static inline void atomic_store_int64(volatile int64_t * target, int64_t value)
+{
+    __atomic_store_n(target, value, __ATOMIC_SEQ_CST);
+}
+//Returns the new value
+static inline int64_t atomic_add_int64(volatile int64_t * target, int64_t value)
+{
+    return __atomic_add_fetch(target, value, __ATOMIC_SEQ_CST);
+}
+//Relaxed: no ordering, only an untorn value. For hints such as timestamps, where a shared read-modify-write would cost
+//more than the hint is worth.
+static inline void atomic_store_int64_relaxed(volatile int64_t * target, int64_t value)
+{
+    __atomic_store_n(target, value, __ATOMIC_RELAXED);
+}
+static inline void * atomic_load_pointer(void * volatile * target)
+{
+    return __atomic_load_n(target, __ATOMIC_SEQ_CST);
+}
+static inline void atomic_store_pointer(void * volatile * target, void * value)
+{
+    __atomic_store_n(target, value, __ATOMIC_SEQ_CST);
+}
+static inline bool atomic_try_acquire_flag(volatile long * flag)
+{
+    return __atomic_exchange_n(flag, 1, __ATOMIC_ACQUIRE) == 0;
+}
+static inline void atomic_release_flag(volatile long * flag)
+{
+    __atomic_store_n(flag, 0, __ATOMIC_RELEASE);
+}
+static inline void thread_yield(void)
+{
+    sched_yield();
+}
+static inline uint32_t processor_count(void)
+{
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (uint32_t)count : 1;
+}
+
+typedef struct {
+    pthread_t handle;
+    ThreadFunction function;
+    void * arg;
+} Thread;
+
+static inline void * Thread_trampoline(void * thread)
+{
+    ((Thread *)thread)->function(((Thread *)thread)->arg);
+    return NULL;
+}
+//Returns false if no thread could be started; the caller can run the function itself
+static inline bool Thread_start(Thread * thread, ThreadFunction function, void * arg)
+{
+    thread->function = function;
+    thread->arg = arg;
+    return pthread_create(&thread->handle, NULL, Thread_trampoline, thread) == 0;
+}
+static inline void Thread_join(Thread * thread)
+{
+    pthread_join(thread->handle, NULL);
+}
+#endif
+
+//Only held for short, allocation-free critical sections; waiters yield rather than block.
+typedef struct {
+    volatile long flag;
+} SpinLock;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void SpinLock_acquire(SpinLock * lock)
+{
+    while (!atomic_try_acquire_flag(&lock->flag)) {
+        thread_yield();
+    }
+}
+
+static inline void SpinLock_release(SpinLock * lock)
+{
+    atomic_release_flag(&lock->flag);
+}
@@ -78,7 +78,13 @@ void * Context_calloc(Context * context, size_t instance_count, size_t instance_
 #ifdef DEBUG
     fprintf(stderr, "%s:%d calloc of %zu * %zu bytes\n", file, line, instance_count, instance_size);
 #endif
-    return context->heap._calloc(context, instance_count, instance_size, file, line);
+    void * pointer = context->heap._calloc(context, instance_count, instance_size, file, line);
+    //The heap has already checked the product for overflow
+    if (pointer != NULL && !MemoryAccounting_record(&context->memory, pointer, instance_count * instance_size, file, line)) {
+        context->heap._free(context, pointer, file, line);
+        return NULL;
+    }
+    return pointer;
 }
 
 void * Context_malloc(Context * context, size_t byte_count, const char * file, int line)
@@ -86,30 +92,45 @@ void * Context_malloc(Context * context, size_t byte_count, const char * file, i
 #ifdef DEBUG
     fprintf(stderr, "%s:%d malloc of %zu bytes\n", file, line, byte_count);
 #endif
-    return context->heap._malloc(context, byte_count, file, line);
+    void * pointer = context->heap._malloc(context, byte_count, file, line);
+    if (pointer != NULL && !MemoryAccounting_record(&context->memory, pointer, byte_count, file, line)) {
+        context->heap._free(context, pointer, file, line);
+        return NULL;
+    }
+    return pointer;
 }
 
 void Context_free(Context * context, void * pointer, const char * file, int line)
 {
+    MemoryAccounting_forget(&context->memory, pointer);
     context->heap._free(context, pointer, file, line);
 }
 
 void Context_free_static_caches(void)
 {
-
+    LineContributions_clear_cache();
+    BufferPool_clear();
 }
 
 static void * DefaultHeapManager_calloc(struct ContextStruct * context, size_t count, size_t element_size, const char * file, int line)
 {
-    return calloc(count, element_size);
+    if (element_size != 0 && count > SIZE_MAX / element_size) {
+        return NULL;
+    }
+    return BufferPool_malloc(count * element_size, true);
 }
 static void * DefaultHeapManager_malloc(struct ContextStruct * context, size_t byte_count, const char * file, int line)
 {
-    return malloc(byte_count);
+    return BufferPool_malloc(byte_count, false);
 }
 static void  DefaultHeapManager_free(struct ContextStruct * context, void * pointer, const char * file, int line)
 {
-    free(pointer);
+    BufferPool_free(pointer);
+}
+
+bool DefaultHeapManager_is_installed(const HeapManager * manager)
+{
+    return manager->_free == DefaultHeapManager_free;
 }
 
 void DefaultHeapManager_initialize(HeapManager * manager)
@@ -118,6 +139,7 @@ void DefaultHeapManager_initialize(HeapManager * manager)
     manager->_malloc = DefaultHeapManager_malloc;
     manager->_free = DefaultHeapManager_free;
     manager->_context_terminate = NULL;
+    manager->_private_state = NULL;
 }
 
 void Context_initialize(Context * context)
@@ -132,6 +154,10 @@ void Context_initialize(Context * context)
     //memset(context->error.callstack, 0, sizeof context->error.callstack);
     context->error.reason = No_Error;
     DefaultHeapManager_initialize(&context->heap);
+    MemoryAccounting_initialize(&context->memory);
+    context->stages.count = 0;
+    context->stages.enabled = false;
+    context->stages.ticks_per_second = 0;
     Context_set_floatspace (context, Floatspace_as_is, 0.0f, 0.0f, 0.0f);
 }
 
@@ -147,10 +173,13 @@ Context * Context_create(void)
 void Context_terminate(Context * context)
 {
     if (context != NULL) {
+        //Free through the heap manager before it goes away
+        CONTEXT_free(context, context->log.log);
+        context->log.log = NULL;
         if (context->heap._context_terminate != NULL) {
             context->heap._context_terminate(context);
         }
-        CONTEXT_free(context, context->log.log);
+        MemoryAccounting_terminate(&context->memory);
     }
 }
 void Context_destroy(Context * context)
@@ -183,24 +212,34 @@ bool Context_enable_profiling(Context * context, uint32_t default_capacity)
 
 void Context_profiler_start(Context * context, const char * name, bool allow_recursion)
 {
+    if (context->log.log == NULL && !context->stages.enabled) return;
+    const int64_t now = get_high_precision_ticks();
+    if (context->stages.enabled) {
+        StageTimers_start(&context->stages, name, now);
+    }
     if (context->log.log == NULL) return;
     ProfilingEntry * current = &(context->log.log[context->log.count]);
     context->log.count++;
     if (context->log.count >= context->log.capacity) return;
 
-    current->time =get_high_precision_ticks();
+    current->time = now;
     current->name = name;
     current->flags = allow_recursion ? Profiling_start_allow_recursion : Profiling_start;
 }
 
-void Context_profiler_stop(Context * context, const char * name, bool assert_started, bool stop_children)
+static void Context_profiler_stop_internal(Context * context, const char * name, bool assert_started, bool stop_children, uint64_t pixels, uint64_t bytes)
 {
+    if (context->log.log == NULL && !context->stages.enabled) return;
+    const int64_t now = get_high_precision_ticks();
+    if (context->stages.enabled) {
+        StageTimers_stop(&context->stages, name, now, pixels, bytes);
+    }
     if (context->log.log == NULL) return;
     ProfilingEntry * current = &(context->log.log[context->log.count]);
     context->log.count++;
     if (context->log.count >= context->log.capacity) return;
 
-    current->time =get_high_precision_ticks();
+    current->time = now;
     current->name = name;
     current->flags = assert_started ? Profiling_stop_assert_started : Profiling_stop;
     if (stop_children) {
@@ -208,35 +247,19 @@ void Context_profiler_stop(Context * context, const char * name, bool assert_sta
     }
 }
 
-
-ProfilingLog * Context_get_profiler_log(Context * context)
+void Context_profiler_stop(Context * context, const char * name, bool assert_started, bool stop_children)
 {
-    return &context->log;
+    Context_profiler_stop_internal(context, name, assert_started, stop_children, 0, 0);
 }
 
-
-/* Aligned allocations
-
-#include <stdlib.h>
-#include "malloc.h"
-
-#define ir_malloc(size) _aligned_malloc(size, 32)
-#define ir_free(ptr) _aligned_free(ptr)
+void Context_profiler_stop_work(Context * context, const char * name, uint64_t pixels, uint64_t bytes)
+{
+    Context_profiler_stop_internal(context, name, true, false, pixels, bytes);
+}
 
 
-_declspec(noalias) _declspec(restrict) inline void* _ir_aligned_calloc(size_t count, size_t elsize, size_t alignment){
-    if (elsize == 0 || count >= SIZE_MAX / elsize) { return NULL; } // Watch out for overflow
-    size_t size = count * elsize;
-    void *memory = _aligned_malloc(size, alignment);
-    if (memory != NULL) { memset(memory, 0, size); }
-    return memory;
+ProfilingLog * Context_get_profiler_log(Context * context)
+{
+    return &context->log;
 }
 
-#define ir_calloc(count, element_size) _ir_aligned_calloc(count,element_size, 32)
-#else
-#define ir_malloc(size) malloc(size)
-#define ir_free(ptr) free(ptr)
-#define ir_calloc(count, element_size) calloc(count,element_size)
-#endif
-*/
-
@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+#include "concurrency.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//Process-wide cache of LineContributions, shared by every Context.
+//Entries are immutable once published, so hits only need an atomic reference count. Readers walk the bucket chains without
+//locking; the lock is only taken to link or evict entries. The cache holds a reference to every entry it links, and
+//keeps it after eviction until no reader could still find the entry; whoever drops the last reference frees it.
+//Entries are allocated with malloc rather than a Context heap, since they outlive the Context that created them.
+//
+//Readers count themselves in their bucket, under one of two phases. Entries evicted during a phase wait until the phase
+//has been flipped and its last reader, in any bucket, has left; readers that start later can't reach them. Since new
+//readers join the new phase, the old one always drains, and whichever reader leaves it last drops their references.
+
+#define CONTRIBUTIONS_CACHE_BUCKETS 256
+#define CONTRIBUTIONS_CACHE_DEFAULT_LIMIT (16 * 1024 * 1024)
+
+typedef struct {
+    uint32_t output_line_size;
+    uint32_t input_line_size;
+    detailed_interpolation_method filter;
+    double window;
+    double blur;
+    double p1, p2, p3, q1, q2, q3, q4;
+    double sharpen_percent_goal;
+    bool tabulated;
+} ContributionsKey;
+
+typedef struct CachedLineContributionsStruct {
+    //Must remain the first member; callers only see this part.
+    LineContributions contributions;
+    ContributionsKey key;
+    uint32_t hash;
+    size_t byte_count;
+    struct CachedLineContributionsStruct * volatile next;
+    struct CachedLineContributionsStruct * retired_next;
+    volatile int64_t references;
+    //A timestamp, not a counter, so hits don't contend on a shared clock. Only read to pick what to evict.
+    volatile int64_t last_used;
+} CachedLineContributions;
+
+typedef struct {
+    CachedLineContributions * volatile head;
+    volatile int64_t readers[2];
+    //Keeps each bucket on its own cache line, so readers of one don't slow down readers of another
+    uint8_t padding[64 - sizeof(void *) - 2 * sizeof(int64_t)];
+} ContributionsBucket;
+
+static ContributionsBucket cache_buckets[CONTRIBUTIONS_CACHE_BUCKETS];
+static SpinLock cache_lock = SPINLOCK_INIT;
+//0 or 1; only changed with the lock held
+static volatile int64_t cache_phase = 0;
+//Protected by cache_lock
+static size_t cache_total_bytes = 0;
+static size_t cache_byte_limit = CONTRIBUTIONS_CACHE_DEFAULT_LIMIT;
+//Evicted during the current phase
+static CachedLineContributions * cache_retired_pending = NULL;
+//Evicted before the last flip; unreachable once the previous phase has no readers left
+static CachedLineContributions * cache_retired_waiting = NULL;
+//Evicted or uncacheable entries not yet freed
+static volatile int64_t cache_retired_bytes = 0;
+
+static void ContributionsKey_init(ContributionsKey * key, const uint32_t output_line_size, const uint32_t input_line_size, const InterpolationDetails * details)
+{
+    memset(key, 0, sizeof(ContributionsKey));
+    key->output_line_size = output_line_size;
+    key->input_line_size = input_line_size;
+    key->filter = details->filter;
+    key->window = details->window;
+    key->blur = details->blur;
+    key->p1 = details->p1;
+    key->p2 = details->p2;
+    key->p3 = details->p3;
+    key->q1 = details->q1;
+    key->q2 = details->q2;
+    key->q3 = details->q3;
+    key->q4 = details->q4;
+    key->sharpen_percent_goal = details->sharpen_percent_goal;
+    key->tabulated = InterpolationDetails_table_is_current(details);
+}
+
+static bool ContributionsKey_equals(const ContributionsKey * a, const ContributionsKey * b)
+{
+    return a->output_line_size == b->output_line_size && a->input_line_size == b->input_line_size &&
+           a->filter == b->filter && a->window == b->window && a->blur == b->blur &&
+           a->p1 == b->p1 && a->p2 == b->p2 && a->p3 == b->p3 &&
+           a->q1 == b->q1 && a->q2 == b->q2 && a->q3 == b->q3 && a->q4 == b->q4 &&
+           a->sharpen_percent_goal == b->sharpen_percent_goal && a->tabulated == b->tabulated;
+}
+
+//FNV-1a. The key is zeroed before being filled, so padding bytes are stable.
+static uint32_t ContributionsKey_hash(const ContributionsKey * key)
+{
+    const uint8_t * bytes = (const uint8_t *)key;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(ContributionsKey); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t LineContributions_row_weight_count(const PixelContributions * row)
+{
+    //Rows whose weights were all zero end up with Right < Left
+    return row->Right >= row->Left ? (uint32_t)(row->Right - row->Left + 1) : 0;
+}
+
+//Copies the contributions into a single malloc block, packing each row's weights back to back.
+static CachedLineContributions * CachedLineContributions_create(Context * context, const LineContributions * source, const ContributionsKey * key, uint32_t hash)
+{
+    size_t weight_count = 0;
+    for (uint32_t u = 0; u < source->LineLength; u++) {
+        weight_count += LineContributions_row_weight_count(&source->ContribRow[u]);
+    }
+    const size_t byte_count = sizeof(CachedLineContributions) + source->LineLength * sizeof(PixelContributions) + weight_count * sizeof(float);
+    CachedLineContributions * entry = (CachedLineContributions *)malloc(byte_count);
+    if (entry == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    PixelContributions * rows = (PixelContributions *)(entry + 1);
+    float * weights = (float *)(rows + source->LineLength);
+
+    entry->contributions.ContribRow = rows;
+    entry->contributions.WindowSize = source->WindowSize;
+    entry->contributions.LineLength = source->LineLength;
+    entry->contributions.percent_negative = source->percent_negative;
+    for (uint32_t u = 0; u < source->LineLength; u++) {
+        const uint32_t count = LineContributions_row_weight_count(&source->ContribRow[u]);
+        rows[u].Left = source->ContribRow[u].Left;
+        rows[u].Right = source->ContribRow[u].Right;
+        rows[u].Weights = weights;
+        memcpy(weights, source->ContribRow[u].Weights, count * sizeof(float));
+        weights += count;
+    }
+    entry->key = *key;
+    entry->hash = hash;
+    entry->byte_count = byte_count;
+    entry->next = NULL;
+    entry->retired_next = NULL;
+    entry->references = 1;
+    entry->last_used = get_high_precision_ticks();
+    return entry;
+}
+
+//For entries that were evicted or never cached
+static void CachedLineContributions_destroy(CachedLineContributions * entry)
+{
+    atomic_add_int64(&cache_retired_bytes, -(int64_t)entry->byte_count);
+    free(entry);
+}
+
+//Takes a reference to the matching entry. Either the lock must be held, or the caller must be counted as a reader.
+static CachedLineContributions * ContributionsCache_lookup(ContributionsBucket * bucket, const ContributionsKey * key, uint32_t hash)
+{
+    CachedLineContributions * entry = (CachedLineContributions *)atomic_load_pointer((void * volatile *)&bucket->head);
+    while (entry != NULL) {
+        if (entry->hash == hash && ContributionsKey_equals(&entry->key, key)) {
+            atomic_add_int64(&entry->references, 1);
+            atomic_store_int64_relaxed(&entry->last_used, get_high_precision_ticks());
+            return entry;
+        }
+        entry = (CachedLineContributions *)atomic_load_pointer((void * volatile *)&entry->next);
+    }
+    return NULL;
+}
+
+//Lock must be held. The entry must have just been unlinked from its bucket.
+static void ContributionsCache_retire(CachedLineContributions * entry)
+{
+    atomic_add_int64(&cache_retired_bytes, (int64_t)entry->byte_count);
+    entry->retired_next = cache_retired_pending;
+    cache_retired_pending = entry;
+}
+
+static bool ContributionsCache_phase_is_empty(int64_t phase)
+{
+    for (uint32_t b = 0; b < CONTRIBUTIONS_CACHE_BUCKETS; b++) {
+        if (atomic_load_int64(&cache_buckets[b].readers[phase]) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//Lock must be held. Unlinks the least recently used entry; returns false if the cache is empty.
+static bool ContributionsCache_evict_oldest(void)
+{
+    CachedLineContributions * volatile * oldest_link = NULL;
+    int64_t oldest_time = INT64_MAX;
+    for (uint32_t b = 0; b < CONTRIBUTIONS_CACHE_BUCKETS; b++) {
+        CachedLineContributions * volatile * link = &cache_buckets[b].head;
+        while (*link != NULL) {
+            const int64_t last_used = atomic_load_int64(&(*link)->last_used);
+            if (last_used < oldest_time) {
+                oldest_time = last_used;
+                oldest_link = link;
+            }
+            link = &(*link)->next;
+        }
+    }
+    if (oldest_link == NULL) {
+        return false;
+    }
+    CachedLineContributions * oldest = *oldest_link;
+    //Readers already past this link may still be on 'oldest'; it keeps its own next pointer until freed.
+    atomic_store_pointer((void * volatile *)oldest_link, oldest->next);
+    cache_total_bytes -= oldest->byte_count;
+    ContributionsCache_retire(oldest);
+    return true;
+}
+
+//Lock must be held. Drops the cache's reference to retired entries that can no longer be reached, and returns those
+//nobody else holds; the caller frees them after unlocking.
+static CachedLineContributions * ContributionsCache_collect_garbage(void)
+{
+    CachedLineContributions * garbage = NULL;
+    int64_t phase = atomic_load_int64(&cache_phase);
+    for (;;) {
+        if (cache_retired_waiting != NULL) {
+            //A reader of the previous phase may still take a reference to them
+            if (!ContributionsCache_phase_is_empty(phase ^ 1)) {
+                break;
+            }
+            while (cache_retired_waiting != NULL) {
+                CachedLineContributions * entry = cache_retired_waiting;
+                cache_retired_waiting = entry->retired_next;
+                //Otherwise the last release frees it
+                if (atomic_add_int64(&entry->references, -1) == 0) {
+                    entry->retired_next = garbage;
+                    garbage = entry;
+                }
+            }
+        }
+        if (cache_retired_pending == NULL) {
+            break;
+        }
+        cache_retired_waiting = cache_retired_pending;
+        cache_retired_pending = NULL;
+        phase ^= 1;
+        atomic_store_int64(&cache_phase, phase);
+    }
+    return garbage;
+}
+
+static void ContributionsCache_free_list(CachedLineContributions * list)
+{
+    while (list != NULL) {
+        CachedLineContributions * next = list->retired_next;
+        CachedLineContributions_destroy(list);
+        list = next;
+    }
+}
+
+//The last reader to leave a phase that has since been flipped may be all an evicted entry is waiting for
+static void ContributionsCache_leave(ContributionsBucket * bucket, int64_t phase)
+{
+    if (atomic_add_int64(&bucket->readers[phase], -1) == 0 && atomic_load_int64(&cache_phase) != phase) {
+        SpinLock_acquire(&cache_lock);
+        CachedLineContributions * garbage = ContributionsCache_collect_garbage();
+        SpinLock_release(&cache_lock);
+        ContributionsCache_free_list(garbage);
+    }
+}
+
+//Must not be called with the lock held
+static CachedLineContributions * ContributionsCache_find(const ContributionsKey * key, uint32_t hash)
+{
+    ContributionsBucket * bucket = &cache_buckets[hash % CONTRIBUTIONS_CACHE_BUCKETS];
+    int64_t phase = atomic_load_int64(&cache_phase);
+    atomic_add_int64(&bucket->readers[phase], 1);
+    //Counting under a phase that was flipped in the meantime could go unnoticed by the flip's check, so count again
+    while (atomic_load_int64(&cache_phase) != phase) {
+        ContributionsCache_leave(bucket, phase);
+        phase = atomic_load_int64(&cache_phase);
+        atomic_add_int64(&bucket->readers[phase], 1);
+    }
+    CachedLineContributions * found = ContributionsCache_lookup(bucket, key, hash);
+    ContributionsCache_leave(bucket, phase);
+    return found;
+}
+
+//Lock must be held.
+static void ContributionsCache_shrink_to(size_t byte_limit)
+{
+    while (cache_total_bytes > byte_limit && ContributionsCache_evict_oldest()) {
+    }
+}
+
+LineContributions * LineContributions_acquire(Context * context, const uint32_t output_line_size, const uint32_t input_line_size, const InterpolationDetails * details)
+{
+    ContributionsKey key;
+    ContributionsKey_init(&key, output_line_size, input_line_size, details);
+    const uint32_t hash = ContributionsKey_hash(&key);
+
+    CachedLineContributions * entry = ContributionsCache_find(&key, hash);
+    if (entry != NULL) {
+        return &entry->contributions;
+    }
+
+    LineContributions * built = LineContributions_create(context, output_line_size, input_line_size, details);
+    if (built == NULL) {
+        CONTEXT_add_to_callstack(context);
+        return NULL;
+    }
+    CachedLineContributions * created = CachedLineContributions_create(context, built, &key, hash);
+    LineContributions_destroy(context, built);
+    if (created == NULL) {
+        CONTEXT_add_to_callstack(context);
+        return NULL;
+    }
+
+    SpinLock_acquire(&cache_lock);
+    //Another thread may have built the same contributions while we were
+    entry = ContributionsCache_lookup(&cache_buckets[hash % CONTRIBUTIONS_CACHE_BUCKETS], &key, hash);
+    CachedLineContributions * duplicate = NULL;
+    if (entry != NULL) {
+        //Never linked, so no reader can have seen it
+        duplicate = created;
+    } else if (created->byte_count <= cache_byte_limit) {
+        entry = created;
+        CachedLineContributions * volatile * bucket = &cache_buckets[hash % CONTRIBUTIONS_CACHE_BUCKETS].head;
+        //The cache's own reference
+        entry->references = 2;
+        entry->next = *bucket;
+        atomic_store_pointer((void * volatile *)bucket, entry);
+        cache_total_bytes += entry->byte_count;
+        ContributionsCache_shrink_to(cache_byte_limit);
+    } else {
+        //Too large to cache; the caller's is the only reference, so it is freed on release
+        entry = created;
+        atomic_add_int64(&cache_retired_bytes, (int64_t)entry->byte_count);
+    }
+    CachedLineContributions * garbage = ContributionsCache_collect_garbage();
+    SpinLock_release(&cache_lock);
+
+    free(duplicate);
+    ContributionsCache_free_list(garbage);
+    return &entry->contributions;
+}
+
+void LineContributions_release(Context * context, LineContributions * p)
+{
+    if (p == NULL) {
+        return;
+    }
+    CachedLineContributions * entry = (CachedLineContributions *)p;
+    //While linked, or until readers can no longer find it, the cache holds a reference of its own
+    if (atomic_add_int64(&entry->references, -1) == 0) {
+        CachedLineContributions_destroy(entry);
+    }
+}
+
+void LineContributions_set_cache_limit(size_t byte_limit)
+{
+    SpinLock_acquire(&cache_lock);
+    cache_byte_limit = byte_limit;
+    ContributionsCache_shrink_to(byte_limit);
+    CachedLineContributions * garbage = ContributionsCache_collect_garbage();
+    SpinLock_release(&cache_lock);
+    ContributionsCache_free_list(garbage);
+}
+
+void LineContributions_clear_cache(void)
+{
+    SpinLock_acquire(&cache_lock);
+    ContributionsCache_shrink_to(0);
+    CachedLineContributions * garbage = ContributionsCache_collect_garbage();
+    SpinLock_release(&cache_lock);
+    ContributionsCache_free_list(garbage);
+}
+
+size_t LineContributions_retired_bytes(void)
+{
+    return (size_t)atomic_load_int64(&cache_retired_bytes);
+}
@@ -10,6 +10,7 @@
 #endif
 
 #include "fastscaling_private.h"
+#include "simd.h"
 
 #include <string.h>
 
@@ -23,24 +24,23 @@
 #endif
 #endif
 
+//Unsharp blurs reaching further than this many pixels either side use box filters instead of a dense kernel
+#define UNSHARP_DENSE_RADIUS_MAX 8
+
 ConvolutionKernel * ConvolutionKernel_create(Context * context, uint32_t radius)
 {
     ConvolutionKernel * k = CONTEXT_calloc_array(context, 1, ConvolutionKernel);
     //For the actual array;
     float * a = CONTEXT_calloc_array(context,radius * 2 + 1, float);
-    //we assume a maximum of 4 channels are going to need buffering during convolution
-    float * buf = (float *)CONTEXT_malloc(context, (radius +2) * 4 * sizeof(float));
 
-    if (k == NULL || a == NULL || buf == NULL) {
+    if (k == NULL || a == NULL) {
         CONTEXT_free(context, k);
         CONTEXT_free(context, a);
-        CONTEXT_free(context, buf);
         CONTEXT_error(context, Out_of_memory);
         return NULL;
     }
     k->kernel = a;
     k->width = radius * 2 + 1;
-    k->buffer = buf;
     k->radius = radius;
     return k;
 
@@ -49,9 +49,7 @@ void ConvolutionKernel_destroy(Context * context, ConvolutionKernel * kernel)
 {
     if (kernel != NULL) {
         CONTEXT_free(context, kernel->kernel);
-        CONTEXT_free(context, kernel->buffer);
         kernel->kernel = NULL;
-        kernel->buffer = NULL;
     }
     CONTEXT_free(context, kernel);
 }
@@ -115,105 +113,414 @@ ConvolutionKernel * ConvolutionKernel_create_guassian_sharpen(Context * context,
 }
 
 
-bool BitmapFloat_convolve_rows(Context * context, BitmapFloat * buf,  ConvolutionKernel *kernel, uint32_t convolve_channels, uint32_t from_row, int row_count)
+//Three box filters approach a gaussian closely enough for blurs; their widths are chosen so the variances sum to stdDev squared.
+//See Wells, "Efficient synthesis of Gaussian filters by cascaded uniform filters" (1986).
+ConvolutionKernel * ConvolutionKernel_create_box_guassian(Context * context, double stdDev)
 {
+    if (!(stdDev > 0)) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return NULL;
+    }
+    const int passes = 3;
+    const double ideal_width = sqrt(12 * stdDev * stdDev / passes + 1);
+    int lower_width = (int)floor(ideal_width);
+    if (lower_width % 2 == 0) lower_width--;
+    const int upper_width = lower_width + 2;
+    //How many passes use the narrower box
+    const int lower_count = (int)floor((12 * stdDev * stdDev - passes * lower_width * lower_width - 4 * passes * lower_width - 3 * passes) / (-4.0 * lower_width - 4) + 0.5);
+
+    uint32_t radii[3];
+    uint32_t radius = 0;
+    for (int i = 0; i < passes; i++) {
+        //Wider boxes first, so box_radii[0] is only 0 when every box is
+        radii[i] = (uint32_t)((i < passes - lower_count ? upper_width : lower_width) - 1) / 2;
+        radius += radii[i];
+    }
+
+    ConvolutionKernel * k = ConvolutionKernel_create(context, radius);
+    if (k == NULL) {
+        CONTEXT_add_to_callstack(context);
+        return NULL;
+    }
+    //Convolve the three boxes together for the equivalent weights
+    double * weights = CONTEXT_calloc_array(context, k->width * 2, double);
+    if (weights == NULL) {
+        ConvolutionKernel_destroy(context, k);
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    double * next = weights + k->width;
+    uint32_t length = 1;
+    weights[0] = 1;
+    for (int i = 0; i < passes; i++) {
+        const uint32_t box_width = radii[i] * 2 + 1;
+        for (uint32_t j = 0; j < length + box_width - 1; j++) {
+            double sum = 0;
+            for (uint32_t b = 0; b < box_width; b++) {
+                if (j >= b && j - b < length) sum += weights[j - b];
+            }
+            next[j] = sum / box_width;
+        }
+        length += box_width - 1;
+        memcpy(weights, next, length * sizeof(double));
+        k->box_radii[i] = radii[i];
+    }
+    for (uint32_t i = 0; i < k->width; i++) {
+        k->kernel[i] = (float)weights[i];
+    }
+    CONTEXT_free(context, weights);
+    return k;
+}
 
-    const uint32_t radius = kernel->radius;
-    const float threshold_min = kernel->threshold_min_change;
-    const float threshold_max = kernel->threshold_max_change;
+//Pixels whose window runs off either end only sample what's present, and divide by the weight they did use
+static inline void convolve_edge_pixels(const float * __restrict src, float * __restrict dest, const float * __restrict kern, const int32_t radius, const int32_t w, const uint32_t step, const uint32_t channels, const int32_t from, const int32_t to)
+{
+    for (int32_t ndx = from; ndx < to; ndx++) {
+        const int32_t left = ndx - radius;
+        const int32_t first = left < 0 ? 0 : left;
+        const int32_t last = ndx + radius >= w ? w - 1 : ndx + radius;
+        float avg[4] = { 0, 0, 0, 0 };
+        float total_weight = 0;
+        for (int32_t i = first; i <= last; i++) {
+            const float weight = kern[i - left];
+            total_weight += weight;
+            for (uint32_t j = 0; j < channels; j++)
+                avg[j] += weight * src[i * step + j];
+        }
+        for (uint32_t j = 0; j < channels; j++)
+            dest[ndx * step + j] = avg[j] / total_weight;
+    }
+}
 
-    //Do nothing unless the image is at least half as wide as the kernel.
-    if (buf->w < radius + 1) return true;
+static inline void convolve_interior_pixels(const float * __restrict src, float * __restrict dest, const float * __restrict kern, const uint32_t kernel_width, const int32_t radius, const uint32_t step, const uint32_t channels, const int32_t from, const int32_t to)
+{
+    for (int32_t ndx = from; ndx < to; ndx++) {
+        const float * window = &src[(ndx - radius) * step];
+        float avg[4] = { 0, 0, 0, 0 };
+        for (uint32_t k = 0; k < kernel_width; k++) {
+            for (uint32_t j = 0; j < channels; j++)
+                avg[j] += kern[k] * window[k * step + j];
+        }
+        for (uint32_t j = 0; j < channels; j++)
+            dest[ndx * step + j] = avg[j];
+    }
+}
 
-    const uint32_t buffer_count = radius + 1;
-    const uint32_t w = buf->w;
-    const int32_t int_w = (int32_t)buf->w;
-    const uint32_t step = buf->channels;
+//When every channel is convolved, the same kernel applies to each float of the row, with taps 'step' floats apart.
+//The vector loops below fill dest[from, to) and return where they stopped.
 
-    const uint32_t until_row = row_count < 0 ? buf->h : from_row + (unsigned)row_count;
+#ifdef FASTSCALING_AVX2
+static AVX2_FUNCTION uint32_t convolve_floats_avx2(const float * __restrict src, float * __restrict dest, const float * __restrict kern, const uint32_t kernel_width, const uint32_t step, const uint32_t from, const uint32_t to)
+{
+    uint32_t f = from;
+    //Four independent accumulators hide the FMA latency
+    for (; f + 32 <= to; f += 32) {
+        const float * window = &src[f];
+        __m256 a0 = _mm256_setzero_ps();
+        __m256 a1 = _mm256_setzero_ps();
+        __m256 a2 = _mm256_setzero_ps();
+        __m256 a3 = _mm256_setzero_ps();
+        for (uint32_t k = 0; k < kernel_width; k++, window += step) {
+            const __m256 weight = _mm256_broadcast_ss(&kern[k]);
+            a0 = _mm256_fmadd_ps(weight, _mm256_loadu_ps(window), a0);
+            a1 = _mm256_fmadd_ps(weight, _mm256_loadu_ps(window + 8), a1);
+            a2 = _mm256_fmadd_ps(weight, _mm256_loadu_ps(window + 16), a2);
+            a3 = _mm256_fmadd_ps(weight, _mm256_loadu_ps(window + 24), a3);
+        }
+        _mm256_storeu_ps(&dest[f], a0);
+        _mm256_storeu_ps(&dest[f + 8], a1);
+        _mm256_storeu_ps(&dest[f + 16], a2);
+        _mm256_storeu_ps(&dest[f + 24], a3);
+    }
+    for (; f + 8 <= to; f += 8) {
+        const float * window = &src[f];
+        __m256 a0 = _mm256_setzero_ps();
+        for (uint32_t k = 0; k < kernel_width; k++, window += step) {
+            a0 = _mm256_fmadd_ps(_mm256_broadcast_ss(&kern[k]), _mm256_loadu_ps(window), a0);
+        }
+        _mm256_storeu_ps(&dest[f], a0);
+    }
+    return f;
+}
+#endif
 
-    const uint32_t ch_used = convolve_channels;
+#ifdef FASTSCALING_SSE2
+static uint32_t convolve_floats_sse2(const float * __restrict src, float * __restrict dest, const float * __restrict kern, const uint32_t kernel_width, const uint32_t step, const uint32_t from, const uint32_t to)
+{
+    uint32_t f = from;
+    for (; f + 8 <= to; f += 8) {
+        const float * window = &src[f];
+        __m128 a0 = _mm_setzero_ps();
+        __m128 a1 = _mm_setzero_ps();
+        for (uint32_t k = 0; k < kernel_width; k++, window += step) {
+            const __m128 weight = _mm_set1_ps(kern[k]);
+            a0 = _mm_add_ps(a0, _mm_mul_ps(weight, _mm_loadu_ps(window)));
+            a1 = _mm_add_ps(a1, _mm_mul_ps(weight, _mm_loadu_ps(window + 4)));
+        }
+        _mm_storeu_ps(&dest[f], a0);
+        _mm_storeu_ps(&dest[f + 4], a1);
+    }
+    for (; f + 4 <= to; f += 4) {
+        const float * window = &src[f];
+        __m128 a0 = _mm_setzero_ps();
+        for (uint32_t k = 0; k < kernel_width; k++, window += step) {
+            a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_set1_ps(kern[k]), _mm_loadu_ps(window)));
+        }
+        _mm_storeu_ps(&dest[f], a0);
+    }
+    return f;
+}
 
-    float* __restrict buffer =  kernel->buffer;
-    float* __restrict avg = &kernel->buffer[buffer_count * ch_used];
+//[x[i], x[i], y[j], y[j]]
+#define PICK_PAIR(x, i, y, j) _mm_shuffle_ps((x), (y), _MM_SHUFFLE((j), (j), (i), (i)))
+//[lo[0], lo[2], hi[0], hi[2]]
+#define JOIN_PAIRS(lo, hi) _mm_shuffle_ps((lo), (hi), _MM_SHUFFLE(2, 0, 2, 0))
 
-    const float  * __restrict kern = kernel->kernel;
+//Returns the summed absolute change of 4 consecutive pixels, adding channels in the same order as the scalar loop
+static inline __m128 change_of_4_pixels_sse2(const float * src, const float * avg, const uint32_t channels)
+{
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 d0 = _mm_and_ps(abs_mask, _mm_sub_ps(_mm_loadu_ps(src), _mm_loadu_ps(avg)));
+    const __m128 d1 = _mm_and_ps(abs_mask, _mm_sub_ps(_mm_loadu_ps(src + 4), _mm_loadu_ps(avg + 4)));
+    const __m128 d2 = _mm_and_ps(abs_mask, _mm_sub_ps(_mm_loadu_ps(src + 8), _mm_loadu_ps(avg + 8)));
+    if (channels == 4) {
+        __m128 d3 = _mm_and_ps(abs_mask, _mm_sub_ps(_mm_loadu_ps(src + 12), _mm_loadu_ps(avg + 12)));
+        __m128 c0 = d0, c1 = d1, c2 = d2;
+        _MM_TRANSPOSE4_PS(c0, c1, c2, d3);
+        return _mm_add_ps(_mm_add_ps(_mm_add_ps(c0, c1), c2), d3);
+    }
+    //3 channels: d0..d2 hold b0 g0 r0 b1 | g1 r1 b2 g2 | r2 b3 g3 r3
+    const __m128 b = JOIN_PAIRS(PICK_PAIR(d0, 0, d0, 3), PICK_PAIR(d1, 2, d2, 1));
+    const __m128 g = JOIN_PAIRS(PICK_PAIR(d0, 1, d1, 0), PICK_PAIR(d1, 3, d2, 2));
+    const __m128 r = JOIN_PAIRS(PICK_PAIR(d0, 2, d1, 1), PICK_PAIR(d2, 0, d2, 3));
+    return _mm_add_ps(_mm_add_ps(b, g), r);
+}
+#endif
 
-    const int  wrap_mode = 0;
+//Puts back the source pixels whose change falls outside [threshold_min, threshold_max]
+static inline void apply_change_threshold(const float * __restrict src, float * __restrict dest, const uint32_t w, const uint32_t step, const uint32_t channels, const float threshold_min, const float threshold_max)
+{
+    uint32_t ndx = 0;
+#ifdef FASTSCALING_SSE2
+    if (step == channels && (channels == 3 || channels == 4) && simd_level() >= Simd_sse2) {
+        const __m128 min = _mm_set1_ps(threshold_min);
+        const __m128 max = _mm_set1_ps(threshold_max);
+        for (; ndx + 4 <= w; ndx += 4) {
+            const __m128 change = change_of_4_pixels_sse2(&src[ndx * step], &dest[ndx * step], channels);
+            const int restore = _mm_movemask_ps(_mm_or_ps(_mm_cmplt_ps(change, min), _mm_cmpgt_ps(change, max)));
+            if (restore == 0) continue;
+            for (uint32_t p = 0; p < 4; p++) {
+                if ((restore & (1 << p)) != 0) {
+                    memcpy(&dest[(ndx + p) * step], &src[(ndx + p) * step], channels * sizeof(float));
+                }
+            }
+        }
+    }
+#endif
+    for (; ndx < w; ndx++) {
+        float change = 0;
+        for (uint32_t j = 0; j < channels; j++)
+            change += (float)fabs(src[ndx * step + j] - dest[ndx * step + j]);
 
-    for (uint32_t row = from_row; row < until_row; row++) {
+        if (change < threshold_min || change > threshold_max) {
+            memcpy(&dest[ndx * step], &src[ndx * step], channels * sizeof(float));
+        }
+    }
+}
+
+//Averages the pixels within 'radius' of each one with a running sum; near the ends, only the pixels present are averaged.
+static inline void box_blur_row(const float * __restrict src, float * __restrict dest, const uint32_t w, const uint32_t step, const uint32_t channels, const uint32_t radius)
+{
+    //Doubles keep the running sums from drifting over long rows
+    double sum[4] = { 0, 0, 0, 0 };
+    const int32_t r = (int32_t)radius;
+    const int32_t int_w = (int32_t)w;
+    const double full_scale = 1.0 / (2 * radius + 1);
+    for (int32_t i = 0; i <= r && i < int_w; i++) {
+        for (uint32_t j = 0; j < channels; j++)
+            sum[j] += src[i * step + j];
+    }
+    for (int32_t x = 0; x < int_w; x++) {
+        const int32_t entering = x + r;
+        const int32_t leaving = x - r - 1;
+        if (x > 0 && entering < int_w) {
+            for (uint32_t j = 0; j < channels; j++)
+                sum[j] += src[entering * step + j];
+        }
+        if (leaving >= 0) {
+            for (uint32_t j = 0; j < channels; j++)
+                sum[j] -= src[leaving * step + j];
+        }
+        const int32_t first = x - r < 0 ? 0 : x - r;
+        const int32_t last = entering >= int_w ? int_w - 1 : entering;
+        const double scale = last - first == 2 * r ? full_scale : 1.0 / (last - first + 1);
+        for (uint32_t j = 0; j < channels; j++)
+            dest[x * step + j] = (float)(sum[j] * scale);
+    }
+}
 
-        float* __restrict source_buffer = &buf->pixels[row * buf->float_stride];
-        int circular_idx = 0;
+//Three box passes, ping-ponging between 'dest' and 'temp'
+static inline void box_blur_row_3(const float * __restrict src, float * __restrict dest, float * __restrict temp, const ConvolutionKernel * kernel, const uint32_t w, const uint32_t step, const uint32_t channels)
+{
+    box_blur_row(src, dest, w, step, channels, kernel->box_radii[0]);
+    box_blur_row(dest, temp, w, step, channels, kernel->box_radii[1]);
+    box_blur_row(temp, dest, w, step, channels, kernel->box_radii[2]);
+    if (kernel->threshold_min_change > 0 || kernel->threshold_max_change > 0) {
+        apply_change_threshold(src, dest, w, step, channels, kernel->threshold_min_change, kernel->threshold_max_change);
+    }
+}
 
-        for (uint32_t ndx = 0; ndx < w + buffer_count; ndx++) {
-            //Flush old value
-            if (ndx >= buffer_count) {
-                memcpy(&source_buffer[(ndx - buffer_count) * step], &buffer[circular_idx * ch_used], ch_used * sizeof(float));
+//Convolves one row from 'src' (a copy of the row) into 'dest'.
+//Callers pass literal channel counts where they can, so the per-pixel loops have fixed trip counts once inlined.
+static inline void convolve_row(const float * __restrict src, float * __restrict dest, const ConvolutionKernel * kernel, const uint32_t w, const uint32_t step, const uint32_t channels)
+{
+    const int32_t radius = (int32_t)kernel->radius;
+    const int32_t int_w = (int32_t)w;
+    const float * __restrict kern = kernel->kernel;
+
+    if (int_w - radius <= radius) {
+        convolve_edge_pixels(src, dest, kern, radius, int_w, step, channels, 0, int_w);
+    } else {
+        convolve_edge_pixels(src, dest, kern, radius, int_w, step, channels, 0, radius);
+        if (step == channels) {
+            //Output float 'f' (counted from the first interior pixel) reads source floats f, f + step, ... f + 2 * radius * step
+            float * __restrict interior = &dest[kernel->radius * step];
+            const uint32_t count = (w - 2 * kernel->radius) * step;
+            uint32_t f = 0;
+#ifdef FASTSCALING_AVX2
+            if (simd_level() >= Simd_avx2) {
+                f = convolve_floats_avx2(src, interior, kern, kernel->width, step, f, count);
             }
-            //Calculate and enqueue new value
-            if (ndx < w) {
-                const int left = ndx - radius;
-                const int right = ndx + radius;
-                int i;
-
-                memset(avg, 0, sizeof(float) * ch_used);
-
-                if (left < 0 || right >= (int32_t)w) {
-                    if (wrap_mode == 0){
-                        //Only sample what's present, and fix the average later.
-                        float total_weight = 0;
-                        /* Accumulate each channel */
-                        for (i = left; i <= right; i++) {
-                            if (i > 0 && i < int_w){
-                                const float weight = kern[i - left];
-                                total_weight += weight;
-                                for (uint32_t j = 0; j < ch_used; j++)
-                                    avg[j] += weight * source_buffer[i * step + j];
-                            }
-                        }
-                        for (uint32_t j = 0; j < ch_used; j++)
-                            avg[j] = avg[j] / total_weight;
-                    }
-                    else if (wrap_mode == 1){
-                        //Extend last pixel to be used for all missing inputs
-                        /* Accumulate each channel */
-                        for (i = left; i <= right; i++) {
-                            const float weight = kern[i - left];
-                            const uint32_t ix = EVIL_CLAMP (i, 0, int_w - 1);
-                            for (uint32_t j = 0; j < ch_used; j++)
-                                avg[j] += weight * source_buffer[ix * step + j];
-                        }
-                    }
-                } else {
-                    /* Accumulate each channel */
-                    for (i = left; i <= right; i++) {
-                        const float weight = kern[i - left];
-                        for (uint32_t j = 0; j < ch_used; j++)
-                            avg[j] += weight * source_buffer[i * step + j];
-                    }
-                }
+#endif
+#ifdef FASTSCALING_SSE2
+            if (simd_level() >= Simd_sse2) {
+                f = convolve_floats_sse2(src, interior, kern, kernel->width, step, f, count);
+            }
+#endif
+            for (; f < count; f++) {
+                float sum = 0;
+                for (uint32_t k = 0; k < kernel->width; k++)
+                    sum += kern[k] * src[f + k * step];
+                interior[f] = sum;
+            }
+        } else {
+            convolve_interior_pixels(src, dest, kern, kernel->width, radius, step, channels, radius, int_w - radius);
+        }
+        convolve_edge_pixels(src, dest, kern, radius, int_w, step, channels, int_w - radius, int_w);
+    }
 
-                //Enqueue difference
-                memcpy(&buffer[circular_idx * ch_used], avg, ch_used * sizeof(float));
+    if (kernel->threshold_min_change > 0 || kernel->threshold_max_change > 0) {
+        apply_change_threshold(src, dest, w, step, channels, kernel->threshold_min_change, kernel->threshold_max_change);
+    }
+}
+
+//Adds back 'amount' times the detail the blur removed. Pixels the blur changed by less than 'threshold' (summed over channels) keep their value.
+static inline void unsharp_row(const float * __restrict src, float * __restrict blurred, const uint32_t w, const uint32_t step, const uint32_t channels, const float amount, const float threshold)
+{
+    if (threshold <= 0 && step == channels) {
+        for (uint32_t i = 0; i < w * step; i++)
+            blurred[i] = src[i] + amount * (src[i] - blurred[i]);
+        return;
+    }
+    for (uint32_t ndx = 0; ndx < w; ndx++) {
+        const float * s = &src[ndx * step];
+        float * b = &blurred[ndx * step];
+        float change = 0;
+        for (uint32_t j = 0; j < channels; j++)
+            change += (float)fabs(s[j] - b[j]);
+        if (change < threshold) {
+            for (uint32_t j = 0; j < channels; j++)
+                b[j] = s[j];
+        } else {
+            for (uint32_t j = 0; j < channels; j++)
+                b[j] = s[j] + amount * (s[j] - b[j]);
+        }
+    }
+}
 
-                if (threshold_min > 0 || threshold_max > 0) {
-                    float change = 0;
-                    for (uint32_t j = 0; j < ch_used; j++)
-                        change += (float)fabs(source_buffer[ndx * step + j] - avg[j]);
+//Blurs (or convolves) 'src' into 'dest', then unsharpens against the original if unsharp_amount isn't 0
+static inline void filter_row(const float * __restrict src, float * __restrict dest, float * __restrict temp, const ConvolutionKernel * kernel, const uint32_t w, const uint32_t step, const uint32_t channels, const float unsharp_amount, const float unsharp_threshold)
+{
+    if (kernel->box_radii[0] > 0) {
+        box_blur_row_3(src, dest, temp, kernel, w, step, channels);
+    } else {
+        convolve_row(src, dest, kernel, w, step, channels);
+    }
+    if (unsharp_amount != 0) {
+        unsharp_row(src, dest, w, step, channels, unsharp_amount, unsharp_threshold);
+    }
+}
 
-                    if (change < threshold_min || change > threshold_max) {
-                        memcpy(&buffer[circular_idx * ch_used], &source_buffer[ndx * step], ch_used * sizeof(float));
-                    }
-                }
-            }
-            circular_idx = (circular_idx + 1) % buffer_count;
+static bool BitmapFloat_filter_rows(Context * context, BitmapFloat * buf, const ConvolutionKernel * kernel, const uint32_t convolve_channels, const uint32_t from_row, const uint32_t until_row, const float unsharp_amount, const float unsharp_threshold)
+{
+    const bool box = kernel->box_radii[0] > 0;
+    //Do nothing unless the image is at least half as wide as the kernel. Box blurs work at any width.
+    if (!box && buf->w < kernel->radius + 1) return true;
 
+    const uint32_t w = buf->w;
+    const uint32_t step = buf->channels;
+
+    if (convolve_channels > step || until_row > buf->h) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+
+    //Each row is copied aside, so the output can be written in place while the window still reads the original values.
+    //Box blurs need a second row for their middle pass.
+    float * source_copy = (float *)CONTEXT_malloc(context, (box ? 2 : 1) * w * step * sizeof(float));
+    if (source_copy == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return false;
+    }
+    float * temp = box ? source_copy + w * step : NULL;
+
+    for (uint32_t row = from_row; row < until_row; row++) {
+        float * __restrict row_pixels = &buf->pixels[row * buf->float_stride];
+        memcpy(source_copy, row_pixels, w * step * sizeof(float));
+
+        if (step == 4 && convolve_channels == 4) {
+            filter_row(source_copy, row_pixels, temp, kernel, w, 4, 4, unsharp_amount, unsharp_threshold);
+        } else if (step == 3 && convolve_channels == 3) {
+            filter_row(source_copy, row_pixels, temp, kernel, w, 3, 3, unsharp_amount, unsharp_threshold);
+        } else {
+            filter_row(source_copy, row_pixels, temp, kernel, w, step, convolve_channels, unsharp_amount, unsharp_threshold);
         }
     }
+    CONTEXT_free(context, source_copy);
+    return true;
+}
+
+bool BitmapFloat_convolve_rows(Context * context, BitmapFloat * buf,  ConvolutionKernel *kernel, uint32_t convolve_channels, uint32_t from_row, int row_count)
+{
+    const uint32_t until_row = row_count < 0 ? buf->h : from_row + (unsigned)row_count;
+    if (!BitmapFloat_filter_rows(context, buf, kernel, convolve_channels, from_row, until_row, 0, 0)) {
+        CONTEXT_add_to_callstack(context);
+        return false;
+    }
+    return true;
+}
+
+bool BitmapFloat_unsharp_rows(Context * context, BitmapFloat * buf, const ConvolutionKernel * blur, float amount, float threshold, uint32_t from_row, uint32_t row_count)
+{
+    if (amount == 0) return true;
+    if (!BitmapFloat_filter_rows(context, buf, blur, buf->channels, from_row, from_row + row_count, amount, threshold)) {
+        CONTEXT_add_to_callstack(context);
+        return false;
+    }
     return true;
 }
 
+ConvolutionKernel * ConvolutionKernel_create_unsharp_blur(Context * context, double stdDev)
+{
+    const uint32_t radius = (uint32_t)ceil(stdDev * 3);
+    ConvolutionKernel * k = radius > UNSHARP_DENSE_RADIUS_MAX ? ConvolutionKernel_create_box_guassian(context, stdDev)
+                            : ConvolutionKernel_create_guassian_normalized(context, stdDev, radius);
+    if (k == NULL) {
+        CONTEXT_add_to_callstack(context);
+    }
+    return k;
+}
+
 
 /*
 static void BgraSharpenInPlaceX(BitmapBgra * im, float pct)
@@ -244,6 +551,91 @@ static void BgraSharpenInPlaceX(BitmapBgra * im, float pct)
 }
 */
 
+//Every float of the row is sharpened against the floats one pixel ('step') either side.
+//The vector loops keep the left neighbors' original values in a register, loading them before the previous store overwrites them.
+//They process floats [f, end) and return where they stopped; 'left' receives the original values of the 'step' floats before that.
+
+#ifdef FASTSCALING_AVX2
+static AVX2_FUNCTION uint32_t sharpen_floats_avx2(float * buf, uint32_t f, const uint32_t end, const uint32_t total, const uint32_t step, const float c_o, const float c_i, float * left_originals)
+{
+    //The look-ahead load of the next left neighbors must stay within the row
+    if (f + 8 > end || f + 16 - step > total) return f;
+    const __m256 outer = _mm256_set1_ps(c_o);
+    const __m256 inner = _mm256_set1_ps(c_i);
+    __m256 left = _mm256_loadu_ps(buf + f - step);
+    while (f + 8 <= end && f + 16 - step <= total) {
+        const __m256 center = _mm256_loadu_ps(buf + f);
+        const __m256 right = _mm256_loadu_ps(buf + f + step);
+        const __m256 next_left = _mm256_loadu_ps(buf + f + 8 - step);
+        _mm256_storeu_ps(buf + f, _mm256_fmadd_ps(outer, _mm256_add_ps(left, right), _mm256_mul_ps(inner, center)));
+        left = next_left;
+        f += 8;
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, left);
+    memcpy(left_originals, lanes, step * sizeof(float));
+    return f;
+}
+#endif
+
+#ifdef FASTSCALING_SSE2
+static uint32_t sharpen_floats_sse2(float * buf, uint32_t f, const uint32_t end, const uint32_t total, const uint32_t step, const float c_o, const float c_i, float * left_originals)
+{
+    if (f + 4 > end || f + 8 - step > total) return f;
+    const __m128 outer = _mm_set1_ps(c_o);
+    const __m128 inner = _mm_set1_ps(c_i);
+    __m128 left = _mm_loadu_ps(buf + f - step);
+    while (f + 4 <= end && f + 8 - step <= total) {
+        const __m128 center = _mm_loadu_ps(buf + f);
+        const __m128 right = _mm_loadu_ps(buf + f + step);
+        const __m128 next_left = _mm_loadu_ps(buf + f + 4 - step);
+        _mm_storeu_ps(buf + f, _mm_add_ps(_mm_mul_ps(outer, _mm_add_ps(left, right)), _mm_mul_ps(inner, center)));
+        left = next_left;
+        f += 4;
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, left);
+    memcpy(left_originals, lanes, step * sizeof(float));
+    return f;
+}
+#endif
+
+//Finishes the floats the vector loops left (fewer than 16), or short rows they couldn't start on
+static void sharpen_floats_tail(float * buf, const uint32_t f, const uint32_t end, const uint32_t step, const float c_o, const float c_i, const float * left_originals)
+{
+    float original[32];
+    memcpy(original, left_originals, step * sizeof(float));
+    memcpy(original + step, buf + f, (end + step - f) * sizeof(float));
+    for (uint32_t i = 0; i < end - f; i++) {
+        buf[f + i] = original[i] * c_o + original[i + step] * c_i + original[i + 2 * step] * c_o;
+    }
+}
+
+static bool sharpen_floats_vectorized(float * buf, const unsigned int count, const uint32_t step, const float c_o, const float c_i)
+{
+    const uint32_t total = count * step;
+    const uint32_t end = total - step;
+    uint32_t f = step;
+    //Until a vector loop runs, the left neighbors are still in the row
+    float left_originals[4];
+    memcpy(left_originals, buf, step * sizeof(float));
+#ifdef FASTSCALING_AVX2
+    if (simd_level() >= Simd_avx2) {
+        f = sharpen_floats_avx2(buf, f, end, total, step, c_o, c_i, left_originals);
+        sharpen_floats_tail(buf, f, end, step, c_o, c_i, left_originals);
+        return true;
+    }
+#endif
+#ifdef FASTSCALING_SSE2
+    if (simd_level() >= Simd_sse2) {
+        f = sharpen_floats_sse2(buf, f, end, total, step, c_o, c_i, left_originals);
+        sharpen_floats_tail(buf, f, end, step, c_o, c_i, left_originals);
+        return true;
+    }
+#endif
+    return false;
+}
+
 static void
 SharpenBgraFloatInPlace(float* buf, unsigned int count, double pct,
                         int step)
@@ -255,6 +647,9 @@ SharpenBgraFloatInPlace(float* buf, unsigned int count, double pct,
 
     unsigned int ndx;
 
+    if (count < 3) return;
+    if (sharpen_floats_vectorized(buf, count, (uint32_t)step, c_o, c_i)) return;
+
     // if both have alpha, process it
     if (step == 4) {
         float left_b = buf[0 * 4 + 0];
@@ -277,6 +672,15 @@ SharpenBgraFloatInPlace(float* buf, unsigned int count, double pct,
             left_a = a;
         }
     }
+    else if (step == 1) {
+        float left = buf[0];
+
+        for (ndx = 1; ndx < count - 1; ndx++) {
+            const float v = buf[ndx];
+            buf[ndx] = left * c_o + v * c_i + buf[ndx + 1] * c_o;
+            left = v;
+        }
+    }
     // otherwise do the same thing without 4th chan
     // (ifs in loops are expensive..)
     else {
@@ -33,7 +33,8 @@ typedef struct BitmapFloatStruct {
     bool pixels_borrowed;
     //The number of floats in the buffer
     uint32_t float_count;
-    //The number of floats between (0,0) and (0,1)
+    //The number of floats between (0,0) and (0,1). BitmapFloat_create pads it like BitmapBgra_create pads stride, so every
+    //row of an owned buffer starts on a HEAP_ALIGNMENT boundary, and the padding fits the row at 4 channels or fewer.
     uint32_t float_stride;
 
     //If true, alpha has been premultiplied
@@ -45,6 +46,42 @@ typedef struct BitmapFloatStruct {
 
 
 
+//How many samples per unit of x InterpolationKernelTable stores; lookups interpolate linearly between them
+#define INTERPOLATION_TABLE_SAMPLES_PER_UNIT 1024
+
+typedef struct InterpolationKernelTableStruct {
+    //filter(x) for x = i / INTERPOLATION_TABLE_SAMPLES_PER_UNIT. All tabulated filters are symmetric.
+    float * samples;
+    uint32_t sample_count;
+    //Cached result of InterpolationDetails_percent_negative_weight
+    double percent_negative;
+    //The parameters the samples were taken with
+    double window;
+    double p1, p2, p3, q1, q2, q3, q4;
+    double blur;
+    detailed_interpolation_method filter;
+} InterpolationKernelTable;
+
+bool InterpolationDetails_table_is_current(const InterpolationDetails * details);
+
+//Evicts every cached LineContributions; those still acquired are freed when released.
+void LineContributions_clear_cache(void);
+//Bytes held by evicted or uncacheable contributions that haven't been freed yet.
+size_t LineContributions_retired_bytes(void);
+
+static inline double InterpolationDetails_evaluate_tabulated(const InterpolationDetails * details, double x)
+{
+    const InterpolationKernelTable * table = details->table;
+    const double position = fabs(x) * INTERPOLATION_TABLE_SAMPLES_PER_UNIT;
+    if (position >= (double)(table->sample_count - 1)) {
+        return details->filter(details, x);
+    }
+    const uint32_t index = (uint32_t)position;
+    const double fraction = position - (double)index;
+    return table->samples[index] + (table->samples[index + 1] - table->samples[index]) * fraction;
+}
+
+
 /** Context: Heap Manager **/
 
 typedef void * (*context_calloc_function)(struct ContextStruct * context, size_t count, size_t element_size, const char * file, int line);
@@ -61,6 +98,19 @@ typedef struct _HeapManager {
 } HeapManager;
 
 void DefaultHeapManager_initialize(HeapManager * context);
+bool DefaultHeapManager_is_installed(const HeapManager * manager);
+
+//Every allocation from the default and arena heaps starts on this boundary - a cache line, and an AVX-512 vector.
+#define HEAP_ALIGNMENT 64
+
+//The default heap's allocator. Buffers of 64KB and up are drawn from, and returned to, a process-wide pool.
+//Buffers of 64MB and up are mapped from the OS, in huge pages where possible, and unmapped when freed.
+void * BufferPool_malloc(size_t byte_count, bool zeroed);
+void BufferPool_free(void * pointer);
+//Whether an allocation bypassed the pool for its own mapping
+bool BufferPool_is_mapped(void * pointer);
+//Frees every idle buffer in the pool
+void BufferPool_clear(void);
 
 
 /** Context: ErrorInfo **/
@@ -90,11 +140,17 @@ typedef struct _SigmoidInfo {
 
 #endif
 
+//Intervals in the floatspace -> byte table. Interpolated linearly, the largest error before rounding, measured over 2^24
+//evenly spaced inputs, is 0.0042 LSB of pow() for sRGB, and 0.045, 0.10 and 0.17 LSB for gammas 1.8, 2.2 and 2.6.
+#define FLOATSPACE_TO_BYTE_TABLE_SIZE 4096
+
 typedef struct _ColorspaceInfo {
     float byte_to_float[256]; //Converts 0..255 -> 0..1, but knowing that 0.255 has sRGB gamma.
+    float float_to_byte[FLOATSPACE_TO_BYTE_TABLE_SIZE + 1]; //Encoded, unrounded 0..255 values for evenly spaced 0..1 inputs
     WorkingFloatspace floatspace;
     bool apply_srgb;
     bool apply_gamma;
+    bool tabulate_encoding;
     float gamma;
     float gamma_inverse;
 #ifdef EXPOSE_SIGMOID
@@ -106,12 +162,68 @@ typedef struct _ColorspaceInfo {
 
 
 
+/** Context: MemoryAccounting **/
+
+#define MEMORY_ACCOUNTING_SITES 128
+
+typedef struct {
+    void * pointer;
+    size_t bytes;
+    uint32_t site;
+} LiveAllocation;
+
+//Kept by Context_calloc/malloc/free, for whichever HeapManager is installed
+typedef struct {
+    MemoryStats totals;
+    //Open addressing on the pointer, with linear probing; allocated from the system heap
+    LiveAllocation * live;
+    uint32_t live_capacity;
+    MemorySiteStats sites[MEMORY_ACCOUNTING_SITES];
+    uint32_t site_count;
+} MemoryAccounting;
+
+void MemoryAccounting_initialize(MemoryAccounting * accounting);
+void MemoryAccounting_terminate(MemoryAccounting * accounting);
+//Returns false if the live allocation table couldn't grow
+bool MemoryAccounting_record(MemoryAccounting * accounting, void * pointer, size_t bytes, const char * file, int line);
+void MemoryAccounting_forget(MemoryAccounting * accounting, void * pointer);
+//For heaps that release everything at once
+void MemoryAccounting_forget_all(MemoryAccounting * accounting);
+
+
+/** Context: StageTimers **/
+
+#define STAGE_TIMERS_MAX 32
+
+typedef struct {
+    const char * name;
+    int64_t started_at;
+    int64_t ticks;
+    uint64_t calls;
+    uint64_t pixels;
+    uint64_t bytes;
+} StageAccumulator;
+
+//Fed by the profiler calls. Stages are identified by their name; the pointer first seen is kept and compared first.
+typedef struct {
+    StageAccumulator stages[STAGE_TIMERS_MAX];
+    uint32_t count;
+    bool enabled;
+    int64_t ticks_per_second;
+} StageTimers;
+
+void StageTimers_start(StageTimers * timers, const char * name, int64_t now);
+void StageTimers_stop(StageTimers * timers, const char * name, int64_t now, uint64_t pixels, uint64_t bytes);
+
+
 /** Context: main structure **/
 
 typedef struct ContextStruct {
     ErrorInfo error;
     HeapManager heap;
+    MemoryAccounting memory;
     ProfilingLog log;
+    StageTimers stages;
     ColorspaceInfo colorspace;
 } Context;
 
@@ -150,13 +262,17 @@ void Context_add_to_callstack(Context * context, const char * file, int line);
 #ifdef ALLOW_PROFILING
 #define prof_start(context, name, allow_recursion)  Context_profiler_start(context,name,allow_recursion);
 #define prof_stop(context, name, assert_started, stop_children) Context_profiler_stop(context,name,assert_started, stop_children);
+#define prof_stop_work(context, name, pixels, bytes) Context_profiler_stop_work(context,name,pixels,bytes);
 #else
 #define prof_start(context, name, allow_recursion)
 #define prof_stop(context, name, assert_started, stop_children)
+#define prof_stop_work(context, name, pixels, bytes)
 #endif
 
 void Context_profiler_start(Context * context, const char * name, bool allow_recursion);
 void Context_profiler_stop(Context * context, const char * name, bool assert_started, bool stop_children);
+//Stops a stage that was asserted started, crediting the stage timers with the pixels and bytes it processed
+void Context_profiler_stop_work(Context * context, const char * name, uint64_t pixels, uint64_t bytes);
 
 
 
@@ -172,13 +288,31 @@ bool BitmapFloat_convolve_rows(Context * context, BitmapFloat * buf, Convolution
 
 bool BitmapFloat_sharpen_rows(Context * context, BitmapFloat * im, uint32_t start_row, uint32_t row_count, double pct);
 
+//The gaussian blur an unsharp mask of the given sigma subtracts
+ConvolutionKernel * ConvolutionKernel_create_unsharp_blur(Context * context, double stdDev);
+
+//Sharpens each row by adding back 'amount' times its difference from the blurred row, leaving pixels that differ by less than
+//'threshold' (summed over channels) as they are. Each row is blurred into a single reused buffer.
+bool BitmapFloat_unsharp_rows(Context * context, BitmapFloat * buf, const ConvolutionKernel * blur, float amount, float threshold, uint32_t from_row, uint32_t row_count);
 
+
+//Counts source rows into the histograms of BitmapBgra_populate_histogram while another stage already has them in cache
+typedef struct HistogramAccumulatorStruct HistogramAccumulator;
+
+HistogramAccumulator * HistogramAccumulator_create(Context * context, uint32_t histogram_size_per_channel, uint32_t histogram_count);
+void HistogramAccumulator_destroy(Context * context, HistogramAccumulator * h);
+bool HistogramAccumulator_add_rows(Context * context, HistogramAccumulator * h, const BitmapBgra * bmp, uint32_t from_row, uint32_t row_count);
+//Adds the counts to histograms and returns the number of pixels counted
+uint64_t HistogramAccumulator_merge_into(const HistogramAccumulator * h, uint64_t * histograms);
+
+//Also counts the source rows into histogram, if not NULL
 bool BitmapBgra_convert_srgb_to_linear(Context * context,
                                        BitmapBgra * src,
                                        uint32_t from_row,
                                        BitmapFloat * dest,
                                        uint32_t dest_row,
-                                       uint32_t row_count);
+                                       uint32_t row_count,
+                                       HistogramAccumulator * histogram);
 
 bool BitmapFloat_pivoting_composite_linear_over_srgb(Context * context,
         BitmapFloat * src,
@@ -186,16 +320,28 @@ bool BitmapFloat_pivoting_composite_linear_over_srgb(Context * context,
         BitmapBgra * dest,
         uint32_t dest_row,
         uint32_t row_count,
-        bool transpose);
+        bool transpose,
+        const ColorMatrixBgra * color_matrix);
 
 bool BitmapBgra_flip_vertical(Context * context, BitmapBgra * b);
 
+//True if every pixel in the given Bgra32 rows has an alpha of 0xFF
+bool BitmapBgra_rows_are_opaque(const BitmapBgra * b, uint32_t from_row, uint32_t row_count);
+
 bool BitmapFloat_demultiply_alpha(
     Context * context,
     BitmapFloat * src,
     const uint32_t from_row,
     const uint32_t row_count);
 
+//Blends premultiplied 4-channel rows over an sRGB BGRA matte, leaving them demultiplied
+bool BitmapFloat_blend_matte(
+    Context * context,
+    BitmapFloat * src,
+    const uint32_t from_row,
+    const uint32_t row_count,
+    const uint8_t * const matte);
+
 bool BitmapFloat_copy_linear_over_srgb(
     Context * context,
     BitmapFloat * src,
@@ -207,9 +353,10 @@ bool BitmapFloat_copy_linear_over_srgb(
     const uint32_t col_count,
     const bool transpose);
 
-bool Halve(Context * context, const BitmapBgra * from, BitmapBgra * to, int divisor);
+//Both also count every source row into histogram, if not NULL
+bool Halve(Context * context, const BitmapBgra * from, BitmapBgra * to, int divisor, HistogramAccumulator * histogram);
 
-bool HalveInPlace(Context * context, BitmapBgra * from, int divisor);
+bool HalveInPlace(Context * context, BitmapBgra * from, int divisor, HistogramAccumulator * histogram);
 
 
 
@@ -234,53 +381,50 @@ static inline int64_t get_profiler_ticks_per_second(void)
 }
 #else
 #include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 #if defined(_POSIX_VERSION)
 #if defined(_POSIX_TIMERS) && (_POSIX_TIMERS > 0)
+//CLOCK_MONOTONIC is read in user space (vDSO) on Linux; CLOCK_MONOTONIC_RAW isn't on older kernels
 #if defined(CLOCK_MONOTONIC_PRECISE)
 /* BSD. --------------------------------------------- */
-#define PROFILER_CLOCK_ID id = CLOCK_MONOTONIC_PRECISE;
-#elif defined(CLOCK_MONOTONIC_RAW)
-/* Linux. ------------------------------------------- */
-#define PROFILER_CLOCK_ID id = CLOCK_MONOTONIC_RAW;
-#elif defined(CLOCK_HIGHRES)
-/* Solaris. ----------------------------------------- */
-#define PROFILER_CLOCK_ID id = CLOCK_HIGHRES;
+#define PROFILER_CLOCK_ID CLOCK_MONOTONIC_PRECISE
 #elif defined(CLOCK_MONOTONIC)
 /* AIX, BSD, Linux, POSIX, Solaris. ----------------- */
-#define PROFILER_CLOCK_ID id = CLOCK_MONOTONIC;
+#define PROFILER_CLOCK_ID CLOCK_MONOTONIC
+#elif defined(CLOCK_HIGHRES)
+/* Solaris. ----------------------------------------- */
+#define PROFILER_CLOCK_ID CLOCK_HIGHRES
 #elif defined(CLOCK_REALTIME)
 /* AIX, BSD, HP-UX, Linux, POSIX. ------------------- */
-#define PROFILER_CLOCK_ID id = CLOCK_REALTIME;
+#define PROFILER_CLOCK_ID CLOCK_REALTIME
 #endif
 #endif
 #endif
 
 
+//Nanoseconds, or microseconds without POSIX timers
 static inline int64_t get_high_precision_ticks(void)
 {
 #ifdef PROFILER_CLOCK_ID
-    timespec ts;
+    struct timespec ts;
     if (clock_gettime(PROFILER_CLOCK_ID, &ts) != 0) {
         return -1;
     }
-    return ts->tv_sec * 1000000 +  ts->tv_nsec;
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 #else
     struct timeval tm;
     if (gettimeofday( &tm, NULL) != 0) {
         return -1;
     }
-    return tm.tv_sec * 1000000 + tm.tv_usec;
+    return (int64_t)tm.tv_sec * 1000000 + tm.tv_usec;
 #endif
 }
 
 static inline int64_t get_profiler_ticks_per_second(void)
 {
 #ifdef PROFILER_CLOCK_ID
-    timespec ts;
-    if (clock_getres(PROFILER_CLOCK_ID, &ts) != 0) {
-        return -1;
-    }
-    return ts->tv_nsec;
+    return 1000000000;
 #else
     return 1000000;
 #endif
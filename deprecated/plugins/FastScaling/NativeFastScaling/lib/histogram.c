@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+#include "concurrency.h"
+#include "simd.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+//Below this many samples per band, starting a thread costs more than it saves
+#define HISTOGRAM_SAMPLES_PER_THREAD (1024 * 1024)
+#define HISTOGRAM_MAX_THREADS 8
+//Consecutive samples increment different copies of the counters, so runs of similar pixels don't stall on their own stores
+#define HISTOGRAM_INTERLEAVE 4
+
+struct HistogramAccumulatorStruct {
+    uint32_t histogram_count;
+    uint32_t histogram_size;
+    int shift;
+    //HISTOGRAM_INTERLEAVE copies of histogram_count * histogram_size counters
+    uint64_t * counts;
+    //Gray8 rows only count one channel, into HISTOGRAM_INTERLEAVE copies of histogram_size counters
+    uint64_t * gray_counts;
+    uint64_t samples;
+    uint64_t gray_samples;
+};
+
+//A band of sampled rows, counted on its own thread
+typedef struct {
+    HistogramAccumulator * histogram;
+    const BitmapBgra * bmp;
+    uint32_t first_row;
+    uint32_t end_row;
+    uint32_t step;
+} HistogramBand;
+
+//306 + 601 + 117 = 1024, so the weighted sum is at most 255 << 10
+static inline uint32_t histogram_luma(const uint8_t * p, int shift)
+{
+    return (306 * p[2] + 601 * p[1] + 117 * p[0]) >> (10 + shift);
+}
+
+static inline uint32_t histogram_saturation(const uint8_t * p, int shift)
+{
+    const int rg = abs((int)p[2] - (int)p[1]);
+    const int gb = abs((int)p[1] - (int)p[0]);
+    return (uint32_t)int_max(rg, gb) >> shift;
+}
+
+//histogram_count is a constant at every call site, so each mode gets its own loop
+static inline void histogram_add(uint64_t * counts, const uint8_t * p, const uint32_t histogram_count, const uint32_t size, const int shift)
+{
+    if (histogram_count == 3) {
+        counts[p[2] >> shift]++;
+        counts[size + (p[1] >> shift)]++;
+        counts[2 * size + (p[0] >> shift)]++;
+    } else {
+        counts[histogram_luma(p, shift)]++;
+        if (histogram_count == 2) {
+            counts[size + histogram_saturation(p, shift)]++;
+        }
+    }
+}
+
+static inline void histogram_add_row(HistogramAccumulator * h, const uint8_t * row, const uint32_t ch, const uint32_t samples, const uint32_t step, const uint32_t histogram_count)
+{
+    const uint32_t size = h->histogram_size;
+    const int shift = h->shift;
+    const uint32_t set = histogram_count * size;
+    const uint32_t step_bytes = step * ch;
+    uint64_t * const c = h->counts;
+    const uint8_t * p = row;
+    uint32_t x = 0;
+#ifdef FASTSCALING_SSE2
+    //Four luma indices at once from 16 contiguous Bgra32 bytes
+    if (histogram_count != 3 && step_bytes == 4 && simd_level() >= Simd_sse2) {
+        const __m128i weights = _mm_set_epi16(0, 306, 601, 117, 0, 306, 601, 117);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i luma_shift = _mm_cvtsi32_si128(10 + shift);
+        uint32_t luma[4];
+        for (; x + 4 <= samples; x += 4, p += 16) {
+            const __m128i px = _mm_loadu_si128((const __m128i *)p);
+            const __m128 lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(px, zero), weights));
+            const __m128 hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(px, zero), weights));
+            const __m128i bg = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+            const __m128i r = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+            _mm_storeu_si128((__m128i *)luma, _mm_srl_epi32(_mm_add_epi32(bg, r), luma_shift));
+            c[luma[0]]++;
+            c[set + luma[1]]++;
+            c[2 * set + luma[2]]++;
+            c[3 * set + luma[3]]++;
+            if (histogram_count == 2) {
+                c[size + histogram_saturation(p, shift)]++;
+                c[set + size + histogram_saturation(p + 4, shift)]++;
+                c[2 * set + size + histogram_saturation(p + 8, shift)]++;
+                c[3 * set + size + histogram_saturation(p + 12, shift)]++;
+            }
+        }
+    }
+#endif
+    for (; x + 4 <= samples; x += 4, p += 4 * step_bytes) {
+        histogram_add(c, p, histogram_count, size, shift);
+        histogram_add(c + set, p + step_bytes, histogram_count, size, shift);
+        histogram_add(c + 2 * set, p + 2 * step_bytes, histogram_count, size, shift);
+        histogram_add(c + 3 * set, p + 3 * step_bytes, histogram_count, size, shift);
+    }
+    for (; x < samples; x++, p += step_bytes) {
+        histogram_add(c, p, histogram_count, size, shift);
+    }
+}
+
+//Gray only fills one histogram; the others are derived from it when merging
+static void histogram_add_gray_row(HistogramAccumulator * h, const uint8_t * row, const uint32_t samples, const uint32_t step)
+{
+    const uint32_t set = h->histogram_size;
+    const int shift = h->shift;
+    uint64_t * const c = h->gray_counts;
+    const uint8_t * p = row;
+    uint32_t x = 0;
+    for (; x + 4 <= samples; x += 4, p += 4 * step) {
+        c[p[0] >> shift]++;
+        c[set + (p[step] >> shift)]++;
+        c[2 * set + (p[2 * step] >> shift)]++;
+        c[3 * set + (p[3 * step] >> shift)]++;
+    }
+    for (; x < samples; x++, p += step) {
+        c[p[0] >> shift]++;
+    }
+}
+
+//Counts every step'th pixel of every step'th row in [first_row, end_row). Touches nothing but the accumulator.
+static void HistogramAccumulator_count(HistogramAccumulator * h, const BitmapBgra * bmp, const uint32_t first_row, const uint32_t end_row, const uint32_t step)
+{
+    const uint32_t ch = BitmapPixelFormat_bytes_per_pixel(bmp->fmt);
+    const uint32_t samples = (bmp->w + step - 1) / step;
+    for (uint32_t y = first_row; y < end_row; y += step) {
+        const uint8_t * row = bmp->pixels + (size_t)bmp->stride * y;
+        if (bmp->fmt == Gray8) {
+            histogram_add_gray_row(h, row, samples, step);
+            h->gray_samples += samples;
+            continue;
+        }
+        if (h->histogram_count == 1) {
+            histogram_add_row(h, row, ch, samples, step, 1);
+        } else if (h->histogram_count == 2) {
+            histogram_add_row(h, row, ch, samples, step, 2);
+        } else {
+            histogram_add_row(h, row, ch, samples, step, 3);
+        }
+        h->samples += samples;
+    }
+}
+
+static void HistogramBand_count(void * arg)
+{
+    const HistogramBand * band = (const HistogramBand *)arg;
+    HistogramAccumulator_count(band->histogram, band->bmp, band->first_row, band->end_row, band->step);
+}
+
+HistogramAccumulator * HistogramAccumulator_create(Context * context, uint32_t histogram_size_per_channel, uint32_t histogram_count)
+{
+    const uint32_t size = histogram_size_per_channel;
+    if (size == 0 || size > 256 || (size & (size - 1)) != 0) {
+        CONTEXT_error (context, Invalid_argument);
+        return NULL;
+    }
+    if (histogram_count < 1 || histogram_count > 3) {
+        CONTEXT_error (context, Invalid_internal_state);
+        return NULL;
+    }
+    //Rounded up to whole cache lines, so accumulators counted on different threads never share one
+    const size_t counters = HISTOGRAM_INTERLEAVE * (histogram_count + 1) * size;
+    const size_t bytes = (sizeof(HistogramAccumulator) + counters * sizeof(uint64_t) + 63) & ~(size_t)63;
+    HistogramAccumulator * h = (HistogramAccumulator *)CONTEXT_calloc(context, 1, bytes);
+    if (h == NULL) {
+        CONTEXT_error (context, Out_of_memory);
+        return NULL;
+    }
+    h->histogram_count = histogram_count;
+    h->histogram_size = size;
+    h->shift = 8 - intlog2(size);
+    h->counts = (uint64_t *)(h + 1);
+    h->gray_counts = h->counts + HISTOGRAM_INTERLEAVE * histogram_count * size;
+    return h;
+}
+
+void HistogramAccumulator_destroy(Context * context, HistogramAccumulator * h)
+{
+    if (h == NULL) return;
+    CONTEXT_free(context, h);
+}
+
+bool HistogramAccumulator_add_rows(Context * context, HistogramAccumulator * h, const BitmapBgra * bmp, uint32_t from_row, uint32_t row_count)
+{
+    if (bmp->fmt != Bgra32 && bmp->fmt != Bgr24 && bmp->fmt != Gray8) {
+        CONTEXT_error (context, Unsupported_pixel_format);
+        return false;
+    }
+    if (from_row + row_count > bmp->h) {
+        CONTEXT_error (context, Invalid_internal_state);
+        return false;
+    }
+    HistogramAccumulator_count(h, bmp, from_row, from_row + row_count, 1);
+    return true;
+}
+
+uint64_t HistogramAccumulator_merge_into(const HistogramAccumulator * h, uint64_t * histograms)
+{
+    const uint32_t size = h->histogram_size;
+    const uint32_t set = h->histogram_count * size;
+    for (uint32_t copy = 0; copy < HISTOGRAM_INTERLEAVE; copy++) {
+        const uint64_t * c = h->counts + copy * set;
+        for (uint32_t b = 0; b < set; b++) {
+            histograms[b] += c[b];
+        }
+        //Gray has no saturation; every channel histogram gets the same values
+        const uint64_t * g = h->gray_counts + copy * size;
+        for (uint32_t b = 0; b < size; b++) {
+            histograms[b] += g[b];
+            if (h->histogram_count == 3) {
+                histograms[size + b] += g[b];
+                histograms[2 * size + b] += g[b];
+            }
+        }
+    }
+    if (h->histogram_count == 2) {
+        histograms[size] += h->gray_samples;
+    }
+    return h->samples + h->gray_samples;
+}
+
+uint32_t BitmapBgra_histogram_sample_step(const BitmapBgra * bmp, uint64_t target_sample_count)
+{
+    const uint64_t pixels = (uint64_t)bmp->w * bmp->h;
+    if (target_sample_count == 0 || pixels <= target_sample_count) {
+        return 1;
+    }
+    //The same step is used for rows and columns; sqrt gets close, rounding up the sample grid may need a step more
+    uint32_t step = (uint32_t)sqrt((double)pixels / (double)target_sample_count);
+    step = umax(step, 1);
+    while ((uint64_t)((bmp->w + step - 1) / step) * ((bmp->h + step - 1) / step) > target_sample_count) {
+        step++;
+    }
+    return step;
+}
+
+bool BitmapBgra_populate_histogram_sampled (Context * context, BitmapBgra * bmp, uint64_t * histograms, const uint32_t histogram_size_per_channel, const uint32_t histogram_count, const uint32_t sample_step, uint64_t * pixels_sampled)
+{
+    if (bmp->fmt != Bgra32 && bmp->fmt != Bgr24 && bmp->fmt != Gray8) {
+        CONTEXT_error (context, Unsupported_pixel_format);
+        return false;
+    }
+    const uint32_t step = umax(sample_step, 1);
+    const uint32_t sample_rows = (bmp->h + step - 1) / step;
+    const uint64_t samples = (uint64_t)((bmp->w + step - 1) / step) * sample_rows;
+
+    uint32_t threads = (uint32_t)umin64(samples / HISTOGRAM_SAMPLES_PER_THREAD, HISTOGRAM_MAX_THREADS);
+    threads = umax(1, umin(umin(threads, processor_count()), sample_rows));
+
+    bool success = true;
+    HistogramBand bands[HISTOGRAM_MAX_THREADS];
+    Thread workers[HISTOGRAM_MAX_THREADS];
+    bool started[HISTOGRAM_MAX_THREADS];
+    memset(bands, 0, sizeof(bands));
+    for (uint32_t i = 0; i < threads; i++) {
+        bands[i].histogram = HistogramAccumulator_create(context, histogram_size_per_channel, histogram_count);
+        if (bands[i].histogram == NULL) {
+            CONTEXT_add_to_callstack (context);
+            success = false;
+            goto cleanup;
+        }
+        bands[i].bmp = bmp;
+        bands[i].first_row = (uint32_t)((uint64_t)sample_rows * i / threads) * step;
+        bands[i].end_row = umin((uint32_t)((uint64_t)sample_rows * (i + 1) / threads) * step, bmp->h);
+        bands[i].step = step;
+    }
+    //The calling thread takes the first band
+    for (uint32_t i = 1; i < threads; i++) {
+        started[i] = Thread_start(&workers[i], HistogramBand_count, &bands[i]);
+    }
+    HistogramBand_count(&bands[0]);
+    for (uint32_t i = 1; i < threads; i++) {
+        if (started[i]) {
+            Thread_join(&workers[i]);
+        } else {
+            HistogramBand_count(&bands[i]);
+        }
+    }
+    *pixels_sampled = 0;
+    for (uint32_t i = 0; i < threads; i++) {
+        *pixels_sampled += HistogramAccumulator_merge_into(bands[i].histogram, histograms);
+    }
+cleanup:
+    for (uint32_t i = 0; i < threads; i++) {
+        HistogramAccumulator_destroy(context, bands[i].histogram);
+    }
+    return success;
+}
+
+bool BitmapBgra_populate_histogram (Context * context, BitmapBgra * bmp, uint64_t * histograms, const uint32_t histogram_size_per_channel, const uint32_t histogram_count, uint64_t * pixels_sampled)
+{
+    if (!BitmapBgra_populate_histogram_sampled(context, bmp, histograms, histogram_size_per_channel, histogram_count, 1, pixels_sampled)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    return true;
+}
@@ -80,6 +80,13 @@ uchar_clamp_ff(float clr)
     return (uint8_t)result;
 }
 
+//Rec. 601 weights, the same ones the histogram and whitespace detection use
+static inline
+float linear_luma(float b, float g, float r)
+{
+    return 0.114f * b + 0.587f * g + 0.299f * r;
+}
+
 static inline
 int intlog2(unsigned int val)
 {
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//Tracks what a Context has allocated, and from where. Every allocation is recorded against the file and line passed by
+//the CONTEXT_malloc macros, so the size of a free can be found whatever the heap. Renders make dozens of allocations,
+//not millions, so a hash table lookup on each costs nothing measurable.
+
+#define LIVE_ALLOCATIONS_INITIAL_CAPACITY 64
+
+static uint32_t MemoryAccounting_home_slot(const MemoryAccounting * accounting, const void * pointer)
+{
+    //Allocations are at least 16-byte aligned; Fibonacci hashing spreads the rest
+    const uint64_t hash = ((uint64_t)(uintptr_t)pointer >> 4) * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(hash >> 32) & (accounting->live_capacity - 1);
+}
+
+static void MemoryAccounting_insert(MemoryAccounting * accounting, LiveAllocation allocation)
+{
+    uint32_t slot = MemoryAccounting_home_slot(accounting, allocation.pointer);
+    while (accounting->live[slot].pointer != NULL) {
+        slot = (slot + 1) & (accounting->live_capacity - 1);
+    }
+    accounting->live[slot] = allocation;
+}
+
+static bool MemoryAccounting_grow(MemoryAccounting * accounting)
+{
+    const uint32_t old_capacity = accounting->live_capacity;
+    LiveAllocation * old_live = accounting->live;
+    const uint32_t capacity = old_capacity == 0 ? LIVE_ALLOCATIONS_INITIAL_CAPACITY : old_capacity * 2;
+    LiveAllocation * live = (LiveAllocation *)calloc(capacity, sizeof(LiveAllocation));
+    if (live == NULL) {
+        return false;
+    }
+    accounting->live = live;
+    accounting->live_capacity = capacity;
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old_live[i].pointer != NULL) {
+            MemoryAccounting_insert(accounting, old_live[i]);
+        }
+    }
+    free(old_live);
+    return true;
+}
+
+static uint32_t MemoryAccounting_site(MemoryAccounting * accounting, const char * file, int line)
+{
+    for (uint32_t i = 0; i < accounting->site_count; i++) {
+        const MemorySiteStats * site = &accounting->sites[i];
+        //__FILE__ may be a different copy of the same string in each translation unit
+        if (site->line == line && (site->file == file || (site->file != NULL && file != NULL && strcmp(site->file, file) == 0))) {
+            return i;
+        }
+    }
+    uint32_t index = accounting->site_count;
+    if (index >= MEMORY_ACCOUNTING_SITES - 1) {
+        //The last site collects everything that didn't fit
+        index = MEMORY_ACCOUNTING_SITES - 1;
+        if (accounting->site_count == index) {
+            memset(&accounting->sites[index], 0, sizeof(MemorySiteStats));
+            accounting->site_count++;
+        }
+        return index;
+    }
+    MemorySiteStats * site = &accounting->sites[index];
+    memset(site, 0, sizeof(MemorySiteStats));
+    site->file = file;
+    site->line = line;
+    accounting->site_count++;
+    return index;
+}
+
+void MemoryAccounting_initialize(MemoryAccounting * accounting)
+{
+    memset(&accounting->totals, 0, sizeof(MemoryStats));
+    accounting->live = NULL;
+    accounting->live_capacity = 0;
+    accounting->site_count = 0;
+}
+
+void MemoryAccounting_terminate(MemoryAccounting * accounting)
+{
+    free(accounting->live);
+    MemoryAccounting_initialize(accounting);
+}
+
+bool MemoryAccounting_record(MemoryAccounting * accounting, void * pointer, size_t bytes, const char * file, int line)
+{
+    //Kept at most half full
+    if ((uint64_t)(accounting->totals.live_allocation_count + 1) * 2 > accounting->live_capacity) {
+        if (!MemoryAccounting_grow(accounting)) {
+            return false;
+        }
+    }
+    LiveAllocation allocation;
+    allocation.pointer = pointer;
+    allocation.bytes = bytes;
+    allocation.site = MemoryAccounting_site(accounting, file, line);
+    MemoryAccounting_insert(accounting, allocation);
+
+    MemoryStats * totals = &accounting->totals;
+    totals->current_bytes += bytes;
+    totals->peak_bytes = totals->current_bytes > totals->peak_bytes ? totals->current_bytes : totals->peak_bytes;
+    totals->allocation_count++;
+    totals->live_allocation_count++;
+    totals->largest_allocation = bytes > totals->largest_allocation ? bytes : totals->largest_allocation;
+
+    MemorySiteStats * site = &accounting->sites[allocation.site];
+    site->current_bytes += bytes;
+    site->peak_bytes = site->current_bytes > site->peak_bytes ? site->current_bytes : site->peak_bytes;
+    site->allocation_count++;
+    return true;
+}
+
+void MemoryAccounting_forget(MemoryAccounting * accounting, void * pointer)
+{
+    if (pointer == NULL || accounting->live == NULL) {
+        return;
+    }
+    const uint32_t mask = accounting->live_capacity - 1;
+    uint32_t slot = MemoryAccounting_home_slot(accounting, pointer);
+    while (accounting->live[slot].pointer != pointer) {
+        if (accounting->live[slot].pointer == NULL) {
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+    const LiveAllocation * allocation = &accounting->live[slot];
+    accounting->totals.current_bytes -= allocation->bytes;
+    accounting->totals.live_allocation_count--;
+    accounting->sites[allocation->site].current_bytes -= allocation->bytes;
+
+    //Shift back any later entry of the run that the hole would cut off from its home slot
+    uint32_t hole = slot;
+    for (uint32_t next = (hole + 1) & mask; accounting->live[next].pointer != NULL; next = (next + 1) & mask) {
+        const uint32_t home = MemoryAccounting_home_slot(accounting, accounting->live[next].pointer);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            accounting->live[hole] = accounting->live[next];
+            hole = next;
+        }
+    }
+    accounting->live[hole].pointer = NULL;
+}
+
+void MemoryAccounting_forget_all(MemoryAccounting * accounting)
+{
+    if (accounting->live != NULL) {
+        memset(accounting->live, 0, accounting->live_capacity * sizeof(LiveAllocation));
+    }
+    accounting->totals.current_bytes = 0;
+    accounting->totals.live_allocation_count = 0;
+    for (uint32_t i = 0; i < accounting->site_count; i++) {
+        accounting->sites[i].current_bytes = 0;
+    }
+}
+
+void Context_get_memory_stats(Context * context, MemoryStats * stats)
+{
+    *stats = context->memory.totals;
+}
+
+uint32_t Context_get_memory_sites(Context * context, MemorySiteStats * sites, uint32_t site_capacity)
+{
+    const uint32_t count = context->memory.site_count;
+    const uint32_t copied = count < site_capacity ? count : site_capacity;
+    if (copied > 0) {
+        memcpy(sites, context->memory.sites, copied * sizeof(MemorySiteStats));
+    }
+    return count;
+}
+
+void Context_reset_memory_peak(Context * context)
+{
+    MemoryAccounting * accounting = &context->memory;
+    accounting->totals.peak_bytes = accounting->totals.current_bytes;
+    for (uint32_t i = 0; i < accounting->site_count; i++) {
+        accounting->sites[i].peak_bytes = accounting->sites[i].current_bytes;
+    }
+}
@@ -26,6 +26,12 @@ typedef struct RendererStruct {
     bool destroy_source;
     BitmapBgra * canvas;
     BitmapBgra * transposed;
+    //Classified once, when the renderer is created
+    ColorMatrixBgra color_matrix;
+    //Counts the source for details->histograms; NULL once it has been counted
+    HistogramAccumulator * histogram;
+    //The blur subtracted by the unsharp mask, if details->unsharp_amount is set
+    ConvolutionKernel * unsharp_blur;
 } Renderer;
 
 
@@ -51,6 +57,7 @@ RenderDetails * RenderDetails_create(Context * context)
     d->halving_acceptable_pixel_loss = 0;
     d->minimum_sample_window_to_interposharpen = 1.5;
     d->apply_color_matrix = false;
+    d->detect_opaque_alpha = true;
     return d;
 }
 
@@ -167,6 +174,10 @@ void Renderer_destroy(Context * context, Renderer * r)
     r->source = NULL;
     BitmapBgra_destroy(context, r->transposed);
     r->transposed = NULL;
+    HistogramAccumulator_destroy(context, r->histogram);
+    r->histogram = NULL;
+    ConvolutionKernel_destroy(context, r->unsharp_blur);
+    r->unsharp_blur = NULL;
     r->canvas = NULL;
     if (r->destroy_details) {
         RenderDetails_destroy(context, r->details);
@@ -176,6 +187,14 @@ void Renderer_destroy(Context * context, Renderer * r)
     CONTEXT_free(context, r);
 }
 
+//Identity and diagonal matrices (brightness, contrast, gain, invert, alpha fade) take cheaper per-channel paths
+static void Renderer_classify_color_matrix(Renderer * r)
+{
+    if (r->details->apply_color_matrix) {
+        ColorMatrixBgra_init(&r->color_matrix, r->details->color_matrix);
+    }
+}
+
 Renderer * Renderer_create_in_place(Context * context, BitmapBgra * editInPlace, RenderDetails * details)
 {
     if (details->post_transpose) {
@@ -187,6 +206,7 @@ Renderer * Renderer_create_in_place(Context * context, BitmapBgra * editInPlace,
         CONTEXT_error(context, Out_of_memory);
         return NULL;
     }
+    r->source = editInPlace;
     if (details->enable_profiling) {
         uint32_t default_capacity = (r->source->h + r->source->w) * 20 + 5;
         if (!Context_enable_profiling(context, default_capacity)) {
@@ -195,9 +215,9 @@ Renderer * Renderer_create_in_place(Context * context, BitmapBgra * editInPlace,
             return NULL;
         }
     }
-    r->source = editInPlace;
     r->destroy_source = false;
     r->details = details;
+    Renderer_classify_color_matrix(r);
     return r;
 }
 
@@ -212,6 +232,7 @@ Renderer * Renderer_create(Context * context, BitmapBgra * source, BitmapBgra *
     r->canvas = canvas;
     r->destroy_source = false;
     r->details = details;
+    Renderer_classify_color_matrix(r);
     if (details->enable_profiling) {
         uint32_t default_capacity = (r->source->w + r->source->h + r->canvas->w + r->canvas->h) * 20 + 50;
         if (!Context_enable_profiling(context, default_capacity)) {
@@ -259,7 +280,7 @@ static bool HalveInTempImage(Context * context, Renderer * r, int divisor)
     // from here we have a temp image
     prof_stop(context,"create temp image for halving", true, false);
 
-    if (!Halve(context, r->source, tmp_im, divisor)) {
+    if (!Halve(context, r->source, tmp_im, divisor, r->histogram)) {
         // we cannot return here, or tmp_im will leak
         CONTEXT_add_to_callstack (context);
         result = false;
@@ -274,6 +295,16 @@ static bool HalveInTempImage(Context * context, Renderer * r, int divisor)
     return result;
 }
 
+//Hands the counts to the caller once the whole source has been read
+static void Renderer_complete_histogram(Context * context, Renderer * r)
+{
+    if (r->histogram != NULL) {
+        r->details->histogram_pixels_sampled = HistogramAccumulator_merge_into(r->histogram, r->details->histograms);
+        HistogramAccumulator_destroy(context, r->histogram);
+        r->histogram = NULL;
+    }
+}
+
 static bool Renderer_complete_halving(Context * context, Renderer * r)
 {
     int divisor = r->details->halving_divisor;
@@ -283,26 +314,32 @@ static bool Renderer_complete_halving(Context * context, Renderer * r)
     bool result = true;
     prof_start(context, "CompleteHalving", false);
     r->details->halving_divisor = 0; //Don't halve twice
+    const uint64_t source_pixels = (uint64_t)r->source->w * r->source->h;
+    const uint64_t source_bytes = (uint64_t)r->source->stride * r->source->h;
 
-    result = r->source->can_reuse_space ? HalveInPlace (context, r->source, divisor) : HalveInTempImage (context, r, divisor);
+    result = r->source->can_reuse_space ? HalveInPlace (context, r->source, divisor, r->histogram) : HalveInTempImage (context, r, divisor);
     if (!result){
         CONTEXT_add_to_callstack (context);
+    } else {
+        Renderer_complete_histogram(context, r);
     }
 
-    prof_stop(context,"CompleteHalving", true, false);
+    prof_stop_work(context, "CompleteHalving", source_pixels, source_bytes);
     return result;
 }
 
 
 static bool ApplyConvolutionsFloat1D(Context * context, const Renderer * r, BitmapFloat * img, const uint32_t from_row, const uint32_t row_count, double sharpening_applied)
 {
+    const uint64_t pixels = (uint64_t)img->w * row_count;
+    const uint64_t bytes = pixels * img->channels * sizeof(float);
     if (r->details->kernel_a != NULL){
         prof_start (context, "convolve kernel a", false);
         if (!BitmapFloat_convolve_rows (context, img, r->details->kernel_a, img->channels, from_row, row_count)) {
             CONTEXT_add_to_callstack (context);
             return false;
         }
-        prof_stop (context, "convolve kernel a", true, false);
+        prof_stop_work (context, "convolve kernel a", pixels, bytes);
     }
     if (r->details->kernel_b != NULL){
         prof_start (context, "convolve kernel b", false);
@@ -310,7 +347,15 @@ static bool ApplyConvolutionsFloat1D(Context * context, const Renderer * r, Bitm
             CONTEXT_add_to_callstack (context);
             return false;
         }
-        prof_stop (context, "convolve kernel b", true, false);
+        prof_stop_work (context, "convolve kernel b", pixels, bytes);
+    }
+    if (r->unsharp_blur != NULL) {
+        prof_start (context, "unsharp mask", false);
+        if (!BitmapFloat_unsharp_rows (context, img, r->unsharp_blur, r->details->unsharp_amount, r->details->unsharp_threshold, from_row, row_count)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        prof_stop_work (context, "unsharp mask", pixels, bytes);
     }
     if (r->details->sharpen_percent_goal > sharpening_applied + 0.01) {
         prof_start(context,"SharpenBgraFloatRowsInPlace", false);
@@ -318,19 +363,51 @@ static bool ApplyConvolutionsFloat1D(Context * context, const Renderer * r, Bitm
             CONTEXT_add_to_callstack (context);
             return false;
         }
-        prof_stop(context,"SharpenBgraFloatRowsInPlace", true, false);
+        prof_stop_work(context, "SharpenBgraFloatRowsInPlace", pixels, bytes);
     }
     return true;
 }
 
-static bool ApplyColorMatrix(Context * context, const Renderer * r, BitmapFloat * img, const uint32_t row_count)
+//The color matrix is only applied in the second pass, as each row is written out
+static const ColorMatrixBgra * Renderer_get_color_matrix(const Renderer * r, const RenderDetails * details, int call_number)
+{
+    if (!details->apply_color_matrix || call_number != 2 || r->color_matrix.kind == ColorMatrix_identity) {
+        return NULL;
+    }
+    return &r->color_matrix;
+}
+
+
+//Whether the color matrix leaves an alpha of 1 at 1 and never lets alpha leak into color
+static bool color_matrix_preserves_opaque_alpha(float * const m[5])
+{
+    return m[0][3] == 0 && m[1][3] == 0 && m[2][3] == 0 && m[3][3] == 1 && m[4][3] == 0 &&
+           m[3][0] == 0 && m[3][1] == 0 && m[3][2] == 0;
+}
+
+//Whether opaque Bgra32 rows may be processed as 3 channels in both passes
+static bool Renderer_may_drop_opaque_alpha(const RenderDetails * details)
 {
-    prof_start(context,"apply_color_matrix_float", false);
-    bool b= BitmapFloat_apply_color_matrix(context, img, 0, row_count, r->details->color_matrix);
-    prof_stop(context,"apply_color_matrix_float", true, false);
-    return b;
+    return details->detect_opaque_alpha && (!details->apply_color_matrix || color_matrix_preserves_opaque_alpha(details->color_matrix));
 }
 
+//Reinterprets a buffer allocated for 4 channels as 3 (or back again). Opaque rows need neither an alpha channel nor premultiplication.
+//The stride is kept, so rows stay aligned.
+static void BitmapFloat_use_opaque_layout(BitmapFloat * buf, bool opaque)
+{
+    buf->channels = opaque ? 3 : 4;
+    buf->alpha_meaningful = !opaque;
+    buf->alpha_premultiplied = !opaque;
+}
+
+//How many float channels to process pSrc with. Gray stays single-channel unless a color matrix could tint a color destination.
+static uint32_t Renderer_float_channels(const BitmapBgra * pSrc, const BitmapBgra * pDst, const RenderDetails * details, int call_number)
+{
+    if (pSrc->fmt == Gray8) {
+        return (details->apply_color_matrix && call_number == 2 && pDst->fmt != Gray8) ? 3 : 1;
+    }
+    return (pSrc->fmt == Bgra32 && !pSrc->alpha_meaningful) ? 3 : BitmapPixelFormat_bytes_per_pixel(pSrc->fmt);
+}
 
 static bool ScaleAndRender1D(Context * context, const Renderer * r,
                              BitmapBgra * pSrc,
@@ -357,12 +434,16 @@ static bool ScaleAndRender1D(Context * context, const Renderer * r,
     //How many rows to buffer and process at a time.
     const uint32_t buffer_row_count = 4; //using buffer=5 seems about 6% better than most other non-zero values.
 
-    //How many bytes per pixel are we scaling?
-    BitmapPixelFormat scaling_format = (pSrc->fmt == Bgra32 && !pSrc->alpha_meaningful) ? Bgr24 : pSrc->fmt;
+    //How many channels are we scaling?
+    const uint32_t scaling_channels = Renderer_float_channels(pSrc, pDst, details, call_number);
+
+    const ColorMatrixBgra * color_matrix = Renderer_get_color_matrix(r, details, call_number);
+    const bool detect_opaque = scaling_channels == 4 && pSrc->fmt == Bgra32 && Renderer_may_drop_opaque_alpha(details);
+    bool all_opaque = detect_opaque;
 
     prof_start(context,"contributions_calc", false);
 
-    contrib = LineContributions_create(context, to_count, from_count, details->interpolation);
+    contrib = LineContributions_acquire(context, to_count, from_count, details->interpolation);
     if (contrib == NULL) {
         CONTEXT_add_to_callstack (context);
         success = false;
@@ -373,13 +454,13 @@ static bool ScaleAndRender1D(Context * context, const Renderer * r,
 
     prof_start(context,"create_bitmap_float (buffers)", false);
 
-    source_buf = BitmapFloat_create(context, from_count, buffer_row_count, scaling_format, false);
+    source_buf = BitmapFloat_create(context, from_count, buffer_row_count, scaling_channels, false);
     if (source_buf == NULL) {
         CONTEXT_add_to_callstack (context);
         success = false;
         goto cleanup;
     }
-    dest_buf = BitmapFloat_create(context, to_count, buffer_row_count, scaling_format, false);
+    dest_buf = BitmapFloat_create(context, to_count, buffer_row_count, scaling_channels, false);
     if (dest_buf == NULL) {
         CONTEXT_add_to_callstack (context);
         success = false;
@@ -393,18 +474,24 @@ static bool ScaleAndRender1D(Context * context, const Renderer * r,
 
     prof_stop(context,"create_bitmap_float (buffers)", true, false);
 
-
     /* Scale each set of lines */
     for (uint32_t source_start_row = 0; source_start_row < pSrc->h; source_start_row += buffer_row_count) {
         const uint32_t row_count = umin(pSrc->h - source_start_row, buffer_row_count);
 
+        if (detect_opaque) {
+            const bool opaque = BitmapBgra_rows_are_opaque(pSrc, source_start_row, row_count);
+            BitmapFloat_use_opaque_layout(source_buf, opaque);
+            BitmapFloat_use_opaque_layout(dest_buf, opaque);
+            all_opaque = all_opaque && opaque;
+        }
+
         prof_start(context,"convert_srgb_to_linear", false);
-        if (!BitmapBgra_convert_srgb_to_linear(context,pSrc, source_start_row, source_buf, 0, row_count)) {
+        if (!BitmapBgra_convert_srgb_to_linear(context,pSrc, source_start_row, source_buf, 0, row_count, call_number == 1 ? r->histogram : NULL)) {
             CONTEXT_add_to_callstack (context);
             success=false;
             goto cleanup;
         }
-        prof_stop(context,"convert_srgb_to_linear", true, false);
+        prof_stop_work(context, "convert_srgb_to_linear", (uint64_t)pSrc->w * row_count, (uint64_t)pSrc->w * row_count * BitmapPixelFormat_bytes_per_pixel(pSrc->fmt));
 
         prof_start(context,"ScaleBgraFloatRows", false);
         if (!BitmapFloat_scale_rows(context, source_buf, 0, dest_buf, 0, row_count, contrib->ContribRow)) {
@@ -412,7 +499,7 @@ static bool ScaleAndRender1D(Context * context, const Renderer * r,
             success=false;
             goto cleanup;
         }
-        prof_stop(context,"ScaleBgraFloatRows", true, false);
+        prof_stop_work(context, "ScaleBgraFloatRows", (uint64_t)source_buf->w * row_count, (uint64_t)source_buf->w * row_count * source_buf->channels * sizeof(float));
 
 
         if (!ApplyConvolutionsFloat1D(context, r, dest_buf, 0, row_count, contrib->percent_negative)) {
@@ -420,23 +507,20 @@ static bool ScaleAndRender1D(Context * context, const Renderer * r,
             success=false;
             goto cleanup;
         }
-        if (details->apply_color_matrix && call_number == 2) {
-            if (!ApplyColorMatrix(context, r, dest_buf, row_count)) {
-                CONTEXT_add_to_callstack (context);
-                success=false;
-                goto cleanup;
-            }
-        }
 
         prof_start(context,"pivoting_composite_linear_over_srgb", false);
-        if (!BitmapFloat_pivoting_composite_linear_over_srgb(context, dest_buf, 0, pDst, source_start_row, row_count, transpose)) {
+        if (!BitmapFloat_pivoting_composite_linear_over_srgb(context, dest_buf, 0, pDst, source_start_row, row_count, transpose, color_matrix)) {
             CONTEXT_add_to_callstack (context);
             success=false;
             goto cleanup;
         }
-        prof_stop(context,"pivoting_composite_linear_over_srgb", true, false);
+        prof_stop_work(context, "pivoting_composite_linear_over_srgb", (uint64_t)dest_buf->w * row_count, (uint64_t)dest_buf->w * row_count * dest_buf->channels * sizeof(float));
 
     }
+    //Pass 2 can skip the scan (and alpha) entirely if every row was opaque
+    if (call_number == 1 && all_opaque) {
+        pDst->alpha_meaningful = false;
+    }
     //sRGB sharpening
     //Color matrix
 
@@ -444,7 +528,7 @@ static bool ScaleAndRender1D(Context * context, const Renderer * r,
 cleanup:
     //p->Start("Free Contributions,FloatBuffers", false);
 
-    if (contrib != NULL) LineContributions_destroy(context, contrib);
+    if (contrib != NULL) LineContributions_release(context, contrib);
 
     if (source_buf != NULL) BitmapFloat_destroy(context, source_buf);
     if (dest_buf != NULL) BitmapFloat_destroy(context, dest_buf);
@@ -468,46 +552,53 @@ static bool Render1D(Context * context,
     //How many rows to buffer and process at a time.
     uint32_t buffer_row_count = 4; //using buffer=5 seems about 6% better than most other non-zero values.
 
-    //How many bytes per pixel are we scaling?
-    BitmapPixelFormat scaling_format = (pSrc->fmt == Bgra32 && !pSrc->alpha_meaningful) ? Bgr24 : pSrc->fmt;
+    //How many channels are we scaling?
+    const uint32_t scaling_channels = Renderer_float_channels(pSrc, pDst, details, call_number);
 
 
-    BitmapFloat * buf = BitmapFloat_create(context,pSrc->w, buffer_row_count, scaling_format, false);
+    BitmapFloat * buf = BitmapFloat_create(context,pSrc->w, buffer_row_count, scaling_channels, false);
     if (buf == NULL)  {
         return false;
     }
     buf->alpha_meaningful = pSrc->alpha_meaningful;
     buf->alpha_premultiplied = buf->channels == 4;
 
-
+    const bool detect_opaque = scaling_channels == 4 && pSrc->fmt == Bgra32 && Renderer_may_drop_opaque_alpha(details);
+    bool all_opaque = detect_opaque;
+    const ColorMatrixBgra * color_matrix = Renderer_get_color_matrix(r, details, call_number);
 
     /* Scale each set of lines */
     for (uint32_t source_start_row = 0; source_start_row < pSrc->h; source_start_row += buffer_row_count) {
         const uint32_t row_count = umin(pSrc->h - source_start_row, buffer_row_count);
 
-        if (!BitmapBgra_convert_srgb_to_linear(context, pSrc, source_start_row, buf, 0, row_count)) {
+        if (detect_opaque) {
+            const bool opaque = BitmapBgra_rows_are_opaque(pSrc, source_start_row, row_count);
+            BitmapFloat_use_opaque_layout(buf, opaque);
+            all_opaque = all_opaque && opaque;
+        }
+
+        prof_start(context,"convert_srgb_to_linear", false);
+        if (!BitmapBgra_convert_srgb_to_linear(context, pSrc, source_start_row, buf, 0, row_count, call_number == 1 ? r->histogram : NULL)) {
             CONTEXT_add_to_callstack (context);
             success=false;
             goto cleanup;
         }
+        prof_stop_work(context, "convert_srgb_to_linear", (uint64_t)pSrc->w * row_count, (uint64_t)pSrc->w * row_count * BitmapPixelFormat_bytes_per_pixel(pSrc->fmt));
         if (!ApplyConvolutionsFloat1D(context, r, buf, 0, row_count, 0)) {
             CONTEXT_add_to_callstack (context);
             success=false;
             goto cleanup;
         }
-        if (details->apply_color_matrix && call_number == 2) {
-            if (!ApplyColorMatrix(context, r, buf, row_count)) {
-                CONTEXT_add_to_callstack (context);
-                success=false;
-                goto cleanup;
-            }
-        }
-
-        if (!BitmapFloat_pivoting_composite_linear_over_srgb(context, buf, 0, pDst, source_start_row, row_count, transpose)) {
+        prof_start(context,"pivoting_composite_linear_over_srgb", false);
+        if (!BitmapFloat_pivoting_composite_linear_over_srgb(context, buf, 0, pDst, source_start_row, row_count, transpose, color_matrix)) {
             CONTEXT_add_to_callstack (context);
             success=false;
             goto cleanup;
         }
+        prof_stop_work(context, "pivoting_composite_linear_over_srgb", (uint64_t)buf->w * row_count, (uint64_t)buf->w * row_count * buf->channels * sizeof(float));
+    }
+    if (call_number == 1 && all_opaque) {
+        pDst->alpha_meaningful = false;
     }
     //sRGB sharpening
     //Color matrix
@@ -547,6 +638,20 @@ static bool RenderWrapper1D(
 bool Renderer_perform_render(Context * context, Renderer * r)
 {
     prof_start(context,"perform_render", false);
+    if (r->details->histograms != NULL && r->histogram == NULL) {
+        r->histogram = HistogramAccumulator_create(context, r->details->histogram_size_per_channel, r->details->histogram_count);
+        if (r->histogram == NULL) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+    }
+    if (r->details->unsharp_amount > 0 && r->details->unsharp_sigma > 0 && r->unsharp_blur == NULL) {
+        r->unsharp_blur = ConvolutionKernel_create_unsharp_blur(context, r->details->unsharp_sigma);
+        if (r->unsharp_blur == NULL) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+    }
     if (!Renderer_complete_halving(context, r)) {
         CONTEXT_add_to_callstack (context);
         return false;
@@ -615,6 +720,11 @@ bool Renderer_perform_render(Context * context, Renderer * r)
 
         r->details->interpolation->sharpen_percent_goal = r->details->sharpen_percent_goal;
     }
+    //Both passes (and any later render with these details) share one sampled copy of the filter
+    if (scaling_required && !InterpolationDetails_prepare_table(context, r->details->interpolation)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
 
 
     //Apply kernels, scale, and transpose
@@ -622,6 +732,7 @@ bool Renderer_perform_render(Context * context, Renderer * r)
         CONTEXT_add_to_callstack (context);
         return false;
     }
+    Renderer_complete_histogram(context, r);
 
     //Apply flip to transposed
     if (vflip_transposed && !BitmapBgra_flip_vertical(context,r->transposed)) {
@@ -88,16 +88,36 @@ bool BitmapFloat_scale_rows(Context * context, BitmapFloat * from, uint32_t from
                 dest_buffer[ndx * to_step + 2] = r;
             }
         }
+    } else if (from_step == 1 && to_step == 1) {
+        for (uint32_t row = 0; row < row_count; row++) {
+            const float* __restrict source_buffer = from->pixels + ((from_row + row) * from->float_stride);
+            float* __restrict dest_buffer = to->pixels + ((to_row + row) * to->float_stride);
+
+            for (ndx = 0; ndx < dest_buffer_count; ndx++) {
+                float v = 0;
+                const int left = weights[ndx].Left;
+                const int right = weights[ndx].Right;
+
+                const float* __restrict weightArray = weights[ndx].Weights;
+                int i;
+
+                for (i = left; i <= right; i++) {
+                    v += weightArray[i - left] * source_buffer[i];
+                }
+
+                dest_buffer[ndx] = v;
+            }
+        }
     } else {
         for (uint32_t row = 0; row < row_count; row++) {
             const float* __restrict source_buffer = from->pixels + ((from_row + row) * from->float_stride);
             float* __restrict dest_buffer = to->pixels + ((to_row + row) * to->float_stride);
 
-            avg[0] = 0;
-            avg[1] = 0;
-            avg[2] = 0;
-            avg[3] = 0;
             for (ndx = 0; ndx < dest_buffer_count; ndx++) {
+                avg[0] = 0;
+                avg[1] = 0;
+                avg[2] = 0;
+                avg[3] = 0;
                 const int left = weights[ndx].Left;
                 const int right = weights[ndx].Right;
 
@@ -159,6 +179,13 @@ static inline void HALVE_ROW_NAME (Context * context, const unsigned char* from,
                 }
             }
         }
+        else if (step == 1){
+            for (to_b = 0, from_b = 0; to_b < to_bytes; to_b++, from_b += divisor_stride) {
+                for (int f = 0; f < divisor_stride; f++) {
+                    to[to_b] += TO_HALVING_TYPE (from[from_b + f]);
+                }
+            }
+        }
         return;
     }
 
@@ -204,7 +231,8 @@ static bool HALVE_INTERNAL_NAME (
     const int to_w,
     const int to_h,
     const int to_stride,
-    const int divisor)
+    const int divisor,
+    HistogramAccumulator * histogram)
 {
 
     const int to_w_bytes = to_w * BitmapPixelFormat_bytes_per_pixel (to->fmt);
@@ -214,7 +242,7 @@ static bool HALVE_INTERNAL_NAME (
         return false;
     }
     //Force the from and to formate to be the same
-    if (from->fmt != to->fmt || (BitmapPixelFormat_bytes_per_pixel (from->fmt) != 3 && BitmapPixelFormat_bytes_per_pixel (from->fmt) != 4)){
+    if (from->fmt != to->fmt || (from->fmt != Gray8 && BitmapPixelFormat_bytes_per_pixel (from->fmt) != 3 && BitmapPixelFormat_bytes_per_pixel (from->fmt) != 4)){
         CONTEXT_error (context, Invalid_internal_state);
         return false;
     }
@@ -235,6 +263,12 @@ static bool HALVE_INTERNAL_NAME (
         for (d = 0; d < divisor; d++) {
             HALVE_ROW_NAME (context, from->pixels + (y * divisor + d) * from->stride, buffer, to_w, divisor, bytes_pp);
         }
+        //Count the source rows before an in-place halving overwrites them
+        if (histogram != NULL && !HistogramAccumulator_add_rows (context, histogram, from, y * divisor, divisor)) {
+            CONTEXT_add_to_callstack (context);
+            CONTEXT_free (context, buffer);
+            return false;
+        }
         unsigned char * dest_line = to->pixels + y * to_stride;
 #ifdef ALLOW_SHIFTING_HALVING_TYPE
         if (shift == 2) {
@@ -263,6 +297,11 @@ static bool HALVE_INTERNAL_NAME (
 
     CONTEXT_free(context, buffer);
 
+    //Rows past the last whole multiple of divisor are never halved, but they are still part of the source
+    if (histogram != NULL && !HistogramAccumulator_add_rows (context, histogram, from, to_h * divisor, from->h - to_h * divisor)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
     return true;
 }
 
@@ -309,6 +348,13 @@ static inline void HALVE_ROW_NAME (Context * context, const unsigned char* from,
                 }
             }
         }
+        else if (step == 1){
+            for (to_b = 0, from_b = 0; to_b < to_bytes; to_b++, from_b += divisor_stride) {
+                for (int f = 0; f < divisor_stride; f++) {
+                    to[to_b] += TO_HALVING_TYPE (from[from_b + f]);
+                }
+            }
+        }
         return;
     }
 
@@ -355,7 +401,8 @@ static bool HALVE_INTERNAL_NAME (
     const int to_w,
     const int to_h,
     const int to_stride,
-    const int divisor)
+    const int divisor,
+    HistogramAccumulator * histogram)
 {
 
     const int to_w_bytes = to_w * BitmapPixelFormat_bytes_per_pixel (to->fmt);
@@ -365,7 +412,7 @@ static bool HALVE_INTERNAL_NAME (
         return false;
     }
     //Force the from and to formate to be the same
-    if (from->fmt != to->fmt || (BitmapPixelFormat_bytes_per_pixel (from->fmt) != 3 && BitmapPixelFormat_bytes_per_pixel (from->fmt) != 4)){
+    if (from->fmt != to->fmt || (from->fmt != Gray8 && BitmapPixelFormat_bytes_per_pixel (from->fmt) != 3 && BitmapPixelFormat_bytes_per_pixel (from->fmt) != 4)){
         CONTEXT_error (context, Invalid_internal_state);
         return false;
     }
@@ -386,6 +433,12 @@ static bool HALVE_INTERNAL_NAME (
         for (d = 0; d < divisor; d++) {
             HALVE_ROW_NAME (context, from->pixels + (y * divisor + d) * from->stride, buffer, to_w, divisor, bytes_pp);
         }
+        //Count the source rows before an in-place halving overwrites them
+        if (histogram != NULL && !HistogramAccumulator_add_rows (context, histogram, from, y * divisor, divisor)) {
+            CONTEXT_add_to_callstack (context);
+            CONTEXT_free (context, buffer);
+            return false;
+        }
         unsigned char * dest_line = to->pixels + y * to_stride;
 #ifdef ALLOW_SHIFTING_HALVING_TYPE
         if (shift == 2) {
@@ -416,6 +469,11 @@ static bool HALVE_INTERNAL_NAME (
 
     CONTEXT_free (context, buffer);
 
+    //Rows past the last whole multiple of divisor are never halved, but they are still part of the source
+    if (histogram != NULL && !HistogramAccumulator_add_rows (context, histogram, from, to_h * divisor, from->h - to_h * divisor)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
     return true;
 }
 
@@ -424,7 +482,7 @@ static bool HALVE_INTERNAL_NAME (
 //** Do not edit the above two functions; they are copy/pasted. **//
 
 
-bool Halve(Context * context, const BitmapBgra * from, BitmapBgra * to, int divisor)
+bool Halve(Context * context, const BitmapBgra * from, BitmapBgra * to, int divisor, HistogramAccumulator * histogram)
 {
     if (divisor > 16) {
         CONTEXT_error(context, Invalid_argument);
@@ -432,10 +490,10 @@ bool Halve(Context * context, const BitmapBgra * from, BitmapBgra * to, int divi
     }
     bool r = false;
     if (context->colorspace.floatspace == Floatspace_as_is){
-        r = HalveInternal (context, from, to, to->w, to->h, to->stride, divisor);
+        r = HalveInternal (context, from, to, to->w, to->h, to->stride, divisor, histogram);
     }
     else{
-        r = HalveInternalColorSpaceAware (context, from, to, to->w, to->h, to->stride, divisor);
+        r = HalveInternalColorSpaceAware (context, from, to, to->w, to->h, to->stride, divisor, histogram);
     }
     if (!r){
         CONTEXT_add_to_callstack (context);
@@ -443,7 +501,7 @@ bool Halve(Context * context, const BitmapBgra * from, BitmapBgra * to, int divi
     return r;
 }
 
-bool HalveInPlace(Context * context, BitmapBgra * from, int divisor)
+bool HalveInPlace(Context * context, BitmapBgra * from, int divisor, HistogramAccumulator * histogram)
 {
     if (divisor > 16) {
         CONTEXT_error(context, Invalid_argument);
@@ -454,10 +512,10 @@ bool HalveInPlace(Context * context, BitmapBgra * from, int divisor)
     int to_stride = to_w * BitmapPixelFormat_bytes_per_pixel (from->fmt);
     bool r = false;
     if (context->colorspace.floatspace == Floatspace_as_is){
-        r = HalveInternal (context, from, from, to_w, to_h, to_stride, divisor);
+        r = HalveInternal (context, from, from, to_w, to_h, to_stride, divisor, histogram);
     }
     else{
-       r =  HalveInternalColorSpaceAware (context, from, from, to_w, to_h, to_stride, divisor);
+       r =  HalveInternalColorSpaceAware (context, from, from, to_w, to_h, to_stride, divisor, histogram);
     }
     if (!r){
         CONTEXT_add_to_callstack (context);
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "simd.h"
+#include "concurrency.h"
+
+#if defined(FASTSCALING_AVX2) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+//-1 until detected. Detection is idempotent, so racing threads just repeat it.
+static volatile int64_t detected_level = -1;
+static volatile int64_t max_level = Simd_avx2;
+
+static SimdLevel simd_detect(void)
+{
+    SimdLevel level = Simd_none;
+#ifdef FASTSCALING_SSE2
+    level = Simd_sse2;
+#endif
+#ifdef FASTSCALING_AVX2
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    const bool fma = (info[2] & (1 << 12)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    //The OS must also save the upper halves of the ymm registers
+    if (fma && osxsave && avx && (_xgetbv(0) & 6) == 6) {
+        __cpuidex(info, 7, 0);
+        if ((info[1] & (1 << 5)) != 0) {
+            level = Simd_avx2;
+        }
+    }
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        level = Simd_avx2;
+    }
+#endif
+#endif
+    return level;
+}
+
+SimdLevel simd_level(void)
+{
+    int64_t level = atomic_load_int64(&detected_level);
+    if (level < 0) {
+        level = simd_detect();
+        atomic_store_int64(&detected_level, level);
+    }
+    const int64_t limit = atomic_load_int64(&max_level);
+    return (SimdLevel)(level < limit ? level : limit);
+}
+
+void simd_set_max_level(SimdLevel level)
+{
+    atomic_store_int64(&max_level, level);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#pragma once
+
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include <stdbool.h>
+
+//SSE2 is part of the x64 baseline, and our Release Win32 builds enable it explicitly
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FASTSCALING_SSE2
+#include <emmintrin.h>
+#endif
+
+//AVX2 (with FMA) is never assumed; functions marked AVX2_FUNCTION may only be called when simd_level() says so.
+//GCC and Clang compile them for AVX2 individually, so the rest of the library keeps the baseline instruction set.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FASTSCALING_AVX2
+#define AVX2_FUNCTION __attribute__((target("avx2,fma")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define FASTSCALING_AVX2
+#define AVX2_FUNCTION
+#include <immintrin.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    Simd_none = 0,
+    Simd_sse2 = 1,
+    Simd_avx2 = 2
+} SimdLevel;
+
+//The best instruction set that is both compiled in and supported by this CPU, limited by simd_set_max_level
+SimdLevel simd_level(void);
+
+//Process-wide; lets tests and benchmarks compare each code path against the scalar one
+void simd_set_max_level(SimdLevel level);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+#include <stdio.h>
+#include <string.h>
+
+//Stage names are string literals, so the pointer almost always matches; a literal from another translation unit may be
+//a different copy, and falls back to strcmp. Past the table's capacity, stages share its last entry.
+static StageAccumulator * StageTimers_find(StageTimers * timers, const char * name)
+{
+    for (uint32_t i = 0; i < timers->count; i++) {
+        if (timers->stages[i].name == name) {
+            return &timers->stages[i];
+        }
+    }
+    for (uint32_t i = 0; i < timers->count; i++) {
+        if (timers->stages[i].name != NULL && strcmp(timers->stages[i].name, name) == 0) {
+            return &timers->stages[i];
+        }
+    }
+    uint32_t index = timers->count;
+    if (index >= STAGE_TIMERS_MAX - 1) {
+        index = STAGE_TIMERS_MAX - 1;
+        if (timers->count == index) {
+            memset(&timers->stages[index], 0, sizeof(StageAccumulator));
+            timers->count++;
+        }
+        return &timers->stages[index];
+    }
+    StageAccumulator * stage = &timers->stages[index];
+    memset(stage, 0, sizeof(StageAccumulator));
+    stage->name = name;
+    timers->count++;
+    return stage;
+}
+
+void StageTimers_start(StageTimers * timers, const char * name, int64_t now)
+{
+    StageTimers_find(timers, name)->started_at = now;
+}
+
+void StageTimers_stop(StageTimers * timers, const char * name, int64_t now, uint64_t pixels, uint64_t bytes)
+{
+    StageAccumulator * stage = StageTimers_find(timers, name);
+    if (stage->started_at > 0 && now >= stage->started_at) {
+        stage->ticks += now - stage->started_at;
+    }
+    stage->started_at = 0;
+    stage->calls++;
+    stage->pixels += pixels;
+    stage->bytes += bytes;
+}
+
+void Context_enable_stage_timers(Context * context, bool enabled)
+{
+    context->stages.enabled = enabled;
+    context->stages.ticks_per_second = get_profiler_ticks_per_second();
+}
+
+void Context_reset_stage_timers(Context * context)
+{
+    context->stages.count = 0;
+}
+
+uint32_t Context_get_stage_timers(Context * context, StageTimer * timers, uint32_t capacity)
+{
+    const StageTimers * stages = &context->stages;
+    const uint64_t per_second = stages->ticks_per_second > 0 ? (uint64_t)stages->ticks_per_second : 1;
+    for (uint32_t i = 0; i < stages->count && i < capacity; i++) {
+        const StageAccumulator * stage = &stages->stages[i];
+        const uint64_t ticks = (uint64_t)stage->ticks;
+        timers[i].name = stage->name;
+        timers[i].calls = stage->calls;
+        //Split, so that hours of ticks can't overflow
+        timers[i].nanoseconds = ticks / per_second * 1000000000 + ticks % per_second * 1000000000 / per_second;
+        timers[i].pixels = stage->pixels;
+        timers[i].bytes = stage->bytes;
+    }
+    return stages->count;
+}
+
+const char * Context_stage_timers_summary(Context * context, char * buffer, size_t buffer_size)
+{
+    StageTimer timers[STAGE_TIMERS_MAX];
+    const uint32_t count = Context_get_stage_timers(context, timers, STAGE_TIMERS_MAX);
+    size_t remaining_space = buffer_size;
+    char * line = buffer;
+    if (buffer_size > 0) {
+        buffer[0] = 0;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        const StageTimer * t = &timers[i];
+        int used = snprintf(line, remaining_space, "%s: %llu calls, %.3f ms, %llu pixels, %llu bytes, %.2f ns/pixel\n",
+                            t->name == NULL ? "(other stages)" : t->name, (unsigned long long)t->calls, t->nanoseconds / 1000000.0,
+                            (unsigned long long)t->pixels, (unsigned long long)t->bytes,
+                            t->pixels > 0 ? (double)t->nanoseconds / t->pixels : 0.0);
+        if (used > 0 && (size_t)used < remaining_space) {
+            remaining_space -= used;
+            line += used;
+        } else {
+            return buffer;
+        }
+    }
+    return buffer;
+}
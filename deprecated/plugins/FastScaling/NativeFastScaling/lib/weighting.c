@@ -37,6 +37,12 @@ static void derive_cubic_coefficients(double B, double C, InterpolationDetails *
 }
 
 
+//Fills out[i] with filter(scale * (first + i - center)); how LineContributions_create walks a window of source pixels.
+//Written as plain loops over hoisted constants so the compiler can vectorize them.
+typedef void (*interpolation_window_method)(const InterpolationDetails * d, double scale, double center, int32_t first, uint32_t count, double * out);
+
+#define FILTER_WINDOW_X(i) (scale * ((double)(first + (int32_t)(i)) - center))
+
 static double filter_flex_cubic(const InterpolationDetails * d, double x)
 {
     const double t = (double)fabs(x) / d->blur;
@@ -49,6 +55,50 @@ static double filter_flex_cubic(const InterpolationDetails * d, double x)
     }
     return(0.0);
 }
+
+static void filter_flex_cubic_window(const InterpolationDetails * d, double scale, double center, int32_t first, uint32_t count, double * out)
+{
+    const double blur = d->blur;
+    const double p1 = d->p1, p2 = d->p2, p3 = d->p3, q1 = d->q1, q2 = d->q2, q3 = d->q3, q4 = d->q4;
+    for (uint32_t i = 0; i < count; i++) {
+        const double t = fabs(FILTER_WINDOW_X(i)) / blur;
+        out[i] = t < 1.0 ? (p1 + t * (t* (p2 + t*p3))) : t < 2.0 ? (q1 + t*(q2 + t* (q3 + t*q4))) : 0.0;
+    }
+}
+
+//Defines filter_cubic_<name> and filter_cubic_<name>_window with B and C folded into the polynomial at compile time.
+//Only blur is read from the details (window merely bounds how far out we sample).
+#define DEFINE_CUBIC_FILTER(name, B, C) \
+    static inline double filter_cubic_##name##_kernel(double t) \
+    { \
+        if (t < 1.0) { \
+            return ((1.0 - (1.0 / 3.0) * (B)) + t * (t * ((-3.0 + ((B) + (B)) + (C)) + t * (2.0 - 1.5 * (B) - (C))))); \
+        } \
+        if (t < 2.0) { \
+            return (((4.0 / 3.0) * (B) + 4.0 * (C)) + t * ((-8.0 * (C) - ((B) + (B))) + t * (((B) + 5.0 * (C)) + t * ((-1.0 / 6.0) * (B) - (C))))); \
+        } \
+        return 0.0; \
+    } \
+    static double filter_cubic_##name(const InterpolationDetails * d, double x) \
+    { \
+        return filter_cubic_##name##_kernel((double)fabs(x) / d->blur); \
+    } \
+    static void filter_cubic_##name##_window(const InterpolationDetails * d, double scale, double center, int32_t first, uint32_t count, double * out) \
+    { \
+        const double blur = d->blur; \
+        for (uint32_t i = 0; i < count; i++) { \
+            out[i] = filter_cubic_##name##_kernel(fabs(FILTER_WINDOW_X(i)) / blur); \
+        } \
+    }
+
+DEFINE_CUBIC_FILTER(robidoux, 0.37821575509399867, 0.31089212245300067)
+DEFINE_CUBIC_FILTER(robidoux_sharp, 0.2620145123990142, 0.3689927438004929)
+DEFINE_CUBIC_FILTER(catmull_rom, 0.0, 0.5)
+DEFINE_CUBIC_FILTER(mitchell, 1.0 / 3.0, 1.0 / 3.0)
+DEFINE_CUBIC_FILTER(cubic, 0.0, 1.0)
+DEFINE_CUBIC_FILTER(bspline, 1.0, 0.0)
+DEFINE_CUBIC_FILTER(hermite, 0.0, 0.0)
+
 static double filter_bicubic_fast(const InterpolationDetails * d, double t)
 {
     double abs_t = (double)fabs(t) / d->blur;
@@ -79,14 +129,36 @@ static double filter_box(const InterpolationDetails * d, double t)
     return (x >= -1 * d->window && x < d->window) ? 1 : 0;
 }
 
-static double filter_triangle(const InterpolationDetails * d, double t)
+static void filter_box_window(const InterpolationDetails * d, double scale, double center, int32_t first, uint32_t count, double * out)
+{
+    const double blur = d->blur;
+    const double window = d->window;
+    for (uint32_t i = 0; i < count; i++) {
+        const double x = FILTER_WINDOW_X(i) / blur;
+        out[i] = (x >= -1 * window && x < window) ? 1 : 0;
+    }
+}
+
+static inline double filter_triangle_kernel(double x)
 {
-    const double x = (double)fabs(t) / d->blur;
     if (x < 1.0)
         return(1.0 - x);
     return(0.0);
 }
 
+static double filter_triangle(const InterpolationDetails * d, double t)
+{
+    return filter_triangle_kernel((double)fabs(t) / d->blur);
+}
+
+static void filter_triangle_window(const InterpolationDetails * d, double scale, double center, int32_t first, uint32_t count, double * out)
+{
+    const double blur = d->blur;
+    for (uint32_t i = 0; i < count; i++) {
+        out[i] = filter_triangle_kernel(fabs(FILTER_WINDOW_X(i)) / blur);
+    }
+}
+
 
 static double filter_sinc_windowed(const InterpolationDetails * d, double t)
 {
@@ -101,6 +173,41 @@ static double filter_sinc_windowed(const InterpolationDetails * d, double t)
     return d->window * sin(IR_PI * x / d->window) * sin(x * IR_PI) / (IR_PI * IR_PI * x * x);
 }
 
+//Lanczos with the window fixed at 3. Falls back to filter_sinc_windowed if the window has been overridden.
+static inline double filter_lanczos3_kernel(double x)
+{
+    const double abs_t = (double)fabs(x);
+    if (abs_t == 0) {
+        return 1;
+    }
+    if (abs_t > 3.0) {
+        return 0;
+    }
+    return 3.0 * sin(IR_PI * x / 3.0) * sin(x * IR_PI) / (IR_PI * IR_PI * x * x);
+}
+
+static double filter_lanczos3(const InterpolationDetails * d, double t)
+{
+    if (d->window != 3.0) {
+        return filter_sinc_windowed(d, t);
+    }
+    return filter_lanczos3_kernel(t / d->blur);
+}
+
+static void filter_lanczos3_window(const InterpolationDetails * d, double scale, double center, int32_t first, uint32_t count, double * out)
+{
+    const double blur = d->blur;
+    if (d->window != 3.0) {
+        for (uint32_t i = 0; i < count; i++) {
+            out[i] = filter_sinc_windowed(d, FILTER_WINDOW_X(i));
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        out[i] = filter_lanczos3_kernel(FILTER_WINDOW_X(i) / blur);
+    }
+}
+
 
 
 
@@ -148,6 +255,42 @@ static double filter_ginseng (const InterpolationDetails * d, double t)
 }
 
 
+static void filter_generic_window(const InterpolationDetails * d, double scale, double center, int32_t first, uint32_t count, double * out)
+{
+    const detailed_interpolation_method filter = d->filter;
+    for (uint32_t i = 0; i < count; i++) {
+        out[i] = filter(d, FILTER_WINDOW_X(i));
+    }
+}
+
+static void filter_tabulated_window(const InterpolationDetails * d, double scale, double center, int32_t first, uint32_t count, double * out)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        out[i] = InterpolationDetails_evaluate_tabulated(d, FILTER_WINDOW_X(i));
+    }
+}
+
+static interpolation_window_method InterpolationDetails_window_method(const InterpolationDetails * d, bool tabulated)
+{
+    if (tabulated) {
+        return filter_tabulated_window;
+    }
+#define WINDOW_METHOD_FOR(filter_name) if (d->filter == filter_name) return filter_name##_window;
+    WINDOW_METHOD_FOR(filter_cubic_robidoux)
+    WINDOW_METHOD_FOR(filter_cubic_robidoux_sharp)
+    WINDOW_METHOD_FOR(filter_cubic_catmull_rom)
+    WINDOW_METHOD_FOR(filter_cubic_mitchell)
+    WINDOW_METHOD_FOR(filter_cubic_cubic)
+    WINDOW_METHOD_FOR(filter_cubic_bspline)
+    WINDOW_METHOD_FOR(filter_cubic_hermite)
+    WINDOW_METHOD_FOR(filter_flex_cubic)
+    WINDOW_METHOD_FOR(filter_lanczos3)
+    WINDOW_METHOD_FOR(filter_triangle)
+    WINDOW_METHOD_FOR(filter_box)
+#undef WINDOW_METHOD_FOR
+    return filter_generic_window;
+}
+
 #define TONY 0.00001
 
 double InterpolationDetails_percent_negative_weight(const InterpolationDetails* details)
@@ -199,6 +342,21 @@ InterpolationDetails * InterpolationDetails_create_bicubic_custom(Context * cont
     }
     return d;
 }
+
+//Like InterpolationDetails_create_bicubic_custom, but with a filter that has B and C compiled in.
+//p1..q4 are still populated so the details describe the filter they use.
+static InterpolationDetails * InterpolationDetails_create_bicubic_specialized(Context * context, double window, double blur, double B, double C, detailed_interpolation_method filter)
+{
+    InterpolationDetails * d = InterpolationDetails_create_bicubic_custom(context, window, blur, B, C);
+    if (d != NULL) {
+        d->filter = filter;
+    }
+    else{
+        CONTEXT_add_to_callstack (context);
+    }
+    return d;
+}
+
 InterpolationDetails * InterpolationDetails_create_custom(Context * context, double window, double blur, detailed_interpolation_method filter)
 {
     InterpolationDetails * d = InterpolationDetails_create(context);
@@ -213,11 +371,87 @@ InterpolationDetails * InterpolationDetails_create_custom(Context * context, dou
     return d;
 }
 
+static void InterpolationKernelTable_destroy(Context * context, InterpolationKernelTable * table)
+{
+    if (table != NULL) {
+        CONTEXT_free(context, table->samples);
+    }
+    CONTEXT_free(context, table);
+}
+
 void InterpolationDetails_destroy(Context * context, InterpolationDetails * details)
 {
+    if (details != NULL) {
+        InterpolationKernelTable_destroy(context, details->table);
+    }
     CONTEXT_free(context, details);
 }
 
+//Only our own filters are known to be symmetric and continuous; filter_box is neither at the window edge.
+static bool InterpolationDetails_filter_is_tabulatable(detailed_interpolation_method filter)
+{
+    return filter == filter_flex_cubic || filter == filter_bicubic_fast || filter == filter_sinc ||
+           filter == filter_sinc_windowed || filter == filter_triangle || filter == filter_jinc ||
+           filter == filter_ginseng || filter == filter_lanczos3 || filter == filter_cubic_robidoux ||
+           filter == filter_cubic_robidoux_sharp || filter == filter_cubic_catmull_rom || filter == filter_cubic_mitchell ||
+           filter == filter_cubic_cubic || filter == filter_cubic_bspline || filter == filter_cubic_hermite;
+}
+
+bool InterpolationDetails_table_is_current(const InterpolationDetails * details)
+{
+    const InterpolationKernelTable * t = details->table;
+    return t != NULL && t->filter == details->filter && t->window == details->window && t->blur == details->blur &&
+           t->p1 == details->p1 && t->p2 == details->p2 && t->p3 == details->p3 &&
+           t->q1 == details->q1 && t->q2 == details->q2 && t->q3 == details->q3 && t->q4 == details->q4;
+}
+
+bool InterpolationDetails_prepare_table(Context * context, InterpolationDetails * details)
+{
+    if (InterpolationDetails_table_is_current(details) || !InterpolationDetails_filter_is_tabulatable(details->filter)) {
+        return true;
+    }
+    InterpolationKernelTable_destroy(context, details->table);
+    details->table = NULL;
+
+    //LineContributions_create never samples further out than window + 0.5 + 1.5 * downscale_factor
+    const uint32_t sample_count = (uint32_t)ceil((details->window + 2) * INTERPOLATION_TABLE_SAMPLES_PER_UNIT) + 2;
+
+    InterpolationKernelTable * table = CONTEXT_calloc_array(context, 1, InterpolationKernelTable);
+    if (table == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return false;
+    }
+    table->samples = CONTEXT_calloc_array(context, sample_count, float);
+    if (table->samples == NULL) {
+        CONTEXT_free(context, table);
+        CONTEXT_error(context, Out_of_memory);
+        return false;
+    }
+    table->sample_count = sample_count;
+    const interpolation_window_method evaluate = InterpolationDetails_window_method(details, false);
+    double chunk[256];
+    for (uint32_t start = 0; start < sample_count; start += 256) {
+        const uint32_t count = umin(256, sample_count - start);
+        evaluate(details, 1.0 / INTERPOLATION_TABLE_SAMPLES_PER_UNIT, 0, (int32_t)start, count, chunk);
+        for (uint32_t i = 0; i < count; i++) {
+            table->samples[start + i] = (float)chunk[i];
+        }
+    }
+    table->percent_negative = InterpolationDetails_percent_negative_weight(details);
+    table->filter = details->filter;
+    table->window = details->window;
+    table->blur = details->blur;
+    table->p1 = details->p1;
+    table->p2 = details->p2;
+    table->p3 = details->p3;
+    table->q1 = details->q1;
+    table->q2 = details->q2;
+    table->q3 = details->q3;
+    table->q4 = details->q4;
+    details->table = table;
+    return true;
+}
+
 static InterpolationDetails * InterpolationDetails_create_from_internal(Context * context, InterpolationFilter filter, bool checkExistenceOnly)
 {
     bool ex = checkExistenceOnly;
@@ -238,52 +472,52 @@ static InterpolationDetails * InterpolationDetails_create_from_internal(Context
 
     //Hermite and BSpline no negative weights
     case Filter_CubicBSpline:
-        return ex ? truePtr : InterpolationDetails_create_bicubic_custom(context, 2, 1, 1, 0);
+        return ex ? truePtr : InterpolationDetails_create_bicubic_specialized(context, 2, 1, 1, 0, filter_cubic_bspline);
 
     case Filter_Lanczos2:
         return ex ? truePtr : InterpolationDetails_create_custom(context, 2, 1, filter_sinc_windowed);
     case Filter_Lanczos:
-        return ex ? truePtr : InterpolationDetails_create_custom(context, 3, 1, filter_sinc_windowed);
+        return ex ? truePtr : InterpolationDetails_create_custom(context, 3, 1, filter_lanczos3);
     case Filter_Lanczos2Sharp:
         return ex ? truePtr :  InterpolationDetails_create_custom(context, 2, 0.9549963639785485, filter_sinc_windowed);
     case Filter_LanczosSharp:
-        return ex ? truePtr : InterpolationDetails_create_custom(context, 3, 0.9812505644269356, filter_sinc_windowed);
+        return ex ? truePtr : InterpolationDetails_create_custom(context, 3, 0.9812505644269356, filter_lanczos3);
 
 
     case Filter_CubicFast:
         return ex ? truePtr : InterpolationDetails_create_custom(context, 2, 1, filter_bicubic_fast);
     case Filter_Cubic:
-        return ex ? truePtr :  InterpolationDetails_create_bicubic_custom(context, 2, 1, 0,1);
+        return ex ? truePtr :  InterpolationDetails_create_bicubic_specialized(context, 2, 1, 0, 1, filter_cubic_cubic);
     case Filter_CubicSharp:
-        return ex ? truePtr :  InterpolationDetails_create_bicubic_custom (context, 2, 0.9549963639785485, 0, 1);
+        return ex ? truePtr :  InterpolationDetails_create_bicubic_specialized(context, 2, 0.9549963639785485, 0, 1, filter_cubic_cubic);
     case Filter_CatmullRom:
-        return ex ? truePtr : InterpolationDetails_create_bicubic_custom(context, 2, 1, 0, 0.5);
+        return ex ? truePtr : InterpolationDetails_create_bicubic_specialized(context, 2, 1, 0, 0.5, filter_cubic_catmull_rom);
     case Filter_CatmullRomFast:
-        return ex ? truePtr :  InterpolationDetails_create_bicubic_custom(context, 1, 1, 0, 0.5);
+        return ex ? truePtr :  InterpolationDetails_create_bicubic_specialized(context, 1, 1, 0, 0.5, filter_cubic_catmull_rom);
     case Filter_CatmullRomFastSharp:
-        return ex ? truePtr :  InterpolationDetails_create_bicubic_custom(context, 1, 13.0 / 16.0, 0, 0.5);
+        return ex ? truePtr :  InterpolationDetails_create_bicubic_specialized(context, 1, 13.0 / 16.0, 0, 0.5, filter_cubic_catmull_rom);
     case Filter_Mitchell:
-        return ex ? truePtr :  InterpolationDetails_create_bicubic_custom(context, 2, 1., 1.0 / 3.0, 1.0 / 3.0);
+        return ex ? truePtr :  InterpolationDetails_create_bicubic_specialized(context, 2, 1., 1.0 / 3.0, 1.0 / 3.0, filter_cubic_mitchell);
     case Filter_MitchellFast:
-        return ex ? truePtr :  InterpolationDetails_create_bicubic_custom (context, 1, 1., 1.0 / 3.0, 1.0 / 3.0);
+        return ex ? truePtr :  InterpolationDetails_create_bicubic_specialized(context, 1, 1., 1.0 / 3.0, 1.0 / 3.0, filter_cubic_mitchell);
 
 
     case Filter_Robidoux:
-        return ex ? truePtr :  InterpolationDetails_create_bicubic_custom(context, 2, 1.,
-                0.37821575509399867, 0.31089212245300067);
+        return ex ? truePtr :  InterpolationDetails_create_bicubic_specialized(context, 2, 1.,
+                0.37821575509399867, 0.31089212245300067, filter_cubic_robidoux);
     case Filter_Fastest:
-        return ex ? truePtr : InterpolationDetails_create_bicubic_custom (context,0.74, 0.74,
-            0.37821575509399867, 0.31089212245300067);
+        return ex ? truePtr : InterpolationDetails_create_bicubic_specialized(context, 0.74, 0.74,
+            0.37821575509399867, 0.31089212245300067, filter_cubic_robidoux);
 
 
     case Filter_RobidouxFast:
-        return ex ? truePtr :  InterpolationDetails_create_bicubic_custom (context, 1.05, 1.,
-            0.37821575509399867, 0.31089212245300067);
+        return ex ? truePtr :  InterpolationDetails_create_bicubic_specialized(context, 1.05, 1.,
+            0.37821575509399867, 0.31089212245300067, filter_cubic_robidoux);
     case Filter_RobidouxSharp:
-        return ex ? truePtr :  InterpolationDetails_create_bicubic_custom(context, 2, 1.,
-                0.2620145123990142, 0.3689927438004929);
+        return ex ? truePtr :  InterpolationDetails_create_bicubic_specialized(context, 2, 1.,
+                0.2620145123990142, 0.3689927438004929, filter_cubic_robidoux_sharp);
     case Filter_Hermite:
-        return ex ? truePtr :  InterpolationDetails_create_bicubic_custom(context, 1, 1, 0, 0);
+        return ex ? truePtr :  InterpolationDetails_create_bicubic_specialized(context, 1, 1, 0, 0, filter_cubic_hermite);
     case Filter_Box:
         return ex ? truePtr :  InterpolationDetails_create_custom(context, 0.5, 1, filter_box);
 
@@ -299,11 +533,11 @@ static InterpolationDetails * InterpolationDetails_create_from_internal(Context
         return ex ? truePtr :  InterpolationDetails_create_custom (context, 6, 1., filter_jinc);
 
     case Filter_NCubic:
-        return ex ? truePtr : InterpolationDetails_create_bicubic_custom(
-            context, 2.5, 1. / 1.1685777620836932, 0.37821575509399867, 0.31089212245300067);
+        return ex ? truePtr : InterpolationDetails_create_bicubic_specialized(
+            context, 2.5, 1. / 1.1685777620836932, 0.37821575509399867, 0.31089212245300067, filter_cubic_robidoux);
     case Filter_NCubicSharp:
-        return ex ? truePtr : InterpolationDetails_create_bicubic_custom(
-            context, 2.5, 1. / 1.105822933719019, 0.2620145123990142, 0.3689927438004929);
+        return ex ? truePtr : InterpolationDetails_create_bicubic_specialized(
+            context, 2.5, 1. / 1.105822933719019, 0.2620145123990142, 0.3689927438004929, filter_cubic_robidoux_sharp);
 
     }
     if (!checkExistenceOnly){
@@ -367,16 +601,24 @@ void LineContributions_destroy(Context * context, LineContributions * p)
 
 LineContributions *LineContributions_create(Context * context,  const uint32_t output_line_size, const uint32_t input_line_size,  const InterpolationDetails* details)
 {
-    const double sharpen_ratio =  InterpolationDetails_percent_negative_weight(details);
+    const bool tabulated = InterpolationDetails_table_is_current(details);
+    const double sharpen_ratio = tabulated ? details->table->percent_negative : InterpolationDetails_percent_negative_weight(details);
     const double desired_sharpen_ratio = details->sharpen_percent_goal / 100.0;
     const double scale_factor = (double)output_line_size / (double)input_line_size;
     const double downscale_factor = fmin(1.0, scale_factor);
     const double half_source_window = (details->window + 0.5) / downscale_factor;
    
     const uint32_t allocated_window_size = (int)ceil(2 * (half_source_window - TONY)) + 1;
+    const interpolation_window_method evaluate = InterpolationDetails_window_method(details, tabulated);
     uint32_t u, ix;
+    double * sampled = (double *)CONTEXT_malloc(context, allocated_window_size * sizeof(double));
+    if (sampled == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
     LineContributions *res = LineContributions_alloc(context, output_line_size, allocated_window_size);
     if (res == NULL){
+        CONTEXT_free(context, sampled);
         CONTEXT_add_to_callstack (context);
         return NULL;
     }
@@ -400,6 +642,7 @@ LineContributions *LineContributions_create(Context * context,  const uint32_t o
         const uint32_t source_pixel_count = right_src_pixel - left_src_pixel + 1;
 
         if (source_pixel_count > allocated_window_size) {
+            CONTEXT_free(context, sampled);
             LineContributions_destroy(context, res);
             CONTEXT_error(context, Invalid_internal_state);
             return NULL;
@@ -411,9 +654,10 @@ LineContributions *LineContributions_create(Context * context,  const uint32_t o
 
         float *weights = res->ContribRow[u].Weights;
 
+        evaluate(details, downscale_factor, center_src_pixel, (int32_t)left_src_pixel, source_pixel_count, sampled);
         for (ix = left_src_pixel; ix <= right_src_pixel; ix++) {
             int tx = ix - left_src_pixel;
-            double add = (*details->filter)(details, downscale_factor *((double)ix - center_src_pixel));
+            double add = sampled[tx];
             if (fabs(add) <= 0.00000002) {
                 add = 0.0;
                 // Weights below a certain threshold make consistent x-plat
@@ -425,23 +669,36 @@ LineContributions *LineContributions_create(Context * context,  const uint32_t o
             total_negative_weight -= fmin(0, add);
         }
 
-        float neg_factor, pos_factor;
-        if (total_weight <= 0 || desired_sharpen_ratio > sharpen_ratio) {
-            float total_positive_weight = total_weight + total_negative_weight;
-            float target_negative_weight = desired_sharpen_ratio * total_positive_weight;
-            pos_factor = 1;
-            neg_factor = target_negative_weight / total_negative_weight;
+        //The weights must sum to 1, or flat areas change brightness; only premultiplied rows, divided by their equally
+        //scaled alpha, used to hide that. Sharpening rescales the negative lobe to the goal, so it needs a negative lobe to
+        //start with, and a goal under 100%.
+        const double total_positive_weight = total_weight + total_negative_weight;
+        const double target_negative_weight = desired_sharpen_ratio * total_positive_weight;
+        const double sharpened_weight = total_positive_weight - target_negative_weight;
+        double neg_factor, pos_factor;
+        if ((total_weight <= 0 || desired_sharpen_ratio > sharpen_ratio) && total_negative_weight > 0 && sharpened_weight > 0) {
+            pos_factor = 1.0 / sharpened_weight;
+            neg_factor = pos_factor * target_negative_weight / total_negative_weight;
+        }
+        else if (total_weight > 0) {
+            neg_factor = pos_factor = 1.0 / total_weight;
+        }
+        else if (total_positive_weight > 0) {
+            //Nothing to balance the negative weights; drop them
+            neg_factor = 0;
+            pos_factor = 1.0 / total_positive_weight;
         }
         else {
-            neg_factor = pos_factor = (float)(1.0f / total_weight);
+            //No positive weights at all; the row is emptied below
+            neg_factor = pos_factor = 0;
         }
         for (ix = 0; ix < source_pixel_count; ix++) {
             if (weights[ix] < 0) {
-                weights[ix] *= neg_factor;
+                weights[ix] = (float)(weights[ix] * neg_factor);
                 negative_area -= weights[ix];
             }
             else {
-                weights[ix] *= pos_factor;
+                weights[ix] = (float)(weights[ix] * pos_factor);
                 positive_area += weights[ix];
             }
         }
@@ -463,6 +720,7 @@ LineContributions *LineContributions_create(Context * context,  const uint32_t o
             res->ContribRow[u].Left++;
         }
     }
+    CONTEXT_free(context, sampled);
     res->percent_negative = negative_area / positive_area;
     return res;
 }
@@ -1,9 +1,13 @@
 #include "catch.hpp"
 
 #include "fastscaling_private.h"
+#include "concurrency.h"
+#include "simd.h"
 #include "weighting_test_helpers.h"
 #include "trim_whitespace.h"
 #include "string.h"
+#include <chrono>
+#include <thread>
 
 bool test (int sx, int sy, BitmapPixelFormat sbpp, int cx, int cy, BitmapPixelFormat cbpp, bool transpose, bool flipx, bool flipy, bool profile, InterpolationFilter filter)
 {
@@ -106,6 +110,849 @@ TEST_CASE ("Sharpen and convolve in place", "[fastscaling]")
 }
 //*/
 
+TEST_CASE ("Render Gray8", "[fastscaling]")
+{
+    REQUIRE (test (400, 300, Gray8, 200, 40, Gray8, false, false, false, false, DEFAULT_FILTER));
+    REQUIRE (test (200, 40, Gray8, 500, 300, Bgra32, true, true, true, false, DEFAULT_FILTER));
+    REQUIRE (test (400, 300, Bgra32, 120, 90, Gray8, true, false, false, false, DEFAULT_FILTER));
+    REQUIRE (test_in_place (400, 300, Gray8, true, true, false, 0.5, 3));
+}
+
+TEST_CASE ("Gray8 renders match the equivalent Bgr24 render", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+
+    BitmapBgra * gray = BitmapBgra_create (&context, 317, 211, false, Gray8);
+    BitmapBgra * color = BitmapBgra_create (&context, 317, 211, false, Bgr24);
+    REQUIRE (gray != NULL);
+    REQUIRE (color != NULL);
+    for (uint32_t y = 0; y < gray->h; y++) {
+        for (uint32_t x = 0; x < gray->w; x++) {
+            const uint8_t v = (uint8_t)((x * 7 + y * 3) % 256);
+            gray->pixels[y * gray->stride + x] = v;
+            memset (color->pixels + y * color->stride + x * 3, v, 3);
+        }
+    }
+    BitmapBgra * gray_canvas = BitmapBgra_create (&context, 37, 101, true, Gray8);
+    BitmapBgra * color_canvas = BitmapBgra_create (&context, 37, 101, true, Bgr24);
+    BitmapBgra * expanded_canvas = BitmapBgra_create (&context, 37, 101, true, Bgr24);
+    RenderDetails * details = RenderDetails_create_with (&context, DEFAULT_FILTER);
+    REQUIRE (details != NULL);
+    details->sharpen_percent_goal = 10;
+    details->halving_divisor = 2;
+    REQUIRE (RenderDetails_render (&context, details, gray, gray_canvas));
+    details->halving_divisor = 2;
+    REQUIRE (RenderDetails_render (&context, details, color, color_canvas));
+    details->halving_divisor = 2;
+    REQUIRE (RenderDetails_render (&context, details, gray, expanded_canvas));
+
+    for (uint32_t y = 0; y < gray_canvas->h; y++) {
+        for (uint32_t x = 0; x < gray_canvas->w; x++) {
+            const uint8_t * expected = color_canvas->pixels + y * color_canvas->stride + x * 3;
+            const uint8_t * expanded = expanded_canvas->pixels + y * expanded_canvas->stride + x * 3;
+            CAPTURE (x);
+            CAPTURE (y);
+            REQUIRE (abs ((int)gray_canvas->pixels[y * gray_canvas->stride + x] - (int)expected[0]) <= 1);
+            REQUIRE (expanded[0] == gray_canvas->pixels[y * gray_canvas->stride + x]);
+            REQUIRE (expanded[1] == expanded[0]);
+            REQUIRE (expanded[2] == expanded[0]);
+        }
+    }
+
+    RenderDetails_destroy (&context, details);
+    BitmapBgra_destroy (&context, gray);
+    BitmapBgra_destroy (&context, color);
+    BitmapBgra_destroy (&context, gray_canvas);
+    BitmapBgra_destroy (&context, color_canvas);
+    BitmapBgra_destroy (&context, expanded_canvas);
+    Context_terminate (&context);
+}
+
+TEST_CASE ("Opaque alpha detection does not change the output", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+
+    BitmapBgra * source = BitmapBgra_create (&context, 203, 157, false, Bgra32);
+    REQUIRE (source != NULL);
+    for (uint32_t y = 0; y < source->h; y++) {
+        for (uint32_t x = 0; x < source->w; x++) {
+            uint8_t * pixel = source->pixels + y * source->stride + x * 4;
+            pixel[0] = (uint8_t)(x * 5 + y);
+            pixel[1] = (uint8_t)(x * 3 + y * 7);
+            pixel[2] = (uint8_t)(y * 11);
+            pixel[3] = 0xFF;
+        }
+    }
+    RenderDetails * details = RenderDetails_create_with (&context, DEFAULT_FILTER);
+    REQUIRE (details != NULL);
+    details->sharpen_percent_goal = 10;
+
+    //The first pass is fully opaque, then only the lower rows are
+    for (int translucent = 0; translucent < 2; translucent++) {
+        if (translucent) {
+            for (uint32_t y = 0; y < source->h / 3; y++) {
+                for (uint32_t x = 0; x < source->w; x++) {
+                    source->pixels[y * source->stride + x * 4 + 3] = (uint8_t)(x + y * 3);
+                }
+            }
+        }
+        BitmapBgra * detected = BitmapBgra_create (&context, 61, 97, true, Bgra32);
+        BitmapBgra * undetected = BitmapBgra_create (&context, 61, 97, true, Bgra32);
+        REQUIRE (detected != NULL);
+        REQUIRE (undetected != NULL);
+        details->detect_opaque_alpha = true;
+        REQUIRE (RenderDetails_render (&context, details, source, detected));
+        details->detect_opaque_alpha = false;
+        REQUIRE (RenderDetails_render (&context, details, source, undetected));
+
+        int max_delta = 0;
+        int min_alpha = 0xFF;
+        for (uint32_t y = 0; y < detected->h; y++) {
+            for (uint32_t x = 0; x < detected->w; x++) {
+                const uint8_t * a = detected->pixels + y * detected->stride + x * 4;
+                const uint8_t * b = undetected->pixels + y * undetected->stride + x * 4;
+                for (int i = 0; i < 4; i++) {
+                    max_delta = int_max (max_delta, abs ((int)a[i] - (int)b[i]));
+                }
+                min_alpha = int_min (min_alpha, (int)a[3]);
+            }
+        }
+        CAPTURE (translucent);
+        REQUIRE (max_delta <= 1);
+        if (!translucent) {
+            REQUIRE (min_alpha == 0xFF);
+        }
+        BitmapBgra_destroy (&context, detected);
+        BitmapBgra_destroy (&context, undetected);
+    }
+
+    RenderDetails_destroy (&context, details);
+    BitmapBgra_destroy (&context, source);
+    Context_terminate (&context);
+}
+
+TEST_CASE ("Vectorized row conversion matches scalar", "[fastscaling]")
+{
+    struct { BitmapPixelFormat from; BitmapPixelFormat to; bool translucent; } cases[] = {
+        { Bgra32, Bgra32, true }, { Bgra32, Bgra32, false }, { Bgra32, Bgr24, true }, { Bgr24, Bgr24, false },
+        { Bgr24, Bgra32, false }, { Gray8, Gray8, false }, { Gray8, Bgra32, false }, { Bgra32, Gray8, true },
+    };
+    const WorkingFloatspace spaces[] = { Floatspace_as_is, Floatspace_linear, Floatspace_gamma };
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        for (size_t sp = 0; sp < sizeof(spaces) / sizeof(spaces[0]); sp++) {
+            Context context;
+            Context_initialize (&context);
+            Context_set_floatspace (&context, spaces[sp], 2.2f, 0, 0);
+
+            BitmapBgra * source = BitmapBgra_create (&context, 203, 37, false, cases[c].from);
+            REQUIRE (source != NULL);
+            const uint32_t bytes_pp = BitmapPixelFormat_bytes_per_pixel (source->fmt);
+            for (uint32_t y = 0; y < source->h; y++) {
+                for (uint32_t x = 0; x < source->w * bytes_pp; x++) {
+                    const bool alpha = bytes_pp == 4 && x % 4 == 3;
+                    source->pixels[y * source->stride + x] = alpha && !cases[c].translucent ? 0xFF : (uint8_t)(x * 7 + y * 13);
+                }
+            }
+            BitmapBgra * canvases[2];
+            RenderDetails * details = RenderDetails_create_with (&context, DEFAULT_FILTER);
+            REQUIRE (details != NULL);
+            for (int simd = 0; simd < 2; simd++) {
+                simd_set_max_level (simd ? Simd_avx2 : Simd_none);
+                canvases[simd] = BitmapBgra_create (&context, 67, 29, true, cases[c].to);
+                REQUIRE (canvases[simd] != NULL);
+                REQUIRE (RenderDetails_render (&context, details, source, canvases[simd]));
+            }
+            simd_set_max_level (Simd_avx2);
+
+            int mismatches = 0;
+            const uint32_t row_bytes = canvases[0]->w * BitmapPixelFormat_bytes_per_pixel (canvases[0]->fmt);
+            for (uint32_t y = 0; y < canvases[0]->h; y++) {
+                mismatches += memcmp (canvases[0]->pixels + y * canvases[0]->stride, canvases[1]->pixels + y * canvases[1]->stride, row_bytes) != 0;
+            }
+            CAPTURE (c);
+            CAPTURE (sp);
+            CHECK (mismatches == 0);
+
+            RenderDetails_destroy (&context, details);
+            BitmapBgra_destroy (&context, canvases[0]);
+            BitmapBgra_destroy (&context, canvases[1]);
+            BitmapBgra_destroy (&context, source);
+            Context_terminate (&context);
+        }
+    }
+}
+
+TEST_CASE ("Vectorized compositing matches scalar", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    BitmapBgra * source = BitmapBgra_create (&context, 97, 83, false, Bgra32);
+    REQUIRE (source != NULL);
+    for (uint32_t y = 0; y < source->h; y++) {
+        for (uint32_t x = 0; x < source->w * 4; x++) {
+            source->pixels[y * source->stride + x] = (uint8_t)(x * 5 + y * 9 + (x * y) % 13);
+        }
+    }
+    RenderDetails * details = RenderDetails_create_with (&context, DEFAULT_FILTER);
+    REQUIRE (details != NULL);
+    const BitmapPixelFormat formats[] = { Bgra32, Bgr24 };
+    for (size_t f = 0; f < 2; f++) {
+        for (int transpose = 0; transpose < 2; transpose++) {
+            BitmapBgra * canvases[2];
+            for (int i = 0; i < 2; i++) {
+                canvases[i] = BitmapBgra_create (&context, 45, 38, false, formats[f]);
+                REQUIRE (canvases[i] != NULL);
+                BitmapBgra * c = canvases[i];
+                for (uint32_t y = 0; y < c->h; y++) {
+                    for (uint32_t x = 0; x < c->stride; x++) {
+                        c->pixels[y * c->stride + x] = (uint8_t)(x * 11 + y * 3);
+                    }
+                }
+                c->compositing_mode = Blend_with_self;
+                details->post_transpose = transpose != 0;
+                simd_set_max_level (i == 0 ? Simd_sse2 : Simd_avx2);
+                REQUIRE (RenderDetails_render (&context, details, source, c));
+                simd_set_max_level (Simd_avx2);
+            }
+            int max_delta = 0;
+            for (uint32_t y = 0; y < canvases[0]->h; y++) {
+                for (uint32_t x = 0; x < canvases[0]->w * BitmapPixelFormat_bytes_per_pixel (formats[f]); x++) {
+                    const uint32_t i = y * canvases[0]->stride + x;
+                    max_delta = int_max (max_delta, abs ((int)canvases[0]->pixels[i] - (int)canvases[1]->pixels[i]));
+                }
+            }
+            CAPTURE (formats[f]);
+            CAPTURE (transpose);
+            CHECK (max_delta <= 1);
+            BitmapBgra_destroy (&context, canvases[0]);
+            BitmapBgra_destroy (&context, canvases[1]);
+        }
+    }
+    RenderDetails_destroy (&context, details);
+    BitmapBgra_destroy (&context, source);
+    Context_terminate (&context);
+}
+
+TEST_CASE ("Compositing skips clear spans and copies opaque ones", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    const uint32_t w = 203;
+    BitmapFloat * src = BitmapFloat_create (&context, w, 1, 4, true);
+    BitmapBgra * dest = BitmapBgra_create (&context, w, 1, false, Bgra32);
+    REQUIRE (src != NULL);
+    REQUIRE (dest != NULL);
+    src->alpha_meaningful = true;
+    src->alpha_premultiplied = true;
+    dest->compositing_mode = Blend_with_self;
+    //Runs of clear, opaque and translucent pixels of varying lengths, including short opaque runs
+    for (uint32_t x = 0; x < w; x++) {
+        const uint32_t segment = x < 120 ? (x / 17) % 4 : (x / 3) % 4;
+        const float alpha = segment == 0 ? 0.0f : segment == 1 ? 1.0f : (float)(x % 9 + 1) / 10.0f;
+        for (uint32_t c = 0; c < 3; c++) {
+            src->pixels[x * 4 + c] = segment == 0 ? 0.0f : alpha * (float)((x + c * 7) % 10) / 9.0f;
+        }
+        src->pixels[x * 4 + 3] = alpha;
+        for (uint32_t c = 0; c < 4; c++) {
+            dest->pixels[x * 4 + c] = (uint8_t)(x * 3 + c * 50 + 1);
+        }
+    }
+    REQUIRE (BitmapFloat_pivoting_composite_linear_over_srgb (&context, src, 0, dest, 0, 1, false, NULL));
+
+    int max_delta = 0;
+    int clear_changes = 0;
+    for (uint32_t x = 0; x < w; x++) {
+        const float * s = src->pixels + x * 4;
+        uint8_t original[4];
+        for (uint32_t c = 0; c < 4; c++) {
+            original[c] = (uint8_t)(x * 3 + c * 50 + 1);
+        }
+        if (s[3] == 0) {
+            clear_changes += memcmp (original, dest->pixels + x * 4, 4) != 0;
+            continue;
+        }
+        const float a = (1.0f - s[3]) * original[3] / 255.0f;
+        const float final_alpha = s[3] + a;
+        for (uint32_t c = 0; c < 3; c++) {
+            const float v = (Context_srgb_to_floatspace (&context, original[c]) * a + s[c]) / final_alpha;
+            max_delta = int_max (max_delta, abs ((int)Context_floatspace_to_srgb (&context, v) - (int)dest->pixels[x * 4 + c]));
+        }
+        max_delta = int_max (max_delta, abs ((int)uchar_clamp_ff (final_alpha * 255) - (int)dest->pixels[x * 4 + 3]));
+    }
+    CHECK (clear_changes == 0);
+    CHECK (max_delta <= 1);
+    BitmapFloat_destroy (&context, src);
+    BitmapBgra_destroy (&context, dest);
+    Context_terminate (&context);
+}
+
+TEST_CASE ("Matte spans match blending every pixel with the matte", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    const uint32_t w = 157;
+    const uint8_t mattes[2][4] = { { 40, 200, 90, 255 }, { 40, 200, 90, 120 } };
+    const BitmapPixelFormat formats[] = { Bgra32, Bgr24, Gray8 };
+    for (size_t m = 0; m < 2; m++) {
+        for (size_t f = 0; f < 3; f++) {
+            BitmapFloat * rows[2];
+            BitmapBgra * dests[2];
+            for (int i = 0; i < 2; i++) {
+                rows[i] = BitmapFloat_create (&context, w, 1, 4, true);
+                dests[i] = BitmapBgra_create (&context, w, 1, true, formats[f]);
+                REQUIRE (rows[i] != NULL);
+                REQUIRE (dests[i] != NULL);
+                rows[i]->alpha_meaningful = true;
+                rows[i]->alpha_premultiplied = true;
+                memcpy (dests[i]->matte_color, mattes[m], 4);
+                dests[i]->compositing_mode = Blend_with_matte;
+                //Letterbox: clear edges around opaque content with translucent borders and specks
+                for (uint32_t x = 0; x < w; x++) {
+                    const bool clear = x < 30 || x >= 130;
+                    const bool translucent = x < 36 || x >= 124 || x % 17 == 0;
+                    const float alpha = clear ? 0.0f : translucent ? (float)(x % 7 + 1) / 8.0f : 1.0f;
+                    for (uint32_t c = 0; c < 3; c++) {
+                        rows[i]->pixels[x * 4 + c] = alpha * (float)((x * 3 + c * 5) % 16) / 15.0f;
+                    }
+                    rows[i]->pixels[x * 4 + 3] = alpha;
+                }
+            }
+            REQUIRE (BitmapFloat_blend_matte (&context, rows[0], 0, 1, mattes[m]));
+            REQUIRE (BitmapFloat_copy_linear_over_srgb (&context, rows[0], 0, dests[0], 0, 1, 0, w, false));
+            REQUIRE (BitmapFloat_pivoting_composite_linear_over_srgb (&context, rows[1], 0, dests[1], 0, 1, false, NULL));
+
+            int max_delta = 0;
+            for (uint32_t x = 0; x < w * BitmapPixelFormat_bytes_per_pixel (formats[f]); x++) {
+                max_delta = int_max (max_delta, abs ((int)dests[0]->pixels[x] - (int)dests[1]->pixels[x]));
+            }
+            CAPTURE (m);
+            CAPTURE (formats[f]);
+            CHECK (max_delta <= 1);
+            for (int i = 0; i < 2; i++) {
+                BitmapFloat_destroy (&context, rows[i]);
+                BitmapBgra_destroy (&context, dests[i]);
+            }
+        }
+    }
+    Context_terminate (&context);
+}
+
+TEST_CASE ("Color matrix matches the RGBA formula at every SIMD level", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    float data[25];
+    float * m[5];
+    for (int i = 0; i < 5; i++) {
+        m[i] = &data[i * 5];
+    }
+    const uint32_t channels[] = { 4, 3 };
+    //A general matrix, then the same matrix reduced to its diagonal
+    for (int diagonal = 0; diagonal < 2; diagonal++) {
+        for (int i = 0; i < 25; i++) {
+            const bool off_diagonal = i < 20 && i % 5 != i / 5;
+            data[i] = diagonal && off_diagonal ? 0 : (float)((i * 37) % 11) / 7.0f - 0.5f;
+        }
+        ColorMatrixBgra cm;
+        ColorMatrixBgra_init (&cm, m);
+        CHECK (cm.kind == (diagonal ? ColorMatrix_diagonal : ColorMatrix_general));
+        for (size_t c = 0; c < 2; c++) {
+            for (int level = Simd_none; level <= Simd_avx2; level++) {
+                BitmapFloat * bmp = BitmapFloat_create (&context, 37, 2, channels[c], true);
+                REQUIRE (bmp != NULL);
+                for (uint32_t i = 0; i < bmp->float_stride * 2; i++) {
+                    bmp->pixels[i] = (float)((i * 13) % 17) / 16.0f;
+                }
+                simd_set_max_level ((SimdLevel)level);
+                REQUIRE (BitmapFloat_apply_color_matrix (&context, bmp, 0, 2, m));
+                simd_set_max_level (Simd_avx2);
+
+                float max_error = 0;
+                for (uint32_t p = 0; p < bmp->w * 2; p++) {
+                    //Rows may be padded
+                    const uint32_t i = (p / bmp->w) * bmp->float_stride + (p % bmp->w) * channels[c];
+                    float in[4];
+                    for (uint32_t ch = 0; ch < 4; ch++) {
+                        const uint32_t ix = i + ch;
+                        in[ch] = ch < channels[c] ? (float)((ix * 13) % 17) / 16.0f : 0;
+                    }
+                    const float * out = bmp->pixels + i;
+                    //RGBA rows and columns, BGRA pixels
+                    for (uint32_t ch = 0; ch < channels[c]; ch++) {
+                        const int col = ch == 3 ? 3 : 2 - (int)ch;
+                        const float expected = m[0][col] * in[2] + m[1][col] * in[1] + m[2][col] * in[0] + m[3][col] * in[3] + m[4][col];
+                        max_error = fmaxf (max_error, fabsf (out[ch] - expected));
+                    }
+                }
+                CAPTURE (diagonal);
+                CAPTURE (channels[c]);
+                CAPTURE (level);
+                CHECK (max_error < 0.00001f);
+                BitmapFloat_destroy (&context, bmp);
+            }
+        }
+    }
+    Context_terminate (&context);
+}
+
+TEST_CASE ("Demultiply and matte blending match division at every SIMD level", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    const uint8_t matte[4] = { 30, 160, 220, 200 };
+    const float linear_matte[4] = {
+        Context_srgb_to_floatspace (&context, matte[0]),
+        Context_srgb_to_floatspace (&context, matte[1]),
+        Context_srgb_to_floatspace (&context, matte[2]),
+        matte[3] / 255.0f
+    };
+    for (int use_matte = 0; use_matte < 2; use_matte++) {
+        for (int level = Simd_none; level <= Simd_avx2; level++) {
+            BitmapFloat * bmp = BitmapFloat_create (&context, 37, 1, 4, true);
+            REQUIRE (bmp != NULL);
+            //Premultiplied pixels, including fully transparent and fully opaque ones
+            for (uint32_t x = 0; x < bmp->w; x++) {
+                const float alpha = (float)(x % 6) / 5.0f;
+                for (uint32_t c = 0; c < 3; c++) {
+                    bmp->pixels[x * 4 + c] = alpha * (float)((x * 7 + c * 3) % 11) / 10.0f;
+                }
+                bmp->pixels[x * 4 + 3] = alpha;
+            }
+            simd_set_max_level ((SimdLevel)level);
+            if (use_matte) {
+                REQUIRE (BitmapFloat_blend_matte (&context, bmp, 0, 1, matte));
+            } else {
+                REQUIRE (BitmapFloat_demultiply_alpha (&context, bmp, 0, 1));
+            }
+            simd_set_max_level (Simd_avx2);
+
+            float max_error = 0;
+            for (uint32_t x = 0; x < bmp->w; x++) {
+                const float src_alpha = (float)(x % 6) / 5.0f;
+                const float a = use_matte ? (1.0f - src_alpha) * linear_matte[3] : 0;
+                const float final_alpha = src_alpha + a;
+                for (uint32_t c = 0; c < 3; c++) {
+                    const float premultiplied = src_alpha * (float)((x * 7 + c * 3) % 11) / 10.0f + linear_matte[c] * a;
+                    const float expected = final_alpha > 0 ? premultiplied / final_alpha : premultiplied;
+                    max_error = fmaxf (max_error, fabsf (bmp->pixels[x * 4 + c] - expected));
+                }
+                max_error = fmaxf (max_error, fabsf (bmp->pixels[x * 4 + 3] - final_alpha));
+            }
+            CAPTURE (use_matte);
+            CAPTURE (level);
+            CHECK (max_error < 0.000002f);
+            BitmapFloat_destroy (&context, bmp);
+        }
+    }
+    Context_terminate (&context);
+}
+
+TEST_CASE ("Convolution matches a direct weighted average at every SIMD level", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    //{channels, convolved channels, width, radius}; the last case has no interior pixels at all
+    const uint32_t cases[][4] = { { 4, 4, 45, 1 }, { 4, 4, 45, 5 }, { 3, 3, 45, 5 }, { 4, 3, 45, 3 }, { 3, 3, 7, 5 } };
+    for (uint32_t c = 0; c < sizeof (cases) / sizeof (cases[0]); c++) {
+        const uint32_t channels = cases[c][0], convolved = cases[c][1], w = cases[c][2], radius = cases[c][3];
+        for (int thresholds = 0; thresholds < 2; thresholds++) {
+            for (int level = Simd_none; level <= Simd_avx2; level++) {
+                ConvolutionKernel * kernel = ConvolutionKernel_create_guassian_normalized (&context, 1.5, radius);
+                REQUIRE (kernel != NULL);
+                kernel->threshold_min_change = thresholds ? 0.05f : 0;
+                kernel->threshold_max_change = thresholds ? 0.6f : 0;
+                BitmapFloat * bmp = BitmapFloat_create (&context, w, 2, channels, true);
+                REQUIRE (bmp != NULL);
+                for (uint32_t i = 0; i < w * channels; i++) {
+                    //Smooth stretches, then noise
+                    bmp->pixels[i] = i < w * channels / 2 ? (float)(i / channels) / (float)w : (float)((i * 37) % 17) / 16.0f;
+                    bmp->pixels[bmp->float_stride + i] = bmp->pixels[i];
+                }
+                simd_set_max_level ((SimdLevel)level);
+                //Only the second row is convolved
+                REQUIRE (BitmapFloat_convolve_rows (&context, bmp, kernel, convolved, 1, 1));
+                simd_set_max_level (Simd_avx2);
+
+                const float * original = bmp->pixels;
+                const float * result = bmp->pixels + bmp->float_stride;
+                float max_error = 0;
+                for (int32_t x = 0; x < (int32_t)w; x++) {
+                    double avg[4] = { 0, 0, 0, 0 };
+                    double total_weight = 0;
+                    for (int32_t i = x - (int32_t)radius; i <= x + (int32_t)radius; i++) {
+                        if (i >= 0 && i < (int32_t)w) {
+                            const double weight = kernel->kernel[i - x + (int32_t)radius];
+                            total_weight += weight;
+                            for (uint32_t j = 0; j < convolved; j++) {
+                                avg[j] += weight * original[i * channels + j];
+                            }
+                        }
+                    }
+                    double change = 0;
+                    for (uint32_t j = 0; j < convolved; j++) {
+                        avg[j] /= total_weight;
+                        change += fabs (original[x * channels + j] - avg[j]);
+                    }
+                    if (thresholds && (fabs (change - kernel->threshold_min_change) < 0.0001 || fabs (change - kernel->threshold_max_change) < 0.0001)) {
+                        continue; //Too close to call
+                    }
+                    const bool keep = thresholds && (change < kernel->threshold_min_change || change > kernel->threshold_max_change);
+                    for (uint32_t j = 0; j < channels; j++) {
+                        const double expected = j >= convolved || keep ? original[x * channels + j] : avg[j];
+                        max_error = fmaxf (max_error, (float)fabs (result[x * channels + j] - expected));
+                    }
+                }
+                CAPTURE (c);
+                CAPTURE (thresholds);
+                CAPTURE (level);
+                CHECK (max_error < 0.000005f);
+                BitmapFloat_destroy (&context, bmp);
+                ConvolutionKernel_destroy (&context, kernel);
+            }
+        }
+    }
+    Context_terminate (&context);
+}
+
+TEST_CASE ("Box gaussian blurs match their equivalent kernel", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    for (uint32_t channels = 3; channels <= 4; channels++) {
+        ConvolutionKernel * box = ConvolutionKernel_create_box_guassian (&context, 12);
+        REQUIRE (box != NULL);
+        REQUIRE (box->box_radii[0] > 0);
+        //The weights approximate the gaussian they stand in for
+        double sum = 0, variance = 0;
+        for (uint32_t i = 0; i < box->width; i++) {
+            const double offset = (double)i - box->radius;
+            sum += box->kernel[i];
+            variance += box->kernel[i] * offset * offset;
+        }
+        CHECK (fabs (sum - 1) < 0.0001);
+        CHECK (fabs (sqrt (variance) - 12) < 0.5);
+
+        const uint32_t w = 300;
+        BitmapFloat * blurred = BitmapFloat_create (&context, w, 1, channels, true);
+        BitmapFloat * convolved = BitmapFloat_create (&context, w, 1, channels, true);
+        REQUIRE (blurred != NULL);
+        REQUIRE (convolved != NULL);
+        for (uint32_t i = 0; i < w * channels; i++) {
+            blurred->pixels[i] = convolved->pixels[i] = (float)((i * 37) % 17) / 16.0f;
+        }
+        REQUIRE (BitmapFloat_convolve_rows (&context, blurred, box, channels, 0, 1));
+        //The same weights as a dense kernel
+        box->box_radii[0] = 0;
+        REQUIRE (BitmapFloat_convolve_rows (&context, convolved, box, channels, 0, 1));
+
+        //Edges are renormalized per pass, so only pixels whose whole window is present must agree
+        float max_error = 0;
+        for (uint32_t i = box->radius * channels; i < (w - box->radius) * channels; i++) {
+            max_error = fmaxf (max_error, fabsf (blurred->pixels[i] - convolved->pixels[i]));
+        }
+        CAPTURE (channels);
+        CHECK (max_error < 0.00001f);
+        //Edges still come out as averages of nearby pixels
+        float lowest = 1, highest = 0;
+        for (uint32_t i = 0; i < w * channels; i++) {
+            lowest = fminf (lowest, blurred->pixels[i]);
+            highest = fmaxf (highest, blurred->pixels[i]);
+        }
+        CHECK (lowest >= 0);
+        CHECK (highest <= 1);
+        BitmapFloat_destroy (&context, blurred);
+        BitmapFloat_destroy (&context, convolved);
+        ConvolutionKernel_destroy (&context, box);
+    }
+    Context_terminate (&context);
+}
+
+TEST_CASE ("Unsharp mask adds back the detail its blur removes", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    //Sigma 1 blurs with a dense kernel, sigma 6 with box filters
+    const double sigmas[] = { 1, 6 };
+    for (uint32_t s = 0; s < 2; s++) {
+        for (int thresholds = 0; thresholds < 2; thresholds++) {
+            ConvolutionKernel * blur = ConvolutionKernel_create_unsharp_blur (&context, sigmas[s]);
+            REQUIRE (blur != NULL);
+            CHECK ((blur->box_radii[0] > 0) == (s == 1));
+            const uint32_t w = 60;
+            BitmapFloat * sharpened = BitmapFloat_create (&context, w, 1, 4, true);
+            BitmapFloat * blurred = BitmapFloat_create (&context, w, 1, 4, true);
+            REQUIRE (sharpened != NULL);
+            REQUIRE (blurred != NULL);
+            for (uint32_t i = 0; i < w * 4; i++) {
+                //A step edge with some noise on either side
+                sharpened->pixels[i] = blurred->pixels[i] = (i / 4 < w / 2 ? 0.2f : 0.7f) + (float)((i * 37) % 5) / 100.0f;
+            }
+            const float threshold = thresholds ? 0.1f : 0;
+            REQUIRE (BitmapFloat_unsharp_rows (&context, sharpened, blur, 0.8f, threshold, 0, 1));
+            REQUIRE (BitmapFloat_convolve_rows (&context, blurred, blur, 4, 0, 1));
+
+            float max_error = 0;
+            uint32_t unchanged = 0;
+            for (uint32_t x = 0; x < w; x++) {
+                float change = 0;
+                for (uint32_t c = 0; c < 4; c++) {
+                    const float original = (x < w / 2 ? 0.2f : 0.7f) + (float)(((x * 4 + c) * 37) % 5) / 100.0f;
+                    change += fabsf (original - blurred->pixels[x * 4 + c]);
+                }
+                for (uint32_t c = 0; c < 4; c++) {
+                    const float original = (x < w / 2 ? 0.2f : 0.7f) + (float)(((x * 4 + c) * 37) % 5) / 100.0f;
+                    const float expected = change < threshold ? original : original + 0.8f * (original - blurred->pixels[x * 4 + c]);
+                    max_error = fmaxf (max_error, fabsf (sharpened->pixels[x * 4 + c] - expected));
+                }
+                if (change < threshold) unchanged++;
+            }
+            CAPTURE (s);
+            CAPTURE (thresholds);
+            CHECK (max_error < 0.000001f);
+            //The threshold spares the noise but not the edge
+            CHECK ((unchanged > 0) == (thresholds == 1));
+            CHECK (unchanged < w);
+            //The edge overshoots on both sides
+            CHECK (sharpened->pixels[(w / 2 - 1) * 4] < 0.2f);
+            CHECK (sharpened->pixels[(w / 2) * 4] > 0.7f);
+            BitmapFloat_destroy (&context, sharpened);
+            BitmapFloat_destroy (&context, blurred);
+            ConvolutionKernel_destroy (&context, blur);
+        }
+    }
+    //Renders apply it after scaling in both directions
+    BitmapBgra * source = BitmapBgra_create (&context, 64, 64, true, Bgr24);
+    REQUIRE (source != NULL);
+    for (uint32_t y = 0; y < 64; y++) {
+        memset (source->pixels + y * source->stride, y < 32 ? 40 : 200, 64 * 3);
+    }
+    uint8_t edge_pixels[2][2];
+    for (int unsharp = 0; unsharp < 2; unsharp++) {
+        BitmapBgra * canvas = BitmapBgra_create (&context, 32, 32, true, Bgr24);
+        RenderDetails * details = RenderDetails_create_with (&context, Filter_Triangle);
+        REQUIRE (canvas != NULL);
+        REQUIRE (details != NULL);
+        details->unsharp_sigma = unsharp ? 1.5f : 0;
+        details->unsharp_amount = unsharp ? 1 : 0;
+        REQUIRE (RenderDetails_render (&context, details, source, canvas));
+        edge_pixels[unsharp][0] = canvas->pixels[14 * canvas->stride];
+        edge_pixels[unsharp][1] = canvas->pixels[17 * canvas->stride];
+        RenderDetails_destroy (&context, details);
+        BitmapBgra_destroy (&context, canvas);
+    }
+    CHECK (edge_pixels[1][0] < edge_pixels[0][0]);
+    CHECK (edge_pixels[1][1] > edge_pixels[0][1]);
+    BitmapBgra_destroy (&context, source);
+    Context_terminate (&context);
+}
+
+TEST_CASE ("Sharpening matches the 3-tap formula at every SIMD level", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    const uint32_t widths[] = { 1, 3, 5, 8, 13, 37, 100 };
+    const double pct = 0.3;
+    const float n = (float)(-pct / (pct - 1));
+    const float c_o = n / -2.0f;
+    const float c_i = n + 1;
+    for (uint32_t channels = 1; channels <= 4; channels++) {
+        if (channels == 2) continue;
+        for (uint32_t wi = 0; wi < sizeof (widths) / sizeof (widths[0]); wi++) {
+            for (int level = Simd_none; level <= Simd_avx2; level++) {
+                const uint32_t w = widths[wi];
+                BitmapFloat * bmp = BitmapFloat_create (&context, w, 1, channels, true);
+                REQUIRE (bmp != NULL);
+                for (uint32_t i = 0; i < w * channels; i++) {
+                    bmp->pixels[i] = (float)((i * 37) % 17) / 16.0f;
+                }
+                simd_set_max_level ((SimdLevel)level);
+                REQUIRE (BitmapFloat_sharpen_rows (&context, bmp, 0, 1, pct));
+                simd_set_max_level (Simd_avx2);
+
+                float max_error = 0;
+                for (uint32_t i = 0; i < w * channels; i++) {
+                    const uint32_t x = i / channels;
+                    const float original = (float)((i * 37) % 17) / 16.0f;
+                    float expected = original;
+                    if (x > 0 && x + 1 < w) {
+                        const float left = (float)(((i - channels) * 37) % 17) / 16.0f;
+                        const float right = (float)(((i + channels) * 37) % 17) / 16.0f;
+                        expected = left * c_o + original * c_i + right * c_o;
+                    }
+                    max_error = fmaxf (max_error, fabsf (bmp->pixels[i] - expected));
+                }
+                CAPTURE (channels);
+                CAPTURE (w);
+                CAPTURE (level);
+                CHECK (max_error < 0.000002f);
+                BitmapFloat_destroy (&context, bmp);
+            }
+        }
+    }
+    Context_terminate (&context);
+}
+
+TEST_CASE ("Diagonal color matrix lookup tables match the byte formula", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    //Contrast with a brightness offset on color, inverted blue, faded alpha (offsets are in byte units)
+    float data[25] = {
+        1.4f, 0, 0, 0, 0,
+        0, 1.4f, 0, 0, 0,
+        0, 0, -1, 0, 0,
+        0, 0, 0, 0.5f, 0,
+        -40, -40, 255, 0, 0
+    };
+    float * m[5];
+    for (int i = 0; i < 5; i++) {
+        m[i] = &data[i * 5];
+    }
+    ColorMatrixBgra cm;
+    ColorMatrixBgra_init (&cm, m);
+    REQUIRE (cm.kind == ColorMatrix_diagonal);
+
+    const BitmapPixelFormat formats[] = { Bgra32, Bgr24 };
+    for (size_t f = 0; f < 2; f++) {
+        BitmapBgra * bmp = BitmapBgra_create (&context, 64, 16, true, formats[f]);
+        REQUIRE (bmp != NULL);
+        const uint32_t ch = BitmapPixelFormat_bytes_per_pixel (formats[f]);
+        for (uint32_t y = 0; y < bmp->h; y++) {
+            for (uint32_t x = 0; x < bmp->w * ch; x++) {
+                bmp->pixels[y * bmp->stride + x] = (uint8_t)((y * 64 * ch + x) * 7);
+            }
+        }
+        REQUIRE (BitmapBgra_apply_color_matrix (&context, bmp, 0, bmp->h, m));
+        int mismatches = 0;
+        for (uint32_t y = 0; y < bmp->h; y++) {
+            for (uint32_t x = 0; x < bmp->w * ch; x++) {
+                const float v = (uint8_t)((y * 64 * ch + x) * 7);
+                const int col = x % ch == 3 ? 3 : 2 - (int)(x % ch);
+                const uint8_t expected = uchar_clamp_ff (m[col][col] * v + m[4][col]);
+                if (bmp->pixels[y * bmp->stride + x] != expected) {
+                    mismatches++;
+                }
+            }
+        }
+        CAPTURE (ch);
+        CHECK (mismatches == 0);
+        BitmapBgra_destroy (&context, bmp);
+    }
+    Context_terminate (&context);
+}
+
+TEST_CASE ("Threaded and sampled histograms match a direct count", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    //Large enough to be split across threads
+    const uint32_t w = 2100, h = 1100;
+    const BitmapPixelFormat formats[] = { Bgra32, Bgr24, Gray8 };
+    const uint32_t size = 64;
+    const int shift = 2;
+    uint64_t * expected = new uint64_t[3 * size];
+    uint64_t * actual = new uint64_t[3 * size];
+    for (size_t f = 0; f < 3; f++) {
+        BitmapBgra * bmp = BitmapBgra_create (&context, w, h, false, formats[f]);
+        REQUIRE (bmp != NULL);
+        const uint32_t ch = BitmapPixelFormat_bytes_per_pixel (formats[f]);
+        for (uint32_t y = 0; y < h; y++) {
+            for (uint32_t x = 0; x < w * ch; x++) {
+                bmp->pixels[y * bmp->stride + x] = (uint8_t)((x * 7 + y * 13 + (x * y) % 251) & 0xFF);
+            }
+        }
+        for (uint32_t count = 1; count <= 3; count++) {
+            for (uint32_t step = 1; step <= 3; step += 2) {
+                memset (expected, 0, sizeof (uint64_t) * 3 * size);
+                memset (actual, 0, sizeof (uint64_t) * 3 * size);
+                uint64_t expected_samples = 0;
+                for (uint32_t y = 0; y < h; y += step) {
+                    for (uint32_t x = 0; x < w; x += step) {
+                        const uint8_t * p = bmp->pixels + y * bmp->stride + x * ch;
+                        const int b = p[0], g = ch == 1 ? p[0] : p[1], r = ch == 1 ? p[0] : p[2];
+                        expected_samples++;
+                        if (count == 3) {
+                            expected[r >> shift]++;
+                            expected[size + (g >> shift)]++;
+                            expected[2 * size + (b >> shift)]++;
+                        } else {
+                            expected[((306 * r + 601 * g + 117 * b) >> 10) >> shift]++;
+                            if (count == 2) {
+                                expected[size + (int_max (abs (r - g), abs (g - b)) >> shift)]++;
+                            }
+                        }
+                    }
+                }
+                uint64_t samples = 0;
+                REQUIRE (BitmapBgra_populate_histogram_sampled (&context, bmp, actual, size, count, step, &samples));
+                CAPTURE (ch);
+                CAPTURE (count);
+                CAPTURE (step);
+                CHECK (samples == expected_samples);
+                CHECK (memcmp (expected, actual, sizeof (uint64_t) * 3 * size) == 0);
+            }
+        }
+        BitmapBgra_destroy (&context, bmp);
+    }
+    delete[] expected;
+    delete[] actual;
+
+    BitmapBgra * header = BitmapBgra_create_header (&context, 8000, 6000);
+    REQUIRE (header != NULL);
+    const uint32_t step = BitmapBgra_histogram_sample_step (header, 1000000);
+    const uint32_t grid = ((8000 + step - 1) / step) * ((6000 + step - 1) / step);
+    const uint32_t finer_grid = ((8000 + step - 2) / (step - 1)) * ((6000 + step - 2) / (step - 1));
+    CHECK (grid <= 1000000);
+    CHECK (finer_grid > 1000000);
+    CHECK (BitmapBgra_histogram_sample_step (header, 0) == 1);
+    BitmapBgra_destroy (&context, header);
+    Context_terminate (&context);
+}
+
+TEST_CASE ("Render counts the source histogram while reading it", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    const uint32_t size = 256;
+    uint64_t expected[2 * 256];
+    uint64_t actual[2 * 256];
+    //No halving, halving into a temporary image, halving in place
+    for (int mode = 0; mode < 3; mode++) {
+        BitmapBgra * source = BitmapBgra_create (&context, 403, 301, false, Bgra32);
+        BitmapBgra * canvas = BitmapBgra_create (&context, 50, 40, true, Bgra32);
+        REQUIRE (source != NULL);
+        REQUIRE (canvas != NULL);
+        for (uint32_t y = 0; y < source->h; y++) {
+            for (uint32_t x = 0; x < source->w * 4; x++) {
+                source->pixels[y * source->stride + x] = (uint8_t)(x * 3 + y * 5 + (x * y) % 7);
+            }
+        }
+        source->can_reuse_space = mode == 2;
+        memset (expected, 0, sizeof (expected));
+        memset (actual, 0, sizeof (actual));
+        uint64_t expected_samples = 0;
+        REQUIRE (BitmapBgra_populate_histogram (&context, source, expected, size, 2, &expected_samples));
+
+        RenderDetails * details = RenderDetails_create_with (&context, DEFAULT_FILTER);
+        REQUIRE (details != NULL);
+        details->halving_divisor = mode == 0 ? 1 : 3;
+        details->histograms = actual;
+        details->histogram_size_per_channel = size;
+        details->histogram_count = 2;
+        REQUIRE (RenderDetails_render (&context, details, source, canvas));
+
+        CAPTURE (mode);
+        CHECK (details->histogram_pixels_sampled == expected_samples);
+        CHECK (memcmp (expected, actual, sizeof (expected)) == 0);
+        RenderDetails_destroy (&context, details);
+        BitmapBgra_destroy (&context, source);
+        BitmapBgra_destroy (&context, canvas);
+    }
+    Context_terminate (&context);
+}
+
 BitmapBgra*  crop_window (Context * context, BitmapBgra* source, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 {
     BitmapBgra* cropped = BitmapBgra_create_header(context, w, h);
@@ -140,6 +987,433 @@ void fill_rect (Context * context, BitmapBgra* b, uint32_t x, uint32_t y, uint32
     BitmapBgra_destroy (context, cropped);
 }
 
+static bool render_with_context (Context * context, BitmapPixelFormat format)
+{
+    BitmapBgra * source = BitmapBgra_create (context, 400, 300, true, format);
+    BitmapBgra * canvas = BitmapBgra_create (context, 150, 200, true, format);
+    RenderDetails * details = RenderDetails_create_with (context, DEFAULT_FILTER);
+    bool result = source != NULL && canvas != NULL && details != NULL;
+    if (result) {
+        details->sharpen_percent_goal = 20;
+        details->unsharp_sigma = 1.2f;
+        details->unsharp_amount = 0.5f;
+        details->post_transpose = true;
+        details->kernel_a = ConvolutionKernel_create_guassian_normalized (context, 1.4, 3);
+        result = details->kernel_a != NULL && RenderDetails_render (context, details, source, canvas);
+    }
+    RenderDetails_destroy (context, details);
+    BitmapBgra_destroy (context, source);
+    BitmapBgra_destroy (context, canvas);
+    return result;
+}
+
+//Renders a gradient to 150x200 (transposed), copying the canvas into output, which holds 150 * 200 * 4 bytes
+static bool render_gradient (Context * context, bool enable_profiling, uint8_t * output)
+{
+    BitmapBgra * source = BitmapBgra_create (context, 400, 300, false, Bgra32);
+    BitmapBgra * canvas = BitmapBgra_create (context, 150, 200, true, Bgra32);
+    RenderDetails * details = RenderDetails_create_with (context, DEFAULT_FILTER);
+    bool result = source != NULL && canvas != NULL && details != NULL;
+    if (result) {
+        for (uint32_t y = 0; y < source->h; y++) {
+            for (uint32_t x = 0; x < source->w; x++) {
+                uint8_t * pixel = source->pixels + y * source->stride + x * 4;
+                pixel[0] = (uint8_t)x;
+                pixel[1] = (uint8_t)(y * 3);
+                pixel[2] = (uint8_t)((x * y) >> 4);
+                pixel[3] = 255;
+            }
+        }
+        details->enable_profiling = enable_profiling;
+        details->sharpen_percent_goal = 20;
+        details->post_transpose = true;
+        result = RenderDetails_render (context, details, source, canvas);
+    }
+    if (result) {
+        for (uint32_t y = 0; y < canvas->h; y++) {
+            memcpy (output + y * canvas->w * 4, canvas->pixels + y * canvas->stride, canvas->w * 4);
+        }
+    }
+    RenderDetails_destroy (context, details);
+    BitmapBgra_destroy (context, source);
+    BitmapBgra_destroy (context, canvas);
+    return result;
+}
+
+TEST_CASE ("Arena heap reuses its chunks across renders", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    //Not once something has been allocated from the default heap, such as the profiling log
+    REQUIRE (Context_enable_profiling (&context, 100));
+    CHECK_FALSE (Context_use_arena_heap (&context, 64 * 1024));
+    context.error.reason = No_Error;
+    CONTEXT_free (&context, context.log.log);
+    context.log.log = NULL;
+    REQUIRE (Context_use_arena_heap (&context, 64 * 1024));
+    CHECK_FALSE (Context_use_arena_heap (&context, 0));
+    context.error.reason = No_Error;
+
+    //Freeing the latest allocation gives its space back
+    void * first = CONTEXT_malloc (&context, 100);
+    REQUIRE (first != NULL);
+    CHECK (((uintptr_t)first % 16) == 0);
+    CONTEXT_free (&context, first);
+    void * again = CONTEXT_malloc (&context, 100);
+    CHECK (again == first);
+    CONTEXT_free (&context, again);
+
+    //Large allocations get their own chunk, returned to the buffer pool when freed
+    Context_free_static_caches ();
+    const size_t before_large = Context_arena_heap_reserved_bytes (&context);
+    uint8_t * large = (uint8_t *)CONTEXT_calloc (&context, 1, 1024 * 1024);
+    REQUIRE (large != NULL);
+    CHECK (large[1024 * 1024 - 1] == 0);
+    CHECK (Context_arena_heap_reserved_bytes (&context) > before_large + 1024 * 1024);
+    memset (large, 0xAB, 1024 * 1024);
+    CONTEXT_free (&context, large);
+    CHECK (Context_arena_heap_reserved_bytes (&context) == before_large);
+    CHECK (BufferPool_idle_bytes () > 1024 * 1024);
+    //The next one reuses it, cleared
+    large = (uint8_t *)CONTEXT_calloc (&context, 1, 1024 * 1024);
+    REQUIRE (large != NULL);
+    CHECK (BufferPool_idle_bytes () == 0);
+    bool zeroed = true;
+    for (size_t i = 0; i < 1024 * 1024; i += 511) {
+        zeroed = zeroed && large[i] == 0;
+    }
+    CHECK (zeroed);
+    CONTEXT_free (&context, large);
+
+    for (int format = 0; format < 2; format++) {
+        REQUIRE (render_with_context (&context, format == 0 ? Bgra32 : Bgr24));
+        Context_reset_arena_heap (&context);
+        const size_t reserved = Context_arena_heap_reserved_bytes (&context);
+        CHECK (reserved > 0);
+        //The same job again fits in the chunks the first one left behind
+        REQUIRE (render_with_context (&context, format == 0 ? Bgra32 : Bgr24));
+        Context_reset_arena_heap (&context);
+        CHECK (Context_arena_heap_reserved_bytes (&context) == reserved);
+    }
+
+    //A profiled render leaves its log in the arena; the reset must take it too, or the next render writes into it
+    static uint8_t expected[150 * 200 * 4];
+    static uint8_t actual[150 * 200 * 4];
+    Context reference;
+    Context_initialize (&reference);
+    REQUIRE (render_gradient (&reference, false, expected));
+    Context_terminate (&reference);
+    REQUIRE (render_gradient (&context, true, actual));
+    CHECK (Context_get_profiler_log (&context)->count > 0);
+    CHECK (memcmp (actual, expected, sizeof (expected)) == 0);
+    Context_reset_arena_heap (&context);
+    CHECK (Context_get_profiler_log (&context)->log == NULL);
+    memset (actual, 0, sizeof (actual));
+    REQUIRE (render_gradient (&context, false, actual));
+    CHECK (memcmp (actual, expected, sizeof (expected)) == 0);
+    Context_reset_arena_heap (&context);
+    //And profiling can be enabled again
+    memset (actual, 0, sizeof (actual));
+    REQUIRE (render_gradient (&context, true, actual));
+    CHECK (memcmp (actual, expected, sizeof (expected)) == 0);
+    Context_terminate (&context);
+}
+
+TEST_CASE ("Buffer pool hands freed buffers to later contexts", "[fastscaling]")
+{
+    Context_free_static_caches ();
+    Context first;
+    Context_initialize (&first);
+    uint8_t * buffer = (uint8_t *)CONTEXT_malloc (&first, 300 * 1000);
+    REQUIRE (buffer != NULL);
+    memset (buffer, 0xAB, 300 * 1000);
+    CONTEXT_free (&first, buffer);
+    Context_terminate (&first);
+    CHECK (BufferPool_idle_bytes () >= 300 * 1000);
+
+    //A slightly smaller request falls in the same size class, and still comes back zeroed
+    Context second;
+    Context_initialize (&second);
+    uint8_t * reused = (uint8_t *)CONTEXT_calloc (&second, 290, 1000);
+    CHECK (reused == buffer);
+    REQUIRE (reused != NULL);
+    bool zeroed = true;
+    for (size_t i = 0; i < 290 * 1000; i++) {
+        zeroed = zeroed && reused[i] == 0;
+    }
+    CHECK (zeroed);
+    CHECK (BufferPool_idle_bytes () == 0);
+
+    //Small allocations bypass the pool
+    void * small = CONTEXT_malloc (&second, 100);
+    REQUIRE (small != NULL);
+    CONTEXT_free (&second, small);
+    CHECK (BufferPool_idle_bytes () == 0);
+
+    //Past the limit, returned buffers are freed
+    BufferPool_set_limit (0);
+    CONTEXT_free (&second, reused);
+    CHECK (BufferPool_idle_bytes () == 0);
+    BufferPool_set_limit (64 * 1024 * 1024);
+
+    //Renders return everything they borrow
+    REQUIRE (render_with_context (&second, Bgra32));
+    const size_t idle = BufferPool_idle_bytes ();
+    CHECK (idle > 0);
+    REQUIRE (render_with_context (&second, Bgra32));
+    CHECK (BufferPool_idle_bytes () == idle);
+    Context_terminate (&second);
+    Context_free_static_caches ();
+    CHECK (BufferPool_idle_bytes () == 0);
+}
+
+TEST_CASE ("Buffer pool trims idle buffers to the recent high-water mark", "[fastscaling]")
+{
+    Context_free_static_caches ();
+    BufferPool_set_trim_window (100);
+    Context context;
+    Context_initialize (&context);
+
+    //A burst that holds four buffers at once keeps all four for the next one
+    void * buffers[4];
+    for (int i = 0; i < 4; i++) {
+        buffers[i] = CONTEXT_malloc (&context, 300 * 1000);
+        REQUIRE (buffers[i] != NULL);
+    }
+    for (int i = 0; i < 4; i++) {
+        CONTEXT_free (&context, buffers[i]);
+    }
+    const size_t burst_idle = BufferPool_idle_bytes ();
+    CHECK (burst_idle >= 4 * 300 * 1000);
+
+    //Two windows later, work that holds one buffer at a time only needs one
+    std::this_thread::sleep_for (std::chrono::milliseconds (250));
+    void * single = CONTEXT_malloc (&context, 300 * 1000);
+    REQUIRE (single != NULL);
+    CONTEXT_free (&context, single);
+    CHECK (BufferPool_idle_bytes () == burst_idle / 4);
+
+    Context_terminate (&context);
+    BufferPool_set_trim_window (5000);
+    Context_free_static_caches ();
+}
+
+TEST_CASE ("Very large buffers are mapped, zeroed, and not pooled", "[fastscaling]")
+{
+    Context_free_static_caches ();
+    Context context;
+    Context_initialize (&context);
+    const size_t size = 80 * 1024 * 1024;
+    uint8_t * buffer = (uint8_t *)CONTEXT_calloc (&context, size, 1);
+    REQUIRE (buffer != NULL);
+    CHECK (BufferPool_is_mapped (buffer));
+    CHECK (((uintptr_t)buffer % 64) == 0);
+    bool zeroed = true;
+    for (size_t i = 0; i < size; i += 4093) {
+        zeroed = zeroed && buffer[i] == 0;
+    }
+    CHECK (zeroed);
+    CHECK (buffer[size - 1] == 0);
+    memset (buffer, 0xAB, size);
+    CONTEXT_free (&context, buffer);
+    CHECK (BufferPool_idle_bytes () == 0);
+
+    //A source this large lands in a mapped bitmap
+    BitmapBgra * b = BitmapBgra_create (&context, 5000, 5000, false, Bgra32);
+    REQUIRE (b != NULL);
+    CHECK (BufferPool_is_mapped (b->pixels));
+    b->pixels[b->stride * b->h - 1] = 1;
+    BitmapBgra_destroy (&context, b);
+
+    //Smaller buffers are not
+    void * pooled = CONTEXT_malloc (&context, 1024 * 1024);
+    REQUIRE (pooled != NULL);
+    CHECK_FALSE (BufferPool_is_mapped (pooled));
+    CONTEXT_free (&context, pooled);
+    Context_terminate (&context);
+    Context_free_static_caches ();
+}
+
+TEST_CASE ("Memory statistics attribute allocations to their source lines", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    MemoryStats stats;
+    Context_get_memory_stats (&context, &stats);
+    CHECK (stats.current_bytes == 0);
+    CHECK (stats.allocation_count == 0);
+
+    void * blocks[300];
+    const int block_line = __LINE__ + 2;
+    for (int i = 0; i < 300; i++) {
+        blocks[i] = CONTEXT_malloc (&context, 1000 + i);
+        REQUIRE (blocks[i] != NULL);
+    }
+    const int large_line = __LINE__ + 1;
+    void * large = CONTEXT_calloc (&context, 1000, 1000);
+    REQUIRE (large != NULL);
+    const size_t block_bytes = 300 * 1000 + 299 * 300 / 2;
+    Context_get_memory_stats (&context, &stats);
+    CHECK (stats.current_bytes == block_bytes + 1000 * 1000);
+    CHECK (stats.peak_bytes == stats.current_bytes);
+    CHECK (stats.allocation_count == 301);
+    CHECK (stats.live_allocation_count == 301);
+    CHECK (stats.largest_allocation == 1000 * 1000);
+
+    //Free in an order that exercises the table's deletion
+    for (int i = 0; i < 300; i += 2) {
+        CONTEXT_free (&context, blocks[i]);
+    }
+    for (int i = 1; i < 300; i += 2) {
+        CONTEXT_free (&context, blocks[i]);
+    }
+    Context_get_memory_stats (&context, &stats);
+    CHECK (stats.current_bytes == 1000 * 1000);
+    CHECK (stats.peak_bytes == block_bytes + 1000 * 1000);
+    CHECK (stats.live_allocation_count == 1);
+
+    MemorySiteStats sites[8];
+    const uint32_t site_count = Context_get_memory_sites (&context, sites, 8);
+    REQUIRE (site_count == 2);
+    CHECK (sites[0].line == block_line);
+    CHECK (strstr (sites[0].file, "test.cpp") != NULL);
+    CHECK (sites[0].current_bytes == 0);
+    CHECK (sites[0].peak_bytes == block_bytes);
+    CHECK (sites[0].allocation_count == 300);
+    CHECK (sites[1].line == large_line);
+    CHECK (sites[1].current_bytes == 1000 * 1000);
+
+    Context_reset_memory_peak (&context);
+    Context_get_memory_stats (&context, &stats);
+    CHECK (stats.peak_bytes == 1000 * 1000);
+    CONTEXT_free (&context, large);
+
+    //A render frees everything it allocates, and its peak is recorded
+    REQUIRE (render_with_context (&context, Bgra32));
+    Context_get_memory_stats (&context, &stats);
+    CHECK (stats.current_bytes == 0);
+    CHECK (stats.live_allocation_count == 0);
+    CHECK (stats.peak_bytes > 150 * 200 * 4);
+    Context_terminate (&context);
+
+    //Arena resets release everything at once
+    Context arena;
+    Context_initialize (&arena);
+    REQUIRE (Context_use_arena_heap (&arena, 0));
+    REQUIRE (CONTEXT_malloc (&arena, 5000) != NULL);
+    Context_get_memory_stats (&arena, &stats);
+    CHECK (stats.current_bytes == 5000);
+    Context_reset_arena_heap (&arena);
+    Context_get_memory_stats (&arena, &stats);
+    CHECK (stats.current_bytes == 0);
+    CHECK (stats.live_allocation_count == 0);
+    CHECK (stats.peak_bytes == 5000);
+    Context_terminate (&arena);
+}
+
+TEST_CASE ("Stage timers total every batch of a render", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    StageTimer timers[STAGE_TIMERS_MAX];
+    //Disabled by default
+    REQUIRE (render_with_context (&context, Bgra32));
+    CHECK (Context_get_stage_timers (&context, timers, STAGE_TIMERS_MAX) == 0);
+
+    Context_enable_stage_timers (&context, true);
+    REQUIRE (render_with_context (&context, Bgra32));
+    const uint32_t count = Context_get_stage_timers (&context, timers, STAGE_TIMERS_MAX);
+    REQUIRE (count > 4);
+    const StageTimer * render = NULL;
+    const StageTimer * scale = NULL;
+    for (uint32_t i = 0; i < count; i++) {
+        REQUIRE (timers[i].name != NULL);
+        if (strcmp (timers[i].name, "perform_render") == 0) render = &timers[i];
+        if (strcmp (timers[i].name, "ScaleBgraFloatRows") == 0) scale = &timers[i];
+    }
+    REQUIRE (render != NULL);
+    REQUIRE (scale != NULL);
+    CHECK (render->calls == 1);
+    CHECK (render->nanoseconds > 0);
+    CHECK (scale->nanoseconds <= render->nanoseconds);
+    //Scaled 4 rows at a time: 300 rows of 400 pixels, then the 200 rows of 300 kept from transposing
+    CHECK (scale->calls == 75 + 50);
+    CHECK (scale->pixels == 400 * 300 + 300 * 200);
+    CHECK (scale->bytes == scale->pixels * 4 * sizeof (float));
+
+    //Totals accumulate across renders until reset
+    REQUIRE (render_with_context (&context, Bgra32));
+    Context_get_stage_timers (&context, timers, STAGE_TIMERS_MAX);
+    CHECK (render->calls == 2);
+    CHECK (scale->pixels == 2 * (400 * 300 + 300 * 200));
+
+    char summary[4096];
+    Context_stage_timers_summary (&context, summary, sizeof (summary));
+    CHECK (strstr (summary, "ScaleBgraFloatRows: 250 calls") != NULL);
+    //Truncates rather than overflowing
+    char small[40];
+    Context_stage_timers_summary (&context, small, sizeof (small));
+    CHECK (strlen (small) < sizeof (small));
+
+    Context_reset_stage_timers (&context);
+    CHECK (Context_get_stage_timers (&context, timers, STAGE_TIMERS_MAX) == 0);
+
+    //In-place renders can enable the profiling log too
+    BitmapBgra * bitmap = BitmapBgra_create (&context, 60, 40, true, Bgra32);
+    RenderDetails * details = RenderDetails_create (&context);
+    REQUIRE (bitmap != NULL);
+    REQUIRE (details != NULL);
+    details->enable_profiling = true;
+    details->sharpen_percent_goal = 10;
+    CHECK (RenderDetails_render_in_place (&context, details, bitmap));
+    CHECK (Context_get_profiler_log (&context)->count > 0);
+    CHECK (Context_get_stage_timers (&context, timers, STAGE_TIMERS_MAX) > 0);
+    RenderDetails_destroy (&context, details);
+    BitmapBgra_destroy (&context, bitmap);
+    Context_terminate (&context);
+}
+
+TEST_CASE ("Created bitmaps have aligned rows", "[fastscaling]")
+{
+    Context context;
+    Context_initialize (&context);
+    for (int arena = 0; arena < 2; arena++) {
+        if (arena == 1) {
+            REQUIRE (Context_use_arena_heap (&context, 64 * 1024));
+        }
+        //Narrow, cache-line multiple, 4KB multiple, and dedicated-chunk sizes
+        const int widths[] = { 1, 13, 16, 128, 1024, 3000 };
+        for (size_t i = 0; i < sizeof (widths) / sizeof (int); i++) {
+            const BitmapPixelFormat formats[] = { Gray8, Bgr24, Bgra32 };
+            for (size_t f = 0; f < 3; f++) {
+                const uint32_t bpp = BitmapPixelFormat_bytes_per_pixel (formats[f]);
+                BitmapBgra * b = BitmapBgra_create (&context, widths[i], 7, i % 2 == 0, formats[f]);
+                REQUIRE (b != NULL);
+                CHECK (((uintptr_t)b->pixels % 64) == 0);
+                CHECK ((b->stride % 64) == 0);
+                CHECK ((b->stride % 512) != 0);
+                CHECK (b->stride >= b->w * bpp);
+                BitmapBgra_destroy (&context, b);
+            }
+            for (int channels = 3; channels <= 4; channels++) {
+                BitmapFloat * f = BitmapFloat_create (&context, widths[i], 5, channels, i % 2 == 1);
+                REQUIRE (f != NULL);
+                const size_t stride_bytes = f->float_stride * sizeof (float);
+                CHECK (((uintptr_t)f->pixels % 64) == 0);
+                CHECK ((stride_bytes % 64) == 0);
+                CHECK ((stride_bytes % 512) != 0);
+                CHECK (f->float_stride >= f->w * channels);
+                CHECK (f->float_count == f->float_stride * f->h);
+                BitmapFloat_destroy (&context, f);
+            }
+        }
+    }
+    //Padded rows render the same as before
+    REQUIRE (render_with_context (&context, Bgra32));
+    REQUIRE (render_with_context (&context, Bgr24));
+    Context_terminate (&context);
+}
+
 /*/ segfaults the process if you uncomment this
 TEST_CASE ("Trim whitespace in 32-bit image", "[fastscaling]") {
     BitmapBgra* b = create_bitmap_bgra (200, 150, true, Bgra32);
@@ -177,6 +1451,40 @@ TEST_CASE("Test contrib windows", "[fastscaling]")
     Context_terminate(&context);
 }
 
+TEST_CASE("Sharpened contribution weights sum to 1", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    InterpolationDetails * details = InterpolationDetails_create_from(&context, Filter_Robidoux);
+    REQUIRE(details != NULL);
+    //Robidoux's own negative lobe is about 1%; larger goals add to it, and from 100% no negative lobe can be balanced
+    const float goals[] = { 0, 20, 50, 99, 100, 150 };
+    const uint32_t sizes[][2] = { { 97, 400 }, { 400, 97 }, { 100, 100 } };
+    for (size_t g = 0; g < sizeof(goals) / sizeof(goals[0]); g++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            details->sharpen_percent_goal = goals[g];
+            LineContributions * contributions = LineContributions_create(&context, sizes[s][0], sizes[s][1], details);
+            REQUIRE(contributions != NULL);
+            //Float weights are rounded relative to their own size, and near 100% both lobes are large
+            double worst_relative_error = 0;
+            for (uint32_t u = 0; u < contributions->LineLength; u++) {
+                double sum = 0;
+                double absolute_sum = 0;
+                for (int i = 0; i <= contributions->ContribRow[u].Right - contributions->ContribRow[u].Left; i++) {
+                    sum += contributions->ContribRow[u].Weights[i];
+                    absolute_sum += fabs(contributions->ContribRow[u].Weights[i]);
+                }
+                worst_relative_error = fmax(worst_relative_error, fabs(sum - 1) / absolute_sum);
+            }
+            INFO("sharpen_percent_goal " << goals[g] << ", " << sizes[s][1] << " -> " << sizes[s][0]);
+            CHECK(worst_relative_error < 1e-6);
+            LineContributions_destroy(&context, contributions);
+        }
+    }
+    InterpolationDetails_destroy(&context, details);
+    Context_terminate(&context);
+}
+
 TEST_CASE("Test Weighting", "[fastscaling]")
 {
 
@@ -238,6 +1546,232 @@ TEST_CASE("Test Weighting", "[fastscaling]")
 
 
 
+TEST_CASE("Tabulated sRGB encoding matches pow", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+
+    const float gammas[] = { 0, 1.8f, 2.2f, 2.6f };
+    //The measured errors documented with FLOATSPACE_TO_BYTE_TABLE_SIZE, rounded up
+    const double error_bounds[] = { 0.005, 0.05, 0.11, 0.17 };
+    for (size_t g = 0; g < sizeof(gammas) / sizeof(float); g++) {
+        if (gammas[g] == 0) {
+            Context_set_floatspace(&context, Floatspace_linear, 0, 0, 0);
+        } else {
+            Context_set_floatspace(&context, Floatspace_gamma, gammas[g], 0, 0);
+        }
+        double max_error = 0;
+        int max_byte_error = 0;
+        for (uint32_t i = 0; i <= (1 << 20); i++) {
+            const float v = (float)i / (float)(1 << 20);
+            const double exact = gammas[g] == 0 ? (v <= 0.0031308 ? 12.92 * v : 1.055 * pow(v, 1 / 2.4) - 0.055) * 255 : pow(v, 1.0 / gammas[g]) * 255;
+            max_error = fmax(max_error, fabs(Context_floatspace_to_srgb_tabulated(&context, v) - exact));
+            max_byte_error = int_max(max_byte_error, abs((int)Context_floatspace_to_byte(&context, v) - (int)floor(exact + 0.5)));
+        }
+        CAPTURE(gammas[g]);
+        CHECK(max_error < error_bounds[g]);
+        CHECK(max_byte_error <= 1);
+        CHECK(Context_floatspace_to_byte(&context, -0.5f) == 0);
+        CHECK(Context_floatspace_to_byte(&context, 1.5f) == 255);
+        CHECK(Context_floatspace_to_byte(&context, NAN) == 0);
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Tabulated filters match direct evaluation", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+
+    for (int f = 1; f <= 30; f++) {
+        InterpolationDetails * details = InterpolationDetails_create_from(&context, (InterpolationFilter)f);
+        REQUIRE(details != NULL);
+        REQUIRE(InterpolationDetails_prepare_table(&context, details));
+        if (InterpolationDetails_table_is_current(details)) {
+            //Linear interpolation is exact to ~1e-7 except across the kink where a filter is cut off at its window
+            const double extent = details->window + 3;
+            double max_error = 0;
+            for (double x = -extent; x <= extent; x += 0.0013) {
+                max_error = fmax(max_error, fabs(InterpolationDetails_evaluate_tabulated(details, x) - details->filter(details, x)));
+            }
+            CAPTURE(f);
+            CHECK(max_error < 0.0002);
+            //Changing the details afterwards must invalidate the table
+            details->blur *= 0.9;
+            CHECK_FALSE(InterpolationDetails_table_is_current(details));
+        }
+        InterpolationDetails_destroy(&context, details);
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Specialized filters match generic evaluation", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+
+    struct { InterpolationFilter filter; double B; double C; } cubics[] = {
+        { Filter_Robidoux, 0.37821575509399867, 0.31089212245300067 },
+        { Filter_RobidouxSharp, 0.2620145123990142, 0.3689927438004929 },
+        { Filter_CatmullRom, 0, 0.5 },
+        { Filter_Mitchell, 1.0 / 3.0, 1.0 / 3.0 },
+        { Filter_Cubic, 0, 1 },
+        { Filter_CubicBSpline, 1, 0 },
+        { Filter_Hermite, 0, 0 },
+    };
+    for (size_t f = 0; f < sizeof(cubics) / sizeof(cubics[0]); f++) {
+        InterpolationDetails * specialized = InterpolationDetails_create_from(&context, cubics[f].filter);
+        REQUIRE(specialized != NULL);
+        InterpolationDetails * generic = InterpolationDetails_create_bicubic_custom(&context, specialized->window, 0.9, cubics[f].B, cubics[f].C);
+        REQUIRE(generic != NULL);
+        specialized->blur = 0.9;
+        CAPTURE(cubics[f].filter);
+        for (double x = -3; x <= 3; x += 0.01) {
+            REQUIRE(specialized->filter(specialized, x) == generic->filter(generic, x));
+        }
+        InterpolationDetails_destroy(&context, specialized);
+        InterpolationDetails_destroy(&context, generic);
+    }
+
+    //Lanczos is specialized for a window of 3, but must honor an overridden window
+    InterpolationDetails * lanczos = InterpolationDetails_create_from(&context, Filter_Lanczos);
+    InterpolationDetails * lanczos_generic = InterpolationDetails_create_from(&context, Filter_Lanczos2);
+    REQUIRE(lanczos != NULL);
+    REQUIRE(lanczos_generic != NULL);
+    lanczos->window = 2;
+    for (double x = -4; x <= 4; x += 0.01) {
+        REQUIRE(lanczos->filter(lanczos, x) == lanczos_generic->filter(lanczos_generic, x));
+    }
+    LineContributions * overridden = LineContributions_create(&context, 30, 100, lanczos);
+    LineContributions * expected = LineContributions_create(&context, 30, 100, lanczos_generic);
+    REQUIRE(overridden != NULL);
+    REQUIRE(expected != NULL);
+    for (uint32_t u = 0; u < expected->LineLength; u++) {
+        REQUIRE(overridden->ContribRow[u].Left == expected->ContribRow[u].Left);
+        REQUIRE(overridden->ContribRow[u].Right == expected->ContribRow[u].Right);
+        REQUIRE(overridden->ContribRow[u].Weights[0] == expected->ContribRow[u].Weights[0]);
+    }
+    LineContributions_destroy(&context, overridden);
+    LineContributions_destroy(&context, expected);
+    InterpolationDetails_destroy(&context, lanczos);
+    InterpolationDetails_destroy(&context, lanczos_generic);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Cached contributions are shared and match fresh ones", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    InterpolationDetails * details = InterpolationDetails_create_from(&context, Filter_Robidoux);
+    REQUIRE(details != NULL);
+
+    LineContributions * fresh = LineContributions_create(&context, 97, 400, details);
+    LineContributions * first = LineContributions_acquire(&context, 97, 400, details);
+    LineContributions * second = LineContributions_acquire(&context, 97, 400, details);
+    REQUIRE(fresh != NULL);
+    REQUIRE(first != NULL);
+    CHECK(first == second);
+    CHECK(first->percent_negative == fresh->percent_negative);
+    for (uint32_t u = 0; u < fresh->LineLength; u++) {
+        REQUIRE(first->ContribRow[u].Left == fresh->ContribRow[u].Left);
+        REQUIRE(first->ContribRow[u].Right == fresh->ContribRow[u].Right);
+        for (int i = 0; i <= fresh->ContribRow[u].Right - fresh->ContribRow[u].Left; i++) {
+            REQUIRE(first->ContribRow[u].Weights[i] == fresh->ContribRow[u].Weights[i]);
+        }
+    }
+
+    details->sharpen_percent_goal = 20;
+    LineContributions * sharpened = LineContributions_acquire(&context, 97, 400, details);
+    CHECK(sharpened != first);
+
+    //Clearing the cache must not free contributions that are still in use
+    Context_free_static_caches();
+    CHECK(first->ContribRow[0].Left == fresh->ContribRow[0].Left);
+    LineContributions_release(&context, sharpened);
+    LineContributions_release(&context, second);
+    LineContributions_release(&context, first);
+
+    LineContributions_set_cache_limit(0);
+    first = LineContributions_acquire(&context, 97, 400, details);
+    second = LineContributions_acquire(&context, 97, 400, details);
+    CHECK(first != second);
+    LineContributions_release(&context, first);
+    LineContributions_release(&context, second);
+    LineContributions_set_cache_limit(16 * 1024 * 1024);
+
+    LineContributions_destroy(&context, fresh);
+    InterpolationDetails_destroy(&context, details);
+    Context_terminate(&context);
+}
+
+
+struct ContributionsChurn {
+    uint32_t seed;
+    bool failed;
+};
+
+//Each thread asks for a rotating set of contributions, more than the cache holds, so entries are evicted while others
+//are still being looked up or held
+static void churn_contributions(void * arg)
+{
+    ContributionsChurn * churn = (ContributionsChurn *)arg;
+    Context context;
+    Context_initialize(&context);
+    InterpolationDetails * details = InterpolationDetails_create_from(&context, Filter_Robidoux);
+    for (uint32_t i = 0; i < 500 && details != NULL; i++) {
+        const uint32_t output_size = 20 + (i * 7 + churn->seed) % 12;
+        LineContributions * contributions = LineContributions_acquire(&context, output_size, 100, details);
+        if (contributions == NULL || contributions->LineLength != output_size || contributions->ContribRow[0].Left != 0) {
+            churn->failed = true;
+        }
+        LineContributions_release(&context, contributions);
+    }
+    churn->failed = churn->failed || details == NULL;
+    InterpolationDetails_destroy(&context, details);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Evicted contributions are freed once no thread can reach them", "[fastscaling]")
+{
+    LineContributions_clear_cache();
+    //A few entries' worth
+    LineContributions_set_cache_limit(8 * 1024);
+
+    const uint32_t thread_count = 4;
+    Thread threads[thread_count];
+    bool started[thread_count];
+    ContributionsChurn churns[thread_count];
+    for (uint32_t i = 0; i < thread_count; i++) {
+        churns[i].seed = i * 5;
+        churns[i].failed = false;
+        started[i] = Thread_start(&threads[i], churn_contributions, &churns[i]);
+    }
+    for (uint32_t i = 0; i < thread_count; i++) {
+        if (started[i]) {
+            Thread_join(&threads[i]);
+        } else {
+            churn_contributions(&churns[i]);
+        }
+        CHECK_FALSE(churns[i].failed);
+    }
+    CHECK(LineContributions_retired_bytes() == 0);
+
+    //Evicted while held, then freed by the release
+    Context context;
+    Context_initialize(&context);
+    InterpolationDetails * details = InterpolationDetails_create_from(&context, Filter_Robidoux);
+    LineContributions * held = LineContributions_acquire(&context, 25, 100, details);
+    REQUIRE(held != NULL);
+    LineContributions_clear_cache();
+    CHECK(LineContributions_retired_bytes() > 0);
+    LineContributions_release(&context, held);
+    CHECK(LineContributions_retired_bytes() == 0);
+
+    LineContributions_set_cache_limit(16 * 1024 * 1024);
+    InterpolationDetails_destroy(&context, details);
+    Context_terminate(&context);
+}
+
 TEST_CASE("Test Linear RGB 000 -> LUV ", "[fastscaling]")
 {
     float bgra[4] = { 0, 0, 0, 0 };
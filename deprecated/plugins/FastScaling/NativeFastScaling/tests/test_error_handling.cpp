@@ -236,6 +236,31 @@ TEST_CASE_METHOD(Fixture, "Creating BitmapBgra", "[error_handling]")
         REQUIRE(Context_error_reason(&context) == Out_of_memory);
     }
     BitmapBgra_destroy(&context,source);
+    Context_terminate(&context);
+}
+
+TEST_CASE_METHOD(Fixture, "Creating BitmapFloat", "[error_handling]")
+{
+    Context context;
+    Context_initialize(&context);
+    initialize_heap(&context);
+    BitmapFloat * source = NULL;
+    SECTION("A gargantuan bitmap is invalid") {
+        source = BitmapFloat_create(&context, 300000000, 1, 4, false);
+        REQUIRE(source == NULL);
+        REQUIRE(Context_has_error(&context));
+        REQUIRE(Context_error_reason(&context) == Invalid_BitmapFloat_dimensions);
+    }
+    SECTION("A row too wide to pad is invalid") {
+        //Valid dimensions, but with this many channels the byte stride doesn't fit in 32 bits, and mustn't wrap around
+        //to a small allocation
+        source = BitmapFloat_create(&context, 100000000, 1, 16, false);
+        REQUIRE(source == NULL);
+        REQUIRE(Context_has_error(&context));
+        REQUIRE(Context_error_reason(&context) == Invalid_BitmapFloat_dimensions);
+    }
+    BitmapFloat_destroy(&context, source);
+    Context_terminate(&context);
 }
 
 TEST_CASE("Context", "[error_handling]")
@@ -260,10 +285,10 @@ TEST_CASE("Argument checking for convert_sgrp_to_linear", "[error_handling]")
     CAPTURE(Context_error_message(&context, error_msg, sizeof error_msg));
     REQUIRE(src != NULL);
     BitmapFloat * dest = BitmapFloat_create(&context,1, 1, 4, false);
-    BitmapBgra_convert_srgb_to_linear(&context, src, 3, dest, 0, 0);
+    BitmapBgra_convert_srgb_to_linear(&context, src, 3, dest, 0, 0, NULL);
     BitmapBgra_destroy(&context,src);
     CAPTURE(*dest);
-    REQUIRE(dest->float_count == 4); // 1x1x4 channels
+    REQUIRE(dest->float_count == 16); // 1x1x4 channels, padded to 64 bytes
     BitmapFloat_destroy(&context,dest);
     Context_terminate (&context);
 }
@@ -39,6 +39,17 @@ namespace ImageResizer{
 
                 public ref class WrappedBitmap{
                 public:
+                    //8-bit indexed bitmaps whose palette is the identity gray ramp can be processed as Gray8
+                    static bool HasGrayRampPalette (Bitmap^ b){
+                        if (b->PixelFormat != PixelFormat::Format8bppIndexed) return false;
+                        array<Color>^ entries = b->Palette->Entries;
+                        if (entries->Length != 256) return false;
+                        for (int i = 0; i < 256; i++){
+                            if (entries[i].R != i || entries[i].G != i || entries[i].B != i) return false;
+                        }
+                        return true;
+                    }
+
                     BitmapOptions^ options;
                     Bitmap^ underlying_bitmap;
                     BitmapData^ locked_bitmap_data;
@@ -53,7 +64,8 @@ namespace ImageResizer{
                         PixelFormat format = opts->Bitmap->PixelFormat;
 
                         bool hasAlpha = format == PixelFormat::Format32bppArgb || format == PixelFormat::Format32bppPArgb;
-                        if (!hasAlpha && format != PixelFormat::Format32bppRgb && format != PixelFormat::Format24bppRgb){
+                        bool isGray = HasGrayRampPalette (source);
+                        if (!hasAlpha && !isGray && format != PixelFormat::Format32bppRgb && format != PixelFormat::Format24bppRgb){
                             throw gcnew ArgumentOutOfRangeException ("source", "Invalid pixel format " + source->PixelFormat.ToString ());
                         }
 
@@ -72,7 +84,7 @@ namespace ImageResizer{
 
                         //LockBits handles cropping for us.
                         this->locked_bitmap_data = source->LockBits (from, opts->Readonly ? ImageLockMode::ReadOnly : ImageLockMode::ReadWrite, source->PixelFormat);
-                        im->fmt = hasAlpha ? Bgra32 : Bgr24;
+                        im->fmt = hasAlpha ? Bgra32 : (isGray ? Gray8 : Bgr24);
                         im->pixels = (unsigned char *)safe_cast<void *>(this->locked_bitmap_data->Scan0);
                         im->stride = this->locked_bitmap_data->Stride;
 
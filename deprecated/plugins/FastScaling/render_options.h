@@ -63,6 +63,10 @@ namespace ImageResizer{
                     property float SharpeningPercentGoal;
                     property float MinSamplingWindowToIntegrateSharpening;
 
+                    property float UnsharpSigma;
+                    property float UnsharpAmount;
+                    property float UnsharpThreshold;
+
                     property array<array<float, 1>^, 1>^ ColorMatrix;
 
                     // If possible to do correctly, halve the image until it is [halve_until] times larger than needed. 3 or greater recommended. Specify -1 to disable halving.
@@ -70,6 +70,9 @@ namespace ImageResizer{
                         to->post_flip_y = from->RequiresVerticalFlipStep;
                         to->halving_acceptable_pixel_loss = from->HalvingAcceptablePixelLoss;
                         to->sharpen_percent_goal = from->SharpeningPercentGoal;
+                        to->unsharp_sigma = from->UnsharpSigma;
+                        to->unsharp_amount = from->UnsharpAmount;
+                        to->unsharp_threshold = from->UnsharpThreshold;
 
                         to->kernel_a = from->KernelA_Struct != nullptr ? from->KernelA_Struct :
                             from->KernelA != nullptr ? CopyKernel (from->KernelA) : nullptr;